@@ -0,0 +1,236 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include "vm.h"
+
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* NOTE: VMs are carved out of 2 MiB regions so each one sits inside a single
+ * hugepage-backed mapping, and released VMs are recycled through a free list
+ * instead of going back to `malloc`. Each NUMA node has its own arena, and
+ * regions are bound to the node of the thread that first asks for them. */
+#define REGION_SIZE (1 << 21)
+#define HOST_PAGE   (1 << 12)
+#define SLOT_SIZE   ((sizeof(Vm) + HOST_PAGE - 1) & ~(usize)(HOST_PAGE - 1))
+#define NODE_CAP    64
+
+/* NOTE: Matches `MPOL_PREFERRED` in `numaif.h`; `mbind` is called through
+ * `syscall` so there is no dependency on libnuma. */
+#define POLICY_PREFERRED 1
+
+typedef struct Slot Slot;
+
+struct Slot {
+    Slot* next;
+};
+
+typedef struct Arena Arena;
+
+/* NOTE: The first host page of every region holds its header, which is how a
+ * released VM finds the arena it came from. `huge` is set if the region is
+ * one hugetlb page, which can only be given back whole. */
+typedef struct {
+    Arena* arena;
+    Bool   huge;
+} Region;
+
+struct Arena {
+    pthread_mutex_t lock;
+    u8*             region;
+    usize           used;
+    Slot*           free;
+    u32             node;
+};
+
+static Arena ARENAS[NODE_CAP];
+
+static pthread_once_t ARENAS_ONCE = PTHREAD_ONCE_INIT;
+
+static void set_arenas(void) {
+    for (u32 i = 0; i < NODE_CAP; ++i) {
+        pthread_mutex_init(&ARENAS[i].lock, NULL);
+        ARENAS[i].node = i;
+    }
+}
+
+static u8* get_region(u32 node) {
+    u8* region = mmap(NULL,
+                      REGION_SIZE,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                      -1,
+                      0);
+    if (region == MAP_FAILED) {
+        /* NOTE: No reserved hugepages, so over-allocate to get a 2 MiB
+         * aligned range and ask for transparent hugepages instead. */
+        u8* base = mmap(NULL,
+                        REGION_SIZE * 2,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1,
+                        0);
+        if (base == MAP_FAILED) {
+            exit(EXIT_FAILURE);
+        }
+        region = (u8*)(((usize)base + REGION_SIZE - 1) &
+                       ~(usize)(REGION_SIZE - 1));
+        if (base < region) {
+            munmap(base, (usize)(region - base));
+        }
+        munmap(region + REGION_SIZE,
+               (usize)((base + (REGION_SIZE * 2)) - (region + REGION_SIZE)));
+        madvise(region, REGION_SIZE, MADV_HUGEPAGE);
+        ((Region*)(void*)region)->huge = FALSE;
+    } else {
+        ((Region*)(void*)region)->huge = TRUE;
+    }
+    u64 mask = 1llu << node;
+    syscall(SYS_mbind,
+            region,
+            REGION_SIZE,
+            POLICY_PREFERRED,
+            &mask,
+            (u64)NODE_CAP,
+            0);
+    return region;
+}
+
+static Vm* get_vm(void) {
+    pthread_once(&ARENAS_ONCE, set_arenas);
+    u32 cpu = 0;
+    u32 node = 0;
+    if (getcpu(&cpu, &node) || (NODE_CAP <= node)) {
+        node = 0;
+    }
+    Arena* arena = &ARENAS[node];
+    pthread_mutex_lock(&arena->lock);
+    Vm* vm;
+    if (arena->free) {
+        vm = (Vm*)(void*)arena->free;
+        arena->free = arena->free->next;
+    } else {
+        if ((arena->region == NULL) ||
+            (REGION_SIZE < (arena->used + SLOT_SIZE)))
+        {
+            arena->region = get_region(node);
+            ((Region*)(void*)arena->region)->arena = arena;
+            arena->used = HOST_PAGE;
+        }
+        vm = (Vm*)(void*)(arena->region + arena->used);
+        arena->used += SLOT_SIZE;
+    }
+    pthread_mutex_unlock(&arena->lock);
+    /* NOTE: Everything but `memory` is cleared here, which keeps recycling
+     * O(1); `set_vm` fills in memory from the image. */
+    memset((u8*)vm + offsetof(Vm, mem), 0, sizeof(Vm) - offsetof(Vm, mem));
+    vm->mem = vm->memory;
+    vm->core_count = 1;
+    vm->refs = 1;
+    set_device_pages(vm);
+    return vm;
+}
+
+static Region* get_vm_region(const Vm* vm) {
+    return (Region*)((usize)vm & ~(usize)(REGION_SIZE - 1));
+}
+
+static const u16 ZERO_PAGE[PAGE_SIZE];
+
+/* NOTE: Gives as much of an idle VM's memory back to the host as it can.
+ * Pages the guest has not stored to are read from the image again, and
+ * pages of nothing but zeros from `ZERO_PAGE`, both the way a fork reads
+ * its parent (`PAGE_SHARED`); any other page that packs down to less than
+ * half its size is packed. Nothing is lost by packing: every page comes
+ * back the first time anything reads or stores to it. Once every VM page
+ * on a host page is elsewhere the host page is released, and faults back
+ * in as zeros when one of them comes back. A hugetlb region cannot give
+ * back less than all of it, so packing one only moves pages elsewhere.
+ *
+ * Frozen pages are left alone, since forks read them in place, and so are
+ * device pages. A VM sharing its memory with other cores must not be
+ * packed, nor one whose memory is being read on another thread. Returns
+ * the number of bytes now held in packs, and sets `released` to the
+ * number of bytes this call gave back to the host. */
+static usize do_pack_vm(Vm* vm, usize* released) {
+    usize held = 0;
+    u64   moved[PAGE_COUNT / 64] = {0};
+    for (u32 i = 0; i < PAGE_COUNT; ++i) {
+        const u8 page = (u8)i;
+        if (vm->pages[page] & PAGE_PACKED) {
+            held += malloc_usable_size(vm->packs[page]);
+            continue;
+        }
+        if (vm->pages[page] & (PAGE_SHARED | PAGE_FROZEN | PAGE_DEVICE)) {
+            continue;
+        }
+        const u16* words = &vm->mem[page << PAGE_BITS];
+        const u16* base = &vm->image->mem[page << PAGE_BITS];
+        if (!(vm->pages[page] & PAGE_DIRTY) ||
+            !memcmp(words, base, PAGE_SIZE * sizeof(u16)))
+        {
+            vm->sources[page] = base;
+            vm->pages[page] |= PAGE_SHARED;
+            moved[page >> 6] |= 1llu << (page & 0x3F);
+            continue;
+        }
+        if (!memcmp(words, ZERO_PAGE, sizeof(ZERO_PAGE))) {
+            vm->sources[page] = ZERO_PAGE;
+            vm->pages[page] |= PAGE_SHARED;
+            moved[page >> 6] |= 1llu << (page & 0x3F);
+            continue;
+        }
+        u16       packed[PAGE_SIZE / 2];
+        const u32 len =
+            get_packed(words, base, PAGE_SIZE, packed, PAGE_SIZE / 2);
+        if (len == 0) {
+            continue;
+        }
+        vm->packs[page] = malloc(len * sizeof(u16));
+        if (vm->packs[page] == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        memcpy(vm->packs[page], packed, len * sizeof(u16));
+        vm->pages[page] |= PAGE_PACKED;
+        moved[page >> 6] |= 1llu << (page & 0x3F);
+        held += malloc_usable_size(vm->packs[page]);
+    }
+    /* NOTE: A host page is only counted when one of its pages moved on this
+     * call; otherwise an earlier call already gave it back. */
+    *released = 0;
+    const u32 span = HOST_PAGE / (PAGE_SIZE * sizeof(u16));
+    for (u32 i = 0; (i < PAGE_COUNT) && !get_vm_region(vm)->huge; i += span) {
+        u32  j = 0;
+        Bool fresh = FALSE;
+        for (; (j < span) && (vm->pages[i + j] & (PAGE_SHARED | PAGE_PACKED));
+             ++j)
+        {
+            fresh = fresh || ((moved[(i + j) >> 6] >> ((i + j) & 0x3F)) & 1);
+        }
+        if ((j == span) && fresh &&
+            !madvise(&vm->memory[i << PAGE_BITS], HOST_PAGE, MADV_DONTNEED))
+        {
+            *released += HOST_PAGE;
+        }
+    }
+    return held;
+}
+
+static void do_free_vm(Vm* vm) {
+    for (u32 i = 0; i < PAGE_COUNT; ++i) {
+        free(vm->packs[i]);
+        vm->packs[i] = NULL;
+    }
+    Arena* arena = get_vm_region(vm)->arena;
+    Slot*  slot = (Slot*)(void*)vm;
+    pthread_mutex_lock(&arena->lock);
+    slot->next = arena->free;
+    arena->free = slot;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+#endif
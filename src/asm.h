@@ -0,0 +1,691 @@
+#ifndef __ASM_H__
+#define __ASM_H__
+
+#include "encode.h"
+
+#include <string.h>
+
+/* NOTE: A one-pass assembler for LC-3 source, writing words straight into
+ * a 64K-word `mem` (an `Image`'s, usually) so nothing goes through an
+ * `.obj`. A label used before it is defined is encoded with a zero offset
+ * and the word is chained onto the label's entry in the symbol table, to be
+ * patched once the label turns up. The table is open addressed over `slots`
+ * (indices into `symbols`, plus one), which keeps probing within a few
+ * cache lines even for tens of thousands of labels.
+ *
+ * Lines are `[label[:]] [mnemonic operands] [; comment]`. Mnemonics,
+ * directives (`.ORIG`, `.FILL`, `.BLKW`, `.STRINGZ`, `.END`), registers and
+ * the trap aliases (`GETC`, `OUT`, `PUTS`, `IN`, `PUTSP`, `HALT`) are
+ * case-insensitive; labels are not. Numbers are `#` decimal, `x` hex, or
+ * plain decimal. An `Assembler` can be used again and again, and keeps its
+ * tables between uses. */
+#define ASM_MEM_SIZE   (U16_MAX + 1)
+#define ASM_SYMBOL_CAP (1 << 10)
+#define ASM_FIXUP_CAP  (1 << 10)
+
+typedef enum {
+    FIX_PC_OFFSET_9 = 0,
+    FIX_PC_OFFSET_11,
+    FIX_WORD,
+} FixKind;
+
+/* NOTE: `next` (and `Symbol::fixups`) are indices plus one, so `0` ends a
+ * chain. */
+typedef struct {
+    u32     next;
+    u32     line;
+    u16     address;
+    FixKind kind;
+} Fixup;
+
+typedef struct {
+    const char* name;
+    u32         len;
+    u32         hash;
+    u32         fixups;
+    u16         address;
+    Bool        defined;
+} Symbol;
+
+typedef struct {
+    u16*        mem;
+    u32*        slots;
+    u32         slot_cap;
+    Symbol*     symbols;
+    u32         symbol_cap;
+    u32         symbol_len;
+    Fixup*      fixups;
+    u32         fixup_cap;
+    u32         fixup_len;
+    const char* at;
+    const char* end;
+    const char* error;
+    u32         line;
+    u32         address;
+    u32         low;
+    u32         high;
+    Bool        origin;
+} Assembler;
+
+typedef enum {
+    ASM_ADD = 0,
+    ASM_AND,
+    ASM_NOT,
+    ASM_BR,
+    ASM_JMP,
+    ASM_RET,
+    ASM_JSR,
+    ASM_JSRR,
+    ASM_LD,
+    ASM_LDI,
+    ASM_LDR,
+    ASM_LEA,
+    ASM_ST,
+    ASM_STI,
+    ASM_STR,
+    ASM_TRAP,
+    ASM_TRAP_ALIAS,
+    ASM_ORIG,
+    ASM_FILL,
+    ASM_BLKW,
+    ASM_STRINGZ,
+    ASM_END,
+    ASM_NONE,
+} Mnemonic;
+
+typedef struct {
+    const char* name;
+    Mnemonic    mnemonic;
+    u8          value;
+} MnemonicName;
+
+#define MNEMONIC_COUNT 26
+
+static const MnemonicName MNEMONICS[MNEMONIC_COUNT] = {
+    {"add", ASM_ADD, 0},
+    {"and", ASM_AND, 0},
+    {"not", ASM_NOT, 0},
+    {"jmp", ASM_JMP, 0},
+    {"ret", ASM_RET, 0},
+    {"jsr", ASM_JSR, 0},
+    {"jsrr", ASM_JSRR, 0},
+    {"ld", ASM_LD, 0},
+    {"ldi", ASM_LDI, 0},
+    {"ldr", ASM_LDR, 0},
+    {"lea", ASM_LEA, 0},
+    {"st", ASM_ST, 0},
+    {"sti", ASM_STI, 0},
+    {"str", ASM_STR, 0},
+    {"trap", ASM_TRAP, 0},
+    {"getc", ASM_TRAP_ALIAS, TRAP_GETC},
+    {"out", ASM_TRAP_ALIAS, TRAP_OUT},
+    {"puts", ASM_TRAP_ALIAS, TRAP_PUTS},
+    {"in", ASM_TRAP_ALIAS, TRAP_IN},
+    {"putsp", ASM_TRAP_ALIAS, TRAP_PUTSP},
+    {"halt", ASM_TRAP_ALIAS, TRAP_HALT},
+    {".orig", ASM_ORIG, 0},
+    {".fill", ASM_FILL, 0},
+    {".blkw", ASM_BLKW, 0},
+    {".stringz", ASM_STRINGZ, 0},
+    {".end", ASM_END, 0},
+};
+
+typedef struct {
+    const char* start;
+    u32         len;
+} Token;
+
+static void do_fail(Assembler* assembler, const char* error) {
+    if (assembler->error == NULL) {
+        assembler->error = error;
+    }
+}
+
+static char get_lower(char x) {
+    return (('A' <= x) && (x <= 'Z')) ? (char)(x + ('a' - 'A')) : x;
+}
+
+static Bool get_token_is(Token token, const char* name) {
+    u32 i = 0;
+    for (; i < token.len; ++i) {
+        if (get_lower(token.start[i]) != name[i]) {
+            return FALSE;
+        }
+    }
+    return name[i] == '\0';
+}
+
+/* NOTE: Skips blanks and commas, and a comment through to the end of the
+ * line; stops at the newline. */
+static void do_skip_blank(Assembler* assembler) {
+    while (assembler->at < assembler->end) {
+        const char x = *assembler->at;
+        if (x == ';') {
+            while ((assembler->at < assembler->end) &&
+                   (*assembler->at != '\n'))
+            {
+                ++assembler->at;
+            }
+            return;
+        }
+        if ((x != ' ') && (x != '\t') && (x != '\r') && (x != ',')) {
+            return;
+        }
+        ++assembler->at;
+    }
+}
+
+static Bool get_end_of_line(Assembler* assembler) {
+    do_skip_blank(assembler);
+    return (assembler->end <= assembler->at) || (*assembler->at == '\n');
+}
+
+static Token get_token(Assembler* assembler) {
+    do_skip_blank(assembler);
+    Token token = {assembler->at, 0};
+    while (assembler->at < assembler->end) {
+        const char x = *assembler->at;
+        if ((x == ' ') || (x == '\t') || (x == '\r') || (x == '\n') ||
+            (x == ',') || (x == ';') || (x == '"'))
+        {
+            break;
+        }
+        ++assembler->at;
+    }
+    token.len = (u32)(assembler->at - token.start);
+    return token;
+}
+
+/* NOTE: `BR` takes any of `n`, `z` and `p`, in that order, in its name. */
+static Mnemonic get_mnemonic(Token token, u8* value) {
+    if ((2 <= token.len) && (get_lower(token.start[0]) == 'b') &&
+        (get_lower(token.start[1]) == 'r'))
+    {
+        u8 nzp = 0;
+        u8 last = FL_NEG << 1;
+        for (u32 i = 2; i < token.len; ++i) {
+            const char x = get_lower(token.start[i]);
+            const u8   flag = x == 'n'   ? FL_NEG
+                              : x == 'z' ? FL_ZERO
+                              : x == 'p' ? FL_POS
+                                         : 0;
+            if ((flag == 0) || (last <= flag)) {
+                return ASM_NONE;
+            }
+            nzp |= flag;
+            last = flag;
+        }
+        *value = nzp ? nzp : FL_NEG | FL_ZERO | FL_POS;
+        return ASM_BR;
+    }
+    if ((token.len < 2) || (8 < token.len)) {
+        return ASM_NONE;
+    }
+    const char first = get_lower(token.start[0]);
+    for (u32 i = 0; i < MNEMONIC_COUNT; ++i) {
+        if ((MNEMONICS[i].name[0] == first) &&
+            get_token_is(token, MNEMONICS[i].name))
+        {
+            *value = MNEMONICS[i].value;
+            return MNEMONICS[i].mnemonic;
+        }
+    }
+    return ASM_NONE;
+}
+
+static Bool get_number(Token token, i32* value) {
+    u32  i = 0;
+    u32  base = 10;
+    Bool negative = FALSE;
+    if (token.len && ((token.start[0] == '#'))) {
+        ++i;
+    } else if (token.len && (get_lower(token.start[0]) == 'x')) {
+        base = 16;
+        ++i;
+    }
+    if ((i < token.len) && (token.start[i] == '-')) {
+        negative = TRUE;
+        ++i;
+    }
+    if (token.len <= i) {
+        return FALSE;
+    }
+    i32 x = 0;
+    for (; i < token.len; ++i) {
+        const char c = get_lower(token.start[i]);
+        const i32  digit = (('0' <= c) && (c <= '9')) ? c - '0'
+                           : ((base == 16) && ('a' <= c) && (c <= 'f'))
+                               ? (c - 'a') + 10
+                               : -1;
+        if ((digit < 0) || (0xFFFF < x)) {
+            return FALSE;
+        }
+        x = (x * (i32)base) + digit;
+    }
+    *value = negative ? -x : x;
+    return TRUE;
+}
+
+static i32 get_bounded(Assembler* assembler, i32 low, i32 high) {
+    i32 value = 0;
+    if (!get_number(get_token(assembler), &value)) {
+        do_fail(assembler, "expected a number");
+    } else if ((value < low) || (high < value)) {
+        do_fail(assembler, "number out of range");
+    }
+    return value;
+}
+
+static u8 get_register(Assembler* assembler) {
+    const Token token = get_token(assembler);
+    if ((token.len != 2) || (get_lower(token.start[0]) != 'r') ||
+        (token.start[1] < '0') || ('7' < token.start[1]))
+    {
+        do_fail(assembler, "expected a register");
+        return 0;
+    }
+    return (u8)(token.start[1] - '0');
+}
+
+static u32 get_hash(Token token) {
+    u32 hash = 2166136261u;
+    for (u32 i = 0; i < token.len; ++i) {
+        hash = (hash ^ (u8)token.start[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void do_grow_symbols(Assembler* assembler) {
+    if (assembler->symbol_cap <= assembler->symbol_len) {
+        assembler->symbol_cap = assembler->symbol_cap
+                                    ? assembler->symbol_cap << 1
+                                    : ASM_SYMBOL_CAP;
+        assembler->symbols = realloc(assembler->symbols,
+                                     assembler->symbol_cap * sizeof(Symbol));
+        if (assembler->symbols == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (assembler->symbol_len < (assembler->slot_cap >> 1)) {
+        return;
+    }
+    free(assembler->slots);
+    assembler->slot_cap =
+        assembler->slot_cap ? assembler->slot_cap << 1 : ASM_SYMBOL_CAP * 2;
+    assembler->slots = calloc(assembler->slot_cap, sizeof(u32));
+    if (assembler->slots == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    const u32 mask = assembler->slot_cap - 1;
+    for (u32 i = 0; i < assembler->symbol_len; ++i) {
+        u32 j = assembler->symbols[i].hash & mask;
+        while (assembler->slots[j]) {
+            j = (j + 1) & mask;
+        }
+        assembler->slots[j] = i + 1;
+    }
+}
+
+static Symbol* get_label(Assembler* assembler, Token token) {
+    const u32 hash = get_hash(token);
+    const u32 mask = assembler->slot_cap - 1;
+    u32       i = hash & mask;
+    for (; assembler->slots[i]; i = (i + 1) & mask) {
+        Symbol* symbol = &assembler->symbols[assembler->slots[i] - 1];
+        if ((symbol->hash == hash) && (symbol->len == token.len) &&
+            !memcmp(symbol->name, token.start, token.len))
+        {
+            return symbol;
+        }
+    }
+    assembler->slots[i] = ++assembler->symbol_len;
+    Symbol* symbol = &assembler->symbols[assembler->symbol_len - 1];
+    symbol->name = token.start;
+    symbol->len = token.len;
+    symbol->hash = hash;
+    symbol->fixups = 0;
+    symbol->address = 0;
+    symbol->defined = FALSE;
+    if ((assembler->symbol_cap <= assembler->symbol_len) ||
+        ((assembler->slot_cap >> 1) <= assembler->symbol_len))
+    {
+        do_grow_symbols(assembler);
+        return get_label(assembler, token);
+    }
+    return symbol;
+}
+
+static void do_patch(Assembler* assembler, const Fixup* fixup, u16 address) {
+    const i32 offset = (i32)address - ((i32)fixup->address + 1);
+    const i32 bound = fixup->kind == FIX_PC_OFFSET_9 ? 256 : 1024;
+    switch (fixup->kind) {
+    case FIX_WORD: {
+        assembler->mem[fixup->address] = address;
+        return;
+    }
+    case FIX_PC_OFFSET_9:
+    case FIX_PC_OFFSET_11: {
+        if ((offset < -bound) || (bound <= offset)) {
+            assembler->line = fixup->line;
+            do_fail(assembler, "label out of range");
+            return;
+        }
+        assembler->mem[fixup->address] |= (u16)(offset & ((bound << 1) - 1));
+        return;
+    }
+    }
+}
+
+static void do_define(Assembler* assembler, Token token) {
+    if (!assembler->origin) {
+        do_fail(assembler, "label before .ORIG");
+        return;
+    }
+    if ((token.len != 0) && (token.start[token.len - 1] == ':')) {
+        --token.len;
+    }
+    Symbol* symbol = get_label(assembler, token);
+    if (symbol->defined) {
+        do_fail(assembler, "label defined twice");
+        return;
+    }
+    symbol->defined = TRUE;
+    symbol->address = (u16)assembler->address;
+    for (u32 i = symbol->fixups; i; i = assembler->fixups[i - 1].next) {
+        do_patch(assembler, &assembler->fixups[i - 1], symbol->address);
+    }
+    symbol->fixups = 0;
+}
+
+/* NOTE: Returns the label's address if it is already known, otherwise
+ * chains the word about to be emitted onto the label and returns `0`. */
+static u16 get_reference(Assembler* assembler, Symbol* symbol, FixKind kind) {
+    if (symbol->defined) {
+        return symbol->address;
+    }
+    if (assembler->fixup_cap <= assembler->fixup_len) {
+        assembler->fixup_cap =
+            assembler->fixup_cap ? assembler->fixup_cap << 1 : ASM_FIXUP_CAP;
+        assembler->fixups = realloc(assembler->fixups,
+                                    assembler->fixup_cap * sizeof(Fixup));
+        if (assembler->fixups == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    Fixup* fixup = &assembler->fixups[assembler->fixup_len++];
+    fixup->next = symbol->fixups;
+    fixup->line = assembler->line;
+    fixup->address = (u16)assembler->address;
+    fixup->kind = kind;
+    symbol->fixups = assembler->fixup_len;
+    return 0;
+}
+
+/* NOTE: A label, or a number taken as the offset itself. */
+static i16 get_pc_offset(Assembler* assembler, FixKind kind) {
+    const Token token = get_token(assembler);
+    const i32   bound = kind == FIX_PC_OFFSET_9 ? 256 : 1024;
+    i32         offset = 0;
+    if (token.len == 0) {
+        do_fail(assembler, "expected a label");
+        return 0;
+    }
+    if (!get_number(token, &offset)) {
+        Symbol* symbol = get_label(assembler, token);
+        if (!symbol->defined) {
+            get_reference(assembler, symbol, kind);
+            return 0;
+        }
+        offset = (i32)symbol->address - ((i32)assembler->address + 1);
+    }
+    if ((offset < -bound) || (bound <= offset)) {
+        do_fail(assembler, "offset out of range");
+        return 0;
+    }
+    return (i16)offset;
+}
+
+static void do_emit_word(Assembler* assembler, u16 word) {
+    if (!assembler->origin) {
+        do_fail(assembler, "code before .ORIG");
+        return;
+    }
+    if (ASM_MEM_SIZE <= assembler->address) {
+        do_fail(assembler, "past the end of memory");
+        return;
+    }
+    assembler->mem[assembler->address] = word;
+    if (assembler->address < assembler->low) {
+        assembler->low = assembler->address;
+    }
+    if (assembler->high <= assembler->address) {
+        assembler->high = assembler->address + 1;
+    }
+    ++assembler->address;
+}
+
+static void do_emit_stringz(Assembler* assembler) {
+    do_skip_blank(assembler);
+    if ((assembler->end <= assembler->at) || (*assembler->at != '"')) {
+        do_fail(assembler, "expected a string");
+        return;
+    }
+    for (++assembler->at;; ++assembler->at) {
+        if ((assembler->end <= assembler->at) || (*assembler->at == '\n')) {
+            do_fail(assembler, "unterminated string");
+            return;
+        }
+        char x = *assembler->at;
+        if (x == '"') {
+            ++assembler->at;
+            break;
+        }
+        if ((x == '\\') && ((assembler->at + 1) < assembler->end)) {
+            x = *++assembler->at;
+            x = x == 'n' ? '\n' : x == 't' ? '\t' : x == '0' ? '\0' : x;
+        }
+        do_emit_word(assembler, (u16)(u8)x);
+    }
+    do_emit_word(assembler, 0);
+}
+
+static void do_emit_fill(Assembler* assembler) {
+    const Token token = get_token(assembler);
+    i32         value = 0;
+    if (token.len == 0) {
+        do_fail(assembler, "expected a number or label");
+    } else if (get_number(token, &value)) {
+        if ((value < -0x8000) || (0xFFFF < value)) {
+            do_fail(assembler, "number out of range");
+        }
+        do_emit_word(assembler, (u16)value);
+    } else {
+        Symbol* symbol = get_label(assembler, token);
+        do_emit_word(assembler, get_reference(assembler, symbol, FIX_WORD));
+    }
+}
+
+/* NOTE: Returns `FALSE` at `.END`. */
+static Bool do_assemble_line(Assembler* assembler) {
+    Token token = get_token(assembler);
+    if (token.len == 0) {
+        return TRUE;
+    }
+    u8       value = 0;
+    Mnemonic mnemonic = get_mnemonic(token, &value);
+    if (mnemonic == ASM_NONE) {
+        do_define(assembler, token);
+        token = get_token(assembler);
+        if (token.len == 0) {
+            return TRUE;
+        }
+        mnemonic = get_mnemonic(token, &value);
+    }
+    Instr instr = {0};
+    switch (mnemonic) {
+    case ASM_ADD:
+    case ASM_AND: {
+        instr.op = mnemonic == ASM_ADD ? OP_ADD : OP_AND;
+        instr.r0_or_nzp = get_register(assembler);
+        instr.r1 = get_register(assembler);
+        const char* at = assembler->at;
+        const Token operand = get_token(assembler);
+        i32         immediate = 0;
+        if (get_number(operand, &immediate)) {
+            if ((immediate < -16) || (15 < immediate)) {
+                do_fail(assembler, "number out of range");
+            }
+            instr.mode = TRUE;
+            instr.immediate_or_offset = (i16)immediate;
+        } else {
+            assembler->at = at;
+            instr.r2 = get_register(assembler);
+        }
+        break;
+    }
+    case ASM_NOT: {
+        instr.op = OP_NOT;
+        instr.r0_or_nzp = get_register(assembler);
+        instr.r1 = get_register(assembler);
+        break;
+    }
+    case ASM_BR: {
+        instr.op = OP_BR;
+        instr.r0_or_nzp = value;
+        instr.immediate_or_offset = get_pc_offset(assembler, FIX_PC_OFFSET_9);
+        break;
+    }
+    case ASM_JMP:
+    case ASM_JSRR: {
+        instr.op = mnemonic == ASM_JMP ? OP_JMP : OP_JSR;
+        instr.r1 = get_register(assembler);
+        break;
+    }
+    case ASM_RET: {
+        instr.op = OP_JMP;
+        instr.r1 = R_7;
+        break;
+    }
+    case ASM_JSR: {
+        instr.op = OP_JSR;
+        instr.mode = TRUE;
+        instr.immediate_or_offset =
+            get_pc_offset(assembler, FIX_PC_OFFSET_11);
+        break;
+    }
+    case ASM_LD:
+    case ASM_LDI:
+    case ASM_LEA:
+    case ASM_ST:
+    case ASM_STI: {
+        instr.op = mnemonic == ASM_LD    ? OP_LD
+                   : mnemonic == ASM_LDI ? OP_LDI
+                   : mnemonic == ASM_LEA ? OP_LEA
+                   : mnemonic == ASM_ST  ? OP_ST
+                                         : OP_STI;
+        instr.r0_or_nzp = get_register(assembler);
+        instr.immediate_or_offset = get_pc_offset(assembler, FIX_PC_OFFSET_9);
+        break;
+    }
+    case ASM_LDR:
+    case ASM_STR: {
+        instr.op = mnemonic == ASM_LDR ? OP_LDR : OP_STR;
+        instr.r0_or_nzp = get_register(assembler);
+        instr.r1 = get_register(assembler);
+        instr.immediate_or_offset = (i16)get_bounded(assembler, -32, 31);
+        break;
+    }
+    case ASM_TRAP: {
+        instr.op = OP_TRAP;
+        instr.trap = (Trap)get_bounded(assembler, 0, 0xFF);
+        break;
+    }
+    case ASM_TRAP_ALIAS: {
+        instr.op = OP_TRAP;
+        instr.trap = (Trap)value;
+        break;
+    }
+    case ASM_ORIG: {
+        assembler->address = (u32)get_bounded(assembler, 0, 0xFFFF);
+        assembler->origin = TRUE;
+        return TRUE;
+    }
+    case ASM_FILL: {
+        do_emit_fill(assembler);
+        return TRUE;
+    }
+    case ASM_BLKW: {
+        for (i32 i = get_bounded(assembler, 0, 0xFFFF); i; --i) {
+            do_emit_word(assembler, 0);
+        }
+        return TRUE;
+    }
+    case ASM_STRINGZ: {
+        do_emit_stringz(assembler);
+        return TRUE;
+    }
+    case ASM_END: {
+        return FALSE;
+    }
+    case ASM_NONE:
+    default: {
+        do_fail(assembler, "unknown mnemonic");
+        return TRUE;
+    }
+    }
+    do_emit_word(assembler, get_bin_instr(instr));
+    return TRUE;
+}
+
+/* NOTE: Assembles `len` bytes of `source` into `mem`, which is only
+ * written where the source puts words. Returns `FALSE` on the first error,
+ * with `error` and `line` (counting from `1`) set. On success the words
+ * written span `low` up to `high`. `source` has to outlive the call only,
+ * since symbols point into it. */
+static Bool set_assembly(Assembler* assembler,
+                         u16*       mem,
+                         const char* source,
+                         usize       len) {
+    if (assembler->slots == NULL) {
+        do_grow_symbols(assembler);
+    }
+    memset(assembler->slots, 0, assembler->slot_cap * sizeof(u32));
+    assembler->symbol_len = 0;
+    assembler->fixup_len = 0;
+    assembler->mem = mem;
+    assembler->at = source;
+    assembler->end = source + len;
+    assembler->error = NULL;
+    assembler->line = 1;
+    assembler->address = 0;
+    assembler->low = ASM_MEM_SIZE;
+    assembler->high = 0;
+    assembler->origin = FALSE;
+    while (do_assemble_line(assembler) && (assembler->error == NULL)) {
+        if (!get_end_of_line(assembler)) {
+            do_fail(assembler, "unexpected operand");
+            break;
+        }
+        if (assembler->end <= assembler->at) {
+            break;
+        }
+        ++assembler->at;
+        ++assembler->line;
+    }
+    for (u32 i = 0; (i < assembler->symbol_len) && !assembler->error; ++i) {
+        const Symbol* symbol = &assembler->symbols[i];
+        if (symbol->fixups) {
+            assembler->line = assembler->fixups[symbol->fixups - 1].line;
+            do_fail(assembler, "undefined label");
+        }
+    }
+    return assembler->error == NULL;
+}
+
+static void do_free_assembler(Assembler* assembler) {
+    free(assembler->slots);
+    free(assembler->symbols);
+    free(assembler->fixups);
+}
+
+#endif
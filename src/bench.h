@@ -0,0 +1,223 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include "fuzz.h"
+#include "tier.h"
+
+/* NOTE: Benchmarks run the image three times from the same snapshot, on the
+ * same input, with output thrown away:
+ *     1. the plain interpreter, for wall time and MIPS
+ *     2. the interpreter again, timing a random one in every ~64 handlers
+ *        with `rdtsc` to estimate what each opcode costs
+ *     3. the tiered engine, for wall time and MIPS
+ * A run ends when the guest halts, asks for more input than the file has,
+ * stops or faults, or hits `--budget`/`--timeout`; the status names which,
+ * as `--explore` names its leaves. */
+#define OP_COUNT     16
+#define SAMPLE_EVERY 64
+
+typedef struct {
+    u64 counts[OP_COUNT];
+    u64 samples[OP_COUNT];
+    u64 cycles[OP_COUNT];
+    u64 overhead;
+    u64 rng;
+} Bench;
+
+static const char* const OP_NAMES[OP_COUNT] = {
+    "BR",
+    "ADD",
+    "LD",
+    "ST",
+    "JSR",
+    "AND",
+    "LDR",
+    "STR",
+    "RTI",
+    "NOT",
+    "LDI",
+    "STI",
+    "JMP",
+    "RES",
+    "LEA",
+    "TRAP",
+};
+
+static const Io IO_BENCH = {
+    get_fuzz_char,
+    poll_fuzz_char,
+    put_null_char,
+    flush_buffers,
+    get_host_clock,
+    wait_fuzz_char,
+};
+
+static u64 get_cycles(void) {
+    _mm_lfence();
+    const u64 cycles = __rdtsc();
+    _mm_lfence();
+    return cycles;
+}
+
+/* NOTE: The least it takes to read the counter twice, which is taken off
+ * every sample. */
+static u64 get_overhead(void) {
+    u64 overhead = U64_MAX;
+    for (u32 i = 0; i < 1024; ++i) {
+        const u64 start = get_cycles();
+        const u64 cycles = get_cycles() - start;
+        overhead = cycles < overhead ? cycles : overhead;
+    }
+    return overhead;
+}
+
+static u64 get_interval(Bench* bench) {
+    bench->rng ^= bench->rng << 13;
+    bench->rng ^= bench->rng >> 7;
+    bench->rng ^= bench->rng << 17;
+    return (SAMPLE_EVERY / 2) + (bench->rng % SAMPLE_EVERY);
+}
+
+static u64 run_sampled(Vm* vm, Bench* bench, u64 budget) {
+    u64 n = 0;
+    u64 countdown = get_interval(bench);
+    vm->deadline = 0;
+    for (; (n < budget) && (vm->status == ALIVE); ++n) {
+        const u16    instr = get_mem_at(vm, vm->reg[R_PC]++);
+        const OpCode op = get_op(instr);
+        ++bench->counts[op];
+        if (--countdown) {
+            do_bin_instr(vm, instr);
+            continue;
+        }
+        const u64 start = get_cycles();
+        do_bin_instr(vm, instr);
+        const u64 cycles = get_cycles() - start;
+        bench->cycles[op] += bench->overhead < cycles
+                                 ? cycles - bench->overhead
+                                 : 0;
+        ++bench->samples[op];
+        countdown = get_interval(bench);
+    }
+    return n;
+}
+
+/* NOTE: Prints `string` as a JSON string, quotes and all. */
+static void do_print_json_string(const char* string) {
+    putchar('"');
+    for (; *string; ++string) {
+        const u8 x = (u8)*string;
+        if ((x == '"') || (x == '\\')) {
+            printf("\\%c", x);
+        } else if (x < 0x20) {
+            printf("\\u%04X", (u32)x);
+        } else {
+            putchar(x);
+        }
+    }
+    putchar('"');
+}
+
+static void do_print_run(const char* name, u64 instrs, u64 elapsed) {
+    const u64 mips = elapsed ? (instrs * 1000000) / elapsed : 0;
+    printf("  \"%s\": {\"instructions\": %" PRIu64 ", \"wall_ns\": %" PRIu64
+           ", \"mips\": %" PRIu64 ".%03" PRIu64 "},\n",
+           name,
+           instrs,
+           elapsed,
+           mips / 1000,
+           mips % 1000);
+}
+
+/* NOTE: Prints the results to `stdout` as JSON. */
+static void do_bench(Vm*         vm,
+                     const char* image_path,
+                     const char* input_path,
+                     u64         budget,
+                     u64         timeout_ms) {
+    File* file = fopen(input_path, "rb");
+    if (file == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    fseek(file, 0, SEEK_END);
+    const long len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    u8*    input = malloc(len ? (usize)len : 1);
+    Bench* bench = calloc(1, sizeof(Bench));
+    Tier*  tier = calloc(1, sizeof(Tier));
+    if ((len < 0) || (input == NULL) || (bench == NULL) || (tier == NULL) ||
+        (fread(input, 1, (usize)len, file) != (usize)len))
+    {
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    Buffers buffers = {0};
+    buffers.input = input;
+    buffers.input_len = (usize)len;
+    vm->io = &IO_BENCH;
+    vm->io_data = &buffers;
+    bench->rng = get_monotonic_ns() | 1;
+    bench->overhead = get_overhead();
+
+    u64       start = get_monotonic_ns();
+    const u64 instrs = run_vm(vm, budget, get_deadline(timeout_ms));
+    const u64 interpret_ns = get_monotonic_ns() - start;
+    const Status status = vm->status;
+
+    do_reset_vm(vm);
+    buffers.input_index = 0;
+    const u64 sampled = run_sampled(vm, bench, instrs);
+
+    do_reset_vm(vm);
+    buffers.input_index = 0;
+    start = get_monotonic_ns();
+    const u64 tiered = run_tiered(vm, tier, budget, get_deadline(timeout_ms));
+    const u64 tiered_ns = get_monotonic_ns() - start;
+
+    printf("{\n  \"image\": ");
+    do_print_json_string(image_path);
+    printf(",\n  \"input_bytes\": %ld,\n  \"status\": \"%s\",\n",
+           len,
+           status == DEAD          ? "halted"
+           : status == EXHAUSTED   ? "exhausted"
+           : status == EXPIRED     ? "expired"
+           : status == BLOCKED     ? "input"
+           : status == FAULTED     ? "faulted"
+           : status == INTERRUPTED ? "interrupted"
+                                   : "stopped");
+    do_print_run("interpret", instrs, interpret_ns);
+    do_print_run("tiered", tiered, tiered_ns);
+    printf("  \"sampled_instructions\": %" PRIu64 ",\n"
+           "  \"timer_overhead_cycles\": %" PRIu64 ",\n"
+           "  \"opcodes\": {",
+           sampled,
+           bench->overhead);
+    Bool first = TRUE;
+    for (u8 op = 0; op < OP_COUNT; ++op) {
+        if (!bench->counts[op]) {
+            continue;
+        }
+        /* NOTE: Hundredths of a cycle, to keep this in integers. */
+        const u64 per_instr =
+            bench->samples[op]
+                ? (bench->cycles[op] * 100) / bench->samples[op]
+                : 0;
+        printf("%s\n    \"%s\": {\"count\": %" PRIu64 ", \"samples\": %" PRIu64
+               ", \"cycles_per_instr\": %" PRIu64 ".%02" PRIu64
+               ", \"cycles_estimate\": %" PRIu64 "}",
+               first ? "" : ",",
+               OP_NAMES[op],
+               bench->counts[op],
+               bench->samples[op],
+               per_instr / 100,
+               per_instr % 100,
+               (per_instr * bench->counts[op]) / 100);
+        first = FALSE;
+    }
+    printf("\n  }\n}\n");
+    free(tier);
+    free(bench);
+    free(input);
+}
+
+#endif
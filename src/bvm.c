@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+
+#include "bvm.h"
+#include "arena.h"
+#include "tier.h"
+
+#define VECTOR_COUNT 256
+
+typedef struct {
+    BvmTrap fn;
+    void*   data;
+} TrapHandler;
+
+/* NOTE: The guest runs on the tiered engine, as it does under `main`, with
+ * its I/O and traps routed back to the host through `IO_LIBRARY` and
+ * `handle_library_trap`. */
+struct Bvm {
+    Image       image;
+    Assembler   assembler;
+    Vm*         vm;
+    Tier*       tier;
+    BvmIo       io;
+    void*       io_data;
+    TrapHandler traps[VECTOR_COUNT];
+    Bool        loaded;
+    Bool        yielded;
+};
+
+static i32 get_library_char(Vm* vm) {
+    const Bvm* bvm = vm->io_data;
+    return bvm->io.get_char ? bvm->io.get_char(bvm->io_data) : EOF;
+}
+
+static Bool poll_library_char(Vm* vm) {
+    const Bvm* bvm = vm->io_data;
+    return bvm->io.poll_char ? bvm->io.poll_char(bvm->io_data) != 0 : FALSE;
+}
+
+static void put_library_char(Vm* vm, char x) {
+    const Bvm* bvm = vm->io_data;
+    if (bvm->io.put_char) {
+        bvm->io.put_char(bvm->io_data, x);
+    }
+}
+
+static void flush_library(Vm* vm) {
+    const Bvm* bvm = vm->io_data;
+    if (bvm->io.flush) {
+        bvm->io.flush(bvm->io_data);
+    }
+}
+
+/* NOTE: The host's input can only be polled, so it is checked every
+ * millisecond until `deadline`. */
+static Bool wait_library_char(Vm* vm, u64 deadline) {
+    for (;;) {
+        if (poll_library_char(vm)) {
+            return TRUE;
+        }
+        if (deadline <= get_host_clock(vm, CLOCK_MS)) {
+            return FALSE;
+        }
+        const TimeSpec time = {0, (long)MILLISECOND_NS};
+        nanosleep(&time, NULL);
+    }
+}
+
+/* NOTE: `TRAP_SLEEP` blocks the calling thread, polling the host every
+ * millisecond; a host with a scheduler of its own can take the trap with
+ * `bvm_set_trap` and yield instead. */
+static const Io IO_LIBRARY = {
+    get_library_char,
+    poll_library_char,
+    put_library_char,
+    flush_library,
+    get_host_clock,
+    wait_library_char,
+};
+
+static Bool handle_library_trap(Vm* vm, Trap trap) {
+    Bvm*               bvm = vm->io_data;
+    const TrapHandler* handler = &bvm->traps[(u8)trap];
+    if (handler->fn == NULL) {
+        return FALSE;
+    }
+    switch (handler->fn(bvm, (u8)trap, handler->data)) {
+    case BVM_HANDLED: {
+        return TRUE;
+    }
+    case BVM_YIELD: {
+        bvm->yielded = TRUE;
+        vm->status = STOPPED;
+        return TRUE;
+    }
+    default: {
+        return FALSE;
+    }
+    }
+}
+
+Bvm* bvm_create(void) {
+    Bvm* bvm = calloc(1, sizeof(Bvm));
+    if (bvm == NULL) {
+        return NULL;
+    }
+    bvm->tier = calloc(1, sizeof(Tier));
+    if (bvm->tier == NULL) {
+        free(bvm);
+        return NULL;
+    }
+    bvm->vm = get_vm();
+    set_vm(bvm->vm, &bvm->image);
+    bvm->vm->status = DEAD;
+    bvm->vm->io = &IO_LIBRARY;
+    bvm->vm->io_data = bvm;
+    bvm->vm->trap = handle_library_trap;
+    return bvm;
+}
+
+void bvm_destroy(Bvm* bvm) {
+    if (bvm == NULL) {
+        return;
+    }
+    do_free_vm(bvm->vm);
+    do_free_assembler(&bvm->assembler);
+    free(bvm->tier);
+    free(bvm);
+}
+
+int bvm_load(Bvm* bvm, const void* bytes, size_t size) {
+    const u8* words = bytes;
+    if ((size < 4) || (size & 1)) {
+        return -1;
+    }
+    const u16   origin = (u16)((words[0] << 8) | words[1]);
+    const usize len = (size - 2) / 2;
+    if ((usize)(MEM_SIZE - origin) < len) {
+        return -1;
+    }
+    memset(bvm->image.mem, 0, sizeof(bvm->image.mem));
+    for (usize i = 0; i < len; ++i) {
+        bvm->image.mem[origin + i] =
+            (u16)((words[2 + (i * 2)] << 8) | words[3 + (i * 2)]);
+    }
+    bvm->image.native = NULL;
+    set_vm(bvm->vm, &bvm->image);
+    bvm->loaded = TRUE;
+    bvm->yielded = FALSE;
+    return 0;
+}
+
+int bvm_assemble(Bvm* bvm, const char* source, size_t len) {
+    memset(bvm->image.mem, 0, sizeof(bvm->image.mem));
+    bvm->image.native = NULL;
+    bvm->yielded = FALSE;
+    if (!set_assembly(&bvm->assembler, bvm->image.mem, source, len)) {
+        set_vm(bvm->vm, &bvm->image);
+        bvm->vm->status = DEAD;
+        bvm->loaded = FALSE;
+        return bvm->assembler.line ? (int)bvm->assembler.line : 1;
+    }
+    set_vm(bvm->vm, &bvm->image);
+    bvm->loaded = TRUE;
+    return 0;
+}
+
+void bvm_reset(Bvm* bvm) {
+    if (!bvm->loaded) {
+        return;
+    }
+    do_reset_vm(bvm->vm);
+    bvm->yielded = FALSE;
+}
+
+int bvm_run(Bvm* bvm, uint64_t budget, uint64_t* instrs) {
+    Vm* vm = bvm->vm;
+    u64 n = 0;
+    if (vm->status != DEAD) {
+        vm->status = ALIVE;
+        bvm->yielded = FALSE;
+        n = run_tiered(vm, bvm->tier, budget, 0);
+    }
+    if (instrs) {
+        *instrs = n;
+    }
+    switch (vm->status) {
+    case DEAD:
+    case FAULTED: {
+        return BVM_HALTED;
+    }
+    case STOPPED: {
+        return bvm->yielded ? BVM_TRAPPED : BVM_BREAK;
+    }
+    case ALIVE:
+    case EXHAUSTED:
+    case EXPIRED:
+    case BLOCKED:
+    case INTERRUPTED:
+    default: {
+        return BVM_BUDGET;
+    }
+    }
+}
+
+void bvm_set_io(Bvm* bvm, const BvmIo* io, void* data) {
+    if (io) {
+        bvm->io = *io;
+    } else {
+        memset(&bvm->io, 0, sizeof(BvmIo));
+    }
+    bvm->io_data = data;
+}
+
+void bvm_set_trap(Bvm* bvm, uint8_t vector, BvmTrap trap, void* data) {
+    bvm->traps[vector].fn = trap;
+    bvm->traps[vector].data = data;
+}
+
+/* NOTE: Brings back every page `bvm_pack` put somewhere else, so `mem`
+ * can be read and written directly. */
+uint16_t* bvm_memory(Bvm* bvm) {
+    Vm* vm = bvm->vm;
+    for (u32 i = 0; i < PAGE_COUNT; ++i) {
+        if (vm->pages[i] & PAGE_SHARED) {
+            do_own_page(vm, (u8)i);
+        }
+    }
+    do_unpack_vm(vm);
+    return vm->mem;
+}
+
+uint16_t* bvm_registers(Bvm* bvm) {
+    return bvm->vm->reg;
+}
+
+size_t bvm_pack(Bvm* bvm) {
+    usize released;
+    return do_pack_vm(bvm->vm, &released);
+}
+
+/* NOTE: Marks the pages as stored to, and moves any decoded code on them
+ * on to a new generation, the way `set_break` does. */
+void bvm_touch(Bvm* bvm, uint16_t address, size_t count) {
+    Vm* vm = bvm->vm;
+    if (count == 0) {
+        return;
+    }
+    const usize last = (usize)address + count - 1;
+    const usize end = last < (usize)MEM_SIZE ? last : (usize)MEM_SIZE - 1;
+    for (usize i = address >> PAGE_BITS; i <= (end >> PAGE_BITS); ++i) {
+        const u8 page = (u8)i;
+        if (vm->pages[page] & PAGE_CODE) {
+            ++vm->generations[page];
+        }
+        vm->pages[page] |= PAGE_DIRTY;
+        vm->dirty[page >> 6] |= 1llu << (page & 0x3F);
+    }
+}
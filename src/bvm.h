@@ -0,0 +1,113 @@
+#ifndef __BVM_H__
+#define __BVM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* NOTE: The embedding API, built as `libbvm.a` and `libbvm.so`. A `Bvm` is
+ * one guest machine; separate machines share nothing and can run on
+ * separate threads, but a single machine must only be used by one thread at
+ * a time.
+ *
+ * Statuses and trap results are passed as plain `int`s, since the library
+ * itself is built with `-fshort-enums` and hosts may not be. */
+
+typedef struct Bvm Bvm;
+
+enum {
+    BVM_HALTED = 0, // the guest ran `TRAP x25`, or has nothing loaded
+    BVM_BUDGET,     // the guest ran every instruction it was given
+    BVM_TRAPPED,    // a trap handler returned `BVM_YIELD`
+    BVM_BREAK,      // the guest ran into a breakpoint (`OP_RES`)
+};
+
+enum {
+    BVM_UNHANDLED = 0, // carry on with the built-in trap, if there is one
+    BVM_HANDLED,       // the trap is done, carry on running
+    BVM_YIELD,         // the trap is done, return `BVM_TRAPPED` to the host
+};
+
+/* NOTE: Indices into `bvm_registers`. */
+enum {
+    BVM_R0 = 0,
+    BVM_R1,
+    BVM_R2,
+    BVM_R3,
+    BVM_R4,
+    BVM_R5,
+    BVM_R6,
+    BVM_R7,
+    BVM_PC,
+    BVM_COND,
+    BVM_REGISTER_COUNT,
+};
+
+#define BVM_MEMORY_SIZE 65536
+
+/* NOTE: Any of these can be left `NULL`. Without `get_char` the guest reads
+ * `-1`, without `poll_char` the keyboard never has anything, and without
+ * `put_char` output is dropped. */
+typedef struct {
+    int (*get_char)(void* data);
+    int (*poll_char)(void* data);
+    void (*put_char)(void* data, char x);
+    void (*flush)(void* data);
+} BvmIo;
+
+/* NOTE: Called for `TRAP vector` with `R_PC` already past the trap. The
+ * handler can read and write the guest through `bvm_registers` and
+ * `bvm_memory`. */
+typedef int (*BvmTrap)(Bvm* bvm, uint8_t vector, void* data);
+
+/* NOTE: Returns `NULL` if there is not enough memory. */
+Bvm* bvm_create(void);
+
+void bvm_destroy(Bvm* bvm);
+
+/* NOTE: Loads an `.obj` image (a big-endian origin followed by big-endian
+ * words) and resets the guest to run it from `x3000`. Returns `0`, or `-1`
+ * if the image does not fit in memory. */
+int bvm_load(Bvm* bvm, const void* bytes, size_t size);
+
+/* NOTE: Assembles `len` bytes of LC-3 assembly and loads the result as
+ * `bvm_load` would. Returns `0`, or the line of the first error, in which
+ * case nothing is loaded. */
+int bvm_assemble(Bvm* bvm, const char* source, size_t len);
+
+/* NOTE: Puts the guest back the way `bvm_load` left it. */
+void bvm_reset(Bvm* bvm);
+
+/* NOTE: Runs at most `budget` instructions and returns why it stopped. If
+ * `instrs` is not `NULL` it is set to the number of instructions run. A
+ * guest stopped for any reason but halting carries on where it left off
+ * the next time it is run. */
+int bvm_run(Bvm* bvm, uint64_t budget, uint64_t* instrs);
+
+void bvm_set_io(Bvm* bvm, const BvmIo* io, void* data);
+
+/* NOTE: Handles `TRAP vector` with `trap` (`NULL` to go back to the
+ * built-in one). Vectors without a built-in trap do nothing unless given a
+ * handler. */
+void bvm_set_trap(Bvm* bvm, uint8_t vector, BvmTrap trap, void* data);
+
+/* NOTE: The guest's `BVM_MEMORY_SIZE` words and `BVM_REGISTER_COUNT`
+ * registers, in place; both pointers stay valid until `bvm_destroy`. The
+ * guest sees writes through them at once, but `bvm_touch` has to be told
+ * about memory written between runs so `bvm_reset` undoes it and code
+ * written over is decoded again. */
+uint16_t* bvm_memory(Bvm* bvm);
+
+uint16_t* bvm_registers(Bvm* bvm);
+
+/* NOTE: Gives back to the host as much of the memory of a guest that is
+ * not running as it can, and returns how many bytes it still holds in
+ * packed pages; the rest of the guest's memory is either the image's or
+ * zeros. Nothing is lost, and the guest takes back each page it touches
+ * when it runs again. Words read or written through an earlier
+ * `bvm_memory` pointer are not the guest's until `bvm_memory` is called
+ * again. */
+size_t bvm_pack(Bvm* bvm);
+
+void bvm_touch(Bvm* bvm, uint16_t address, size_t count);
+
+#endif
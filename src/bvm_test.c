@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bvm.h"
+
+/* NOTE: Exercises `libbvm` through `bvm.h` alone, linked the way a host
+ * would link it. */
+
+#define FAIL(test)               \
+    {                            \
+        printf("!\n" test "\n"); \
+        exit(EXIT_FAILURE);      \
+    }
+
+typedef struct {
+    char   output[64];
+    size_t len;
+    int    flushes;
+    int    key;
+} Host;
+
+typedef struct {
+    int calls;
+    int result;
+} Handler;
+
+static const char COUNT_SOURCE[] = ".ORIG x3000\n"
+                                   "       AND R1, R1, #0\n"
+                                   "       LD R2, COUNT\n"
+                                   "LOOP   ADD R1, R1, #1\n"
+                                   "       ADD R2, R2, #-1\n"
+                                   "       BRp LOOP\n"
+                                   "       ST R1, RESULT\n"
+                                   "       HALT\n"
+                                   "COUNT  .FILL #50\n"
+                                   "RESULT .FILL #0\n"
+                                   ".END\n";
+
+#define COUNT_AT  0x3007
+#define RESULT_AT 0x3008
+#define LOOP_AT   0x3002
+
+static Bvm* get_test_bvm(const char* source) {
+    Bvm* bvm = bvm_create();
+    if (bvm == NULL) {
+        FAIL("get_test_bvm (bvm_create)");
+    }
+    if (bvm_assemble(bvm, source, strlen(source))) {
+        FAIL("get_test_bvm (bvm_assemble)");
+    }
+    return bvm;
+}
+
+static int get_host_char(void* data) {
+    return ((const Host*)data)->key;
+}
+
+static int poll_host_char(void* data) {
+    return 1;
+}
+
+static void put_host_char(void* data, char x) {
+    Host* host = data;
+    if (host->len < sizeof(host->output)) {
+        host->output[host->len++] = x;
+    }
+}
+
+static void flush_host(void* data) {
+    ++((Host*)data)->flushes;
+}
+
+/* NOTE: Adds one to `R0`. */
+static int handle_test_trap(Bvm* bvm, uint8_t vector, void* data) {
+    Handler* handler = data;
+    ++bvm_registers(bvm)[BVM_R0];
+    ++handler->calls;
+    return handler->result;
+}
+
+static int count_test_trap(Bvm* bvm, uint8_t vector, void* data) {
+    ++((Handler*)data)->calls;
+    return BVM_UNHANDLED;
+}
+
+static void test_assemble_error(void) {
+    Bvm*     bvm = bvm_create();
+    uint64_t instrs = 1;
+    if (bvm == NULL) {
+        FAIL("test_assemble_error (bvm_create)");
+    }
+    if ((bvm_run(bvm, 100, &instrs) != BVM_HALTED) || instrs) {
+        FAIL("test_assemble_error (empty)");
+    }
+    const char source[] = ".ORIG x3000\n"
+                          "      HALT\n"
+                          "      ADD R0, R0\n"
+                          ".END\n";
+    if (bvm_assemble(bvm, source, strlen(source)) != 3) {
+        FAIL("test_assemble_error (line)");
+    }
+    bvm_reset(bvm);
+    if ((bvm_run(bvm, 100, &instrs) != BVM_HALTED) || instrs) {
+        FAIL("test_assemble_error (run)");
+    }
+    bvm_destroy(bvm);
+    printf(".");
+}
+
+static void test_load(void) {
+    /* NOTE: `ADD R0, R0, #5` then `HALT`, at `x3000`. */
+    const uint8_t bytes[] = {0x30, 0x00, 0x10, 0x25, 0xF0, 0x25};
+    const uint8_t past[] = {0xFF, 0xFF, 0x10, 0x25, 0xF0, 0x25};
+    Bvm*          bvm = bvm_create();
+    uint64_t      instrs;
+    if (bvm == NULL) {
+        FAIL("test_load (bvm_create)");
+    }
+    if ((bvm_load(bvm, bytes, 3) != -1) || (bvm_load(bvm, bytes, 5) != -1) ||
+        (bvm_load(bvm, past, sizeof(past)) != -1))
+    {
+        FAIL("test_load (errors)");
+    }
+    if ((bvm_run(bvm, 100, &instrs) != BVM_HALTED) || instrs) {
+        FAIL("test_load (nothing loaded)");
+    }
+    if (bvm_load(bvm, bytes, sizeof(bytes))) {
+        FAIL("test_load (bvm_load)");
+    }
+    if ((bvm_memory(bvm)[0x3000] != 0x1025) ||
+        (bvm_registers(bvm)[BVM_PC] != 0x3000))
+    {
+        FAIL("test_load (image)");
+    }
+    if ((bvm_run(bvm, 100, &instrs) != BVM_HALTED) ||
+        (bvm_registers(bvm)[BVM_R0] != 5) || (instrs != 2))
+    {
+        FAIL("test_load (run)");
+    }
+    bvm_destroy(bvm);
+    printf(".");
+}
+
+/* NOTE: Run in slices, the guest ends up where it does in one go. */
+static void test_run_budget(void) {
+    Bvm*     bvm = get_test_bvm(COUNT_SOURCE);
+    uint64_t total;
+    if (bvm_run(bvm, UINT64_MAX, &total) != BVM_HALTED) {
+        FAIL("test_run_budget (run)");
+    }
+    if ((bvm_memory(bvm)[RESULT_AT] != 50) ||
+        (bvm_registers(bvm)[BVM_R1] != 50))
+    {
+        FAIL("test_run_budget (result)");
+    }
+    bvm_reset(bvm);
+    if (bvm_memory(bvm)[RESULT_AT] || (bvm_registers(bvm)[BVM_PC] != 0x3000))
+    {
+        FAIL("test_run_budget (bvm_reset)");
+    }
+    uint64_t sum = 0;
+    uint64_t instrs;
+    int      status;
+    while ((status = bvm_run(bvm, 10, &instrs)) == BVM_BUDGET) {
+        if ((instrs == 0) || (10 < instrs)) {
+            FAIL("test_run_budget (slice)");
+        }
+        sum += instrs;
+    }
+    sum += instrs;
+    if ((status != BVM_HALTED) || (sum != total) ||
+        (bvm_memory(bvm)[RESULT_AT] != 50))
+    {
+        FAIL("test_run_budget (slices)");
+    }
+    if ((bvm_run(bvm, 10, &instrs) != BVM_HALTED) || instrs) {
+        FAIL("test_run_budget (halted)");
+    }
+    bvm_destroy(bvm);
+    printf(".");
+}
+
+/* NOTE: Words the host writes and touches are undone by a reset, and code
+ * it writes over is not run as it was decoded before. */
+static void test_memory(void) {
+    Bvm* bvm = get_test_bvm(COUNT_SOURCE);
+    bvm_run(bvm, UINT64_MAX, NULL);
+    bvm_reset(bvm);
+    uint16_t* mem = bvm_memory(bvm);
+    mem[COUNT_AT] = 5;
+    bvm_touch(bvm, COUNT_AT, 1);
+    if ((bvm_run(bvm, UINT64_MAX, NULL) != BVM_HALTED) ||
+        (mem[RESULT_AT] != 5))
+    {
+        FAIL("test_memory (data)");
+    }
+    bvm_reset(bvm);
+    if ((mem[COUNT_AT] != 50) || mem[RESULT_AT]) {
+        FAIL("test_memory (bvm_reset)");
+    }
+    /* NOTE: `ADD R1, R1, #2`. */
+    mem[LOOP_AT] = 0x1262;
+    bvm_touch(bvm, LOOP_AT, 1);
+    bvm_registers(bvm)[BVM_R2] = 7;
+    if ((bvm_run(bvm, UINT64_MAX, NULL) != BVM_HALTED) ||
+        (mem[RESULT_AT] != 100))
+    {
+        FAIL("test_memory (code)");
+    }
+    bvm_reset(bvm);
+    if ((mem[LOOP_AT] == 0x1262) || bvm_registers(bvm)[BVM_R2]) {
+        FAIL("test_memory (bvm_reset code)");
+    }
+    bvm_destroy(bvm);
+    printf(".");
+}
+
+static void test_io(void) {
+    const char source[] = ".ORIG x3000\n"
+                          "      LEA R0, TEXT\n"
+                          "      PUTS\n"
+                          "      GETC\n"
+                          "      OUT\n"
+                          "      ST R0, KEY\n"
+                          "      HALT\n"
+                          "TEXT  .STRINGZ \"hi\"\n"
+                          "KEY   .FILL #0\n"
+                          ".END\n";
+    Bvm*        bvm = get_test_bvm(source);
+    Host        host = {0};
+    const BvmIo io = {
+        get_host_char,
+        poll_host_char,
+        put_host_char,
+        flush_host,
+    };
+    host.key = 'k';
+    bvm_set_io(bvm, &io, &host);
+    if ((bvm_run(bvm, UINT64_MAX, NULL) != BVM_HALTED) ||
+        (bvm_memory(bvm)[0x3009] != 'k') || (host.len < 3) ||
+        memcmp(host.output, "hik", 3) || (host.flushes == 0))
+    {
+        FAIL("test_io (host)");
+    }
+    const size_t len = host.len;
+    bvm_set_io(bvm, NULL, NULL);
+    bvm_reset(bvm);
+    if ((bvm_run(bvm, UINT64_MAX, NULL) != BVM_HALTED) ||
+        (bvm_memory(bvm)[0x3009] != 0xFFFF) || (host.len != len))
+    {
+        FAIL("test_io (none)");
+    }
+    bvm_destroy(bvm);
+    printf(".");
+}
+
+static void test_trap(void) {
+    const char source[] = ".ORIG x3000\n"
+                          "      AND R0, R0, #0\n"
+                          "      TRAP x30\n"
+                          "      TRAP x30\n"
+                          "      OUT\n"
+                          "      HALT\n"
+                          ".END\n";
+    Bvm*        bvm = get_test_bvm(source);
+    Host        host = {0};
+    const BvmIo io = {NULL, NULL, put_host_char, NULL};
+    Handler     add = {0, BVM_HANDLED};
+    Handler     out = {0, BVM_UNHANDLED};
+    bvm_set_io(bvm, &io, &host);
+    bvm_set_trap(bvm, 0x30, handle_test_trap, &add);
+    bvm_set_trap(bvm, 0x21, count_test_trap, &out);
+    if ((bvm_run(bvm, UINT64_MAX, NULL) != BVM_HALTED) || (add.calls != 2) ||
+        (out.calls != 1) || (host.len == 0) || (host.output[0] != 2))
+    {
+        FAIL("test_trap (handled)");
+    }
+    add.calls = 0;
+    add.result = BVM_YIELD;
+    bvm_reset(bvm);
+    if ((bvm_run(bvm, UINT64_MAX, NULL) != BVM_TRAPPED) || (add.calls != 1) ||
+        (bvm_registers(bvm)[BVM_R0] != 1) ||
+        (bvm_registers(bvm)[BVM_PC] != 0x3002))
+    {
+        FAIL("test_trap (yield)");
+    }
+    if ((bvm_run(bvm, UINT64_MAX, NULL) != BVM_TRAPPED) ||
+        (bvm_run(bvm, UINT64_MAX, NULL) != BVM_HALTED) || (add.calls != 2) ||
+        (bvm_registers(bvm)[BVM_R0] != 2))
+    {
+        FAIL("test_trap (resume)");
+    }
+    bvm_set_trap(bvm, 0x30, NULL, NULL);
+    bvm_reset(bvm);
+    if ((bvm_run(bvm, UINT64_MAX, NULL) != BVM_HALTED) || (add.calls != 2) ||
+        bvm_registers(bvm)[BVM_R0])
+    {
+        FAIL("test_trap (none)");
+    }
+    bvm_destroy(bvm);
+    printf(".");
+}
+
+static void test_break(void) {
+    const char source[] = ".ORIG x3000\n"
+                          "      ADD R0, R0, #1\n"
+                          "      .FILL xD000\n"
+                          "      HALT\n"
+                          ".END\n";
+    Bvm* bvm = get_test_bvm(source);
+    if ((bvm_run(bvm, UINT64_MAX, NULL) != BVM_BREAK) ||
+        (bvm_registers(bvm)[BVM_R0] != 1))
+    {
+        FAIL("test_break");
+    }
+    bvm_destroy(bvm);
+    printf(".");
+}
+
+/* NOTE: Packing loses nothing, whether the guest is read after it or run
+ * again. */
+static void test_pack(void) {
+    Bvm*      bvm = get_test_bvm(COUNT_SOURCE);
+    uint16_t* copy = malloc(BVM_MEMORY_SIZE * sizeof(uint16_t));
+    if (copy == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    bvm_run(bvm, UINT64_MAX, NULL);
+    uint16_t* mem = bvm_memory(bvm);
+    for (uint32_t i = 0x4000; i < 0x4100; i += 4) {
+        mem[i] = (uint16_t)i;
+    }
+    bvm_touch(bvm, 0x4000, 0x100);
+    memcpy(copy, mem, BVM_MEMORY_SIZE * sizeof(uint16_t));
+    if ((bvm_pack(bvm) == 0) || (bvm_pack(bvm) == 0)) {
+        FAIL("test_pack (bvm_pack)");
+    }
+    if (memcmp(bvm_memory(bvm), copy, BVM_MEMORY_SIZE * sizeof(uint16_t))) {
+        FAIL("test_pack (bvm_memory)");
+    }
+    bvm_pack(bvm);
+    bvm_reset(bvm);
+    if ((bvm_run(bvm, UINT64_MAX, NULL) != BVM_HALTED) ||
+        (bvm_memory(bvm)[RESULT_AT] != 50) || bvm_memory(bvm)[0x4000])
+    {
+        FAIL("test_pack (run)");
+    }
+    free(copy);
+    bvm_destroy(bvm);
+    printf(".");
+}
+
+int main(void) {
+    test_assemble_error();
+    test_load();
+    test_run_budget();
+    test_memory();
+    test_io();
+    test_trap();
+    test_break();
+    test_pack();
+    bvm_destroy(NULL);
+    printf("\nDone!\n");
+    return EXIT_SUCCESS;
+}
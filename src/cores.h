@@ -0,0 +1,82 @@
+#ifndef __CORES_H__
+#define __CORES_H__
+
+#include "server.h"
+
+/* NOTE: Runs a guest on several cores at once. Every core has its own
+ * registers and starts at `PC_START`, and all of them share the first
+ * core's memory; a guest tells the cores apart by reading `CORE_ID` (and
+ * `CORE_COUNT`). Each core runs on its own host thread.
+ *
+ * Memory ordering: loads and stores of a word are relaxed atomics, so they
+ * are never torn, and they are ordered as the host orders them, which on
+ * x86 is total store order (a core sees its own stores at once, and
+ * everyone sees a core's stores in the order it made them, but a store may
+ * still be in flight when the same core loads another address).
+ * `TRAP_CAS` is sequentially consistent and fences everything around it,
+ * so guests should publish and acquire shared data through it.
+ *
+ * The cores run in the interpreter, since a tier only watches its own
+ * core's stores for self-modifying code. */
+#define CORE_CAP 64
+
+typedef struct {
+    Vm* vm;
+    u64 budget;
+    u64 deadline;
+    u64 instrs;
+} Core;
+
+static void set_core(Vm* core, const Vm* first, u16 id, u16 count) {
+    core->mem = first->mem;
+    memset(core->reg, 0, sizeof(core->reg));
+    core->reg[R_PC] = PC_START;
+    core->core = id;
+    core->core_count = count;
+    core->status = ALIVE;
+    core->image = first->image;
+    core->io = first->io;
+    core->io_data = first->io_data;
+    core->trap = first->trap;
+}
+
+static void* do_run_core(void* data) {
+    Core* core = data;
+    core->instrs = run_vm(core->vm, core->budget, core->deadline);
+    return NULL;
+}
+
+/* NOTE: Runs `vm` as core `0` on the calling thread, alongside `count - 1`
+ * more, until all of them stop. `budget` applies to each core. Returns the
+ * number of instructions run across all of them. */
+static u64 run_cores(Vm* vm, u16 count, u64 budget, u64 deadline) {
+    Core   cores[CORE_CAP];
+    Thread threads[CORE_CAP];
+    vm->core = 0;
+    vm->core_count = count;
+    for (u16 i = 0; i < count; ++i) {
+        cores[i].vm = i ? get_vm() : vm;
+        cores[i].budget = budget;
+        cores[i].deadline = deadline;
+        cores[i].instrs = 0;
+        if (i) {
+            set_core(cores[i].vm, vm, i, count);
+        }
+    }
+    for (u16 i = 1; i < count; ++i) {
+        if (pthread_create(&threads[i], NULL, do_run_core, &cores[i])) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    do_run_core(&cores[0]);
+    u64 instrs = cores[0].instrs;
+    for (u16 i = 1; i < count; ++i) {
+        pthread_join(threads[i], NULL);
+        instrs += cores[i].instrs;
+        do_free_vm(cores[i].vm);
+    }
+    vm->core_count = 1;
+    return instrs;
+}
+
+#endif
@@ -0,0 +1,285 @@
+#ifndef __DEBUG_H__
+#define __DEBUG_H__
+
+#include "server.h"
+
+/* NOTE: Breakpoints overwrite guest code with `OP_RES` and watchpoints flag
+ * their page, so the interpreter runs at full speed between stops. A guest
+ * store over a breakpoint replaces it. */
+#define BREAK_INSTR (OP_RES << 12)
+
+typedef struct {
+    u64   breaks[MEM_SIZE / 64];
+    u64   watches[MEM_SIZE / 64];
+    u16   originals[MEM_SIZE];
+    File* input;
+    File* output;
+} Debug;
+
+static Bool get_bit(const u64* bits, u16 address) {
+    return (bits[address >> 6] >> (address & 0x3F)) & 1;
+}
+
+static void set_bit(u64* bits, u16 address) {
+    bits[address >> 6] |= 1llu << (address & 0x3F);
+}
+
+static void unset_bit(u64* bits, u16 address) {
+    bits[address >> 6] &= ~(1llu << (address & 0x3F));
+}
+
+static void set_break(Vm* vm, Debug* debug, u16 address) {
+    if (get_bit(debug->breaks, address)) {
+        return;
+    }
+    debug->originals[address] = vm->mem[address];
+    vm->mem[address] = BREAK_INSTR;
+    ++vm->generations[address >> PAGE_BITS];
+    set_bit(debug->breaks, address);
+}
+
+static void unset_break(Vm* vm, Debug* debug, u16 address) {
+    if (!get_bit(debug->breaks, address)) {
+        return;
+    }
+    if (vm->mem[address] == BREAK_INSTR) {
+        vm->mem[address] = debug->originals[address];
+        ++vm->generations[address >> PAGE_BITS];
+    }
+    unset_bit(debug->breaks, address);
+}
+
+static void set_watch(Vm* vm, Debug* debug, u16 address) {
+    set_bit(debug->watches, address);
+    vm->pages[address >> PAGE_BITS] |= PAGE_WATCH;
+}
+
+static void unset_watch(Vm* vm, Debug* debug, u16 address) {
+    unset_bit(debug->watches, address);
+    const u64* bits =
+        &debug->watches[(address >> PAGE_BITS) * (PAGE_SIZE / 64)];
+    for (u8 i = 0; i < (PAGE_SIZE / 64); ++i) {
+        if (bits[i]) {
+            return;
+        }
+    }
+    vm->pages[address >> PAGE_BITS] &= (u8)~PAGE_WATCH;
+}
+
+/* NOTE: Runs up to `budget` instructions, or until `SIGINT`. A breakpoint
+ * under the current `R_PC` is lifted for one instruction so the guest can
+ * move past it. */
+static void do_run_debug(Vm* vm, Debug* debug, u64 budget) {
+    SigAction previous;
+    INTERRUPT = 0;
+    set_run_interrupt(&previous);
+    const u16 pc = vm->reg[R_PC];
+    if (get_bit(debug->breaks, pc) && (vm->mem[pc] == BREAK_INSTR)) {
+        vm->mem[pc] = debug->originals[pc];
+        run_vm(vm, 1, 0);
+        debug->originals[pc] = vm->mem[pc];
+        vm->mem[pc] = BREAK_INSTR;
+        if (vm->status == EXHAUSTED) {
+            vm->status = ALIVE;
+        }
+        --budget;
+    }
+    if ((vm->status == ALIVE) && budget) {
+        run_vm(vm, budget, 0);
+    }
+    if (vm->status == EXHAUSTED) {
+        vm->status = ALIVE;
+    }
+    sigaction(SIGINT, &previous, NULL);
+    INTERRUPT = 0;
+}
+
+static void do_print_stop(const Vm* vm, const Debug* debug) {
+    const u16 pc = vm->reg[R_PC];
+    switch (vm->status) {
+    case DEAD: {
+        fprintf(debug->output, "halted\n");
+        break;
+    }
+    case STOPPED: {
+        if (get_bit(debug->breaks, pc) && (vm->mem[pc] == BREAK_INSTR)) {
+            const char* symbol =
+                vm->image->native ? get_symbol(vm->image->native, pc) : NULL;
+            if (symbol) {
+                fprintf(debug->output, "break x%04X %s\n", (u32)pc, symbol);
+            } else {
+                fprintf(debug->output, "break x%04X\n", (u32)pc);
+            }
+        } else {
+            fprintf(debug->output,
+                    "watch x%04X (pc x%04X)\n",
+                    (u32)vm->watch_address,
+                    (u32)pc);
+        }
+        break;
+    }
+    case FAULTED: {
+        fprintf(debug->output, "faulted (pc x%04X)\n", (u32)pc);
+        break;
+    }
+    case INTERRUPTED: {
+        fprintf(debug->output, "interrupted x%04X\n", (u32)pc);
+        break;
+    }
+    case ALIVE:
+    case EXHAUSTED:
+    case EXPIRED:
+    case BLOCKED: {
+        fprintf(debug->output, "pc x%04X\n", (u32)pc);
+        break;
+    }
+    }
+}
+
+static void do_print_registers(const Vm* vm, const Debug* debug) {
+    for (u8 i = R_0; i <= R_7; ++i) {
+        fprintf(debug->output, "R%u x%04X ", (u32)i, (u32)vm->reg[i]);
+    }
+    fprintf(debug->output,
+            "\nPC x%04X COND x%04X\n",
+            (u32)vm->reg[R_PC],
+            (u32)vm->reg[R_COND]);
+}
+
+static void do_print_memory(const Vm* vm,
+                            const Debug* debug,
+                            u16          address,
+                            u32          n) {
+    for (u32 i = 0; i < n; ++i) {
+        const u16 at = (u16)(address + i);
+        if (!(i & 0x7)) {
+            fprintf(debug->output, i ? "\nx%04X:" : "x%04X:", (u32)at);
+        }
+        /* NOTE: A guest store over a breakpoint leaves the bit set, but the
+         * word in memory is then the guest's own. */
+        const Bool hidden =
+            get_bit(debug->breaks, at) && (vm->mem[at] == BREAK_INSTR);
+        fprintf(debug->output,
+                " %04X",
+                (u32)(hidden ? debug->originals[at] : vm->mem[at]));
+    }
+    fprintf(debug->output, "\n");
+}
+
+/* NOTE: Commands, one per line, with addresses in hex and counts in
+ * decimal:
+ *     b ADDR     set a breakpoint
+ *     d ADDR     delete a breakpoint
+ *     w ADDR     watch stores to an address
+ *     u ADDR     stop watching an address
+ *     s [N]      step N (default 1) instructions
+ *     c          continue until a stop, a halt or `SIGINT`
+ *     r          print registers
+ *     m ADDR [N] print N (default 8) words of memory
+ *     q          quit */
+static void do_debug(Vm* vm, File* input, File* output) {
+    Debug* debug = calloc(1, sizeof(Debug));
+    if (debug == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    debug->input = input;
+    debug->output = output;
+    vm->watches = debug->watches;
+    char line[64];
+    for (;;) {
+        fprintf(output, "(bvm) ");
+        fflush(output);
+        if (fgets(line, sizeof(line), input) == NULL) {
+            break;
+        }
+        char      command = '\0';
+        u32       address = 0;
+        u32       n = 0;
+        const i32 read = sscanf(line, " %c %x %u", &command, &address, &n);
+        if (read < 1) {
+            continue;
+        }
+        /* NOTE: Without an address these would all act on `x0000`. */
+        if ((read < 2) && strchr("bdwum", command)) {
+            fprintf(output, "?\n");
+            continue;
+        }
+        /* NOTE: `s` takes a count where the others take an address. */
+        if (command == 's') {
+            sscanf(line, " %*c %u", &n);
+        }
+        if (command == 'q') {
+            break;
+        }
+        if ((vm->status == DEAD) && ((command == 's') || (command == 'c'))) {
+            do_print_stop(vm, debug);
+            continue;
+        }
+        switch (command) {
+        case 'b': {
+            set_break(vm, debug, (u16)address);
+            break;
+        }
+        case 'd': {
+            unset_break(vm, debug, (u16)address);
+            break;
+        }
+        case 'w': {
+            set_watch(vm, debug, (u16)address);
+            break;
+        }
+        case 'u': {
+            unset_watch(vm, debug, (u16)address);
+            break;
+        }
+        case 's':
+        case 'c': {
+            vm->status = ALIVE;
+            if (input == stdin) {
+                disable_input_buffering();
+            }
+            do_run_debug(vm, debug, command == 'c' ? U64_MAX : (n ? n : 1));
+            if (input == stdin) {
+                restore_input_buffering();
+            }
+            do_print_stop(vm, debug);
+            break;
+        }
+        case 'r': {
+            do_print_registers(vm, debug);
+            break;
+        }
+        case 'm': {
+            do_print_memory(vm, debug, (u16)address, n ? n : 8);
+            break;
+        }
+        default: {
+            fprintf(output, "?\n");
+        }
+        }
+    }
+    vm->watches = NULL;
+    free(debug);
+}
+
+/* NOTE: Serves a single debugger session on a Unix domain socket, while the
+ * guest keeps using the terminal. */
+static void do_debug_remote(Vm* vm, const char* path) {
+    const i32 listen_fd = get_listen_fd(path, 0);
+    const i32 fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+        exit(EXIT_FAILURE);
+    }
+    close(listen_fd);
+    File* input = fdopen(fd, "r");
+    File* output = fdopen(dup(fd), "w");
+    if ((input == NULL) || (output == NULL)) {
+        exit(EXIT_FAILURE);
+    }
+    do_debug(vm, input, output);
+    fclose(input);
+    fclose(output);
+    unlink(path);
+}
+
+#endif
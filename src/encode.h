@@ -0,0 +1,292 @@
+#ifndef __ENCODE_H__
+#define __ENCODE_H__
+
+#include "pre_vm.h"
+
+typedef struct {
+    i16    immediate_or_offset;
+    u8     r0_or_nzp;
+    u8     r1;
+    u8     r2;
+    Trap   trap;
+    Bool   mode;
+    OpCode op;
+} Instr;
+
+static void set_op(u16* instr, OpCode op) {
+    *instr = (u16)(*instr | (op << 12));
+}
+
+static void set_r0_or_nzp(u16* instr, u8 r0_or_nzp) {
+    *instr = (u16)(*instr | ((r0_or_nzp & 0x7) << 9));
+}
+
+static void set_r1(u16* instr, u8 r1) {
+    *instr = (u16)(*instr | ((r1 & 0x7) << 6));
+}
+
+static void set_r2(u16* instr, u8 r2) {
+    *instr = (u16)(*instr | (r2 & 0x7));
+}
+
+static void set_immediate(u16* instr, i8 immediate) {
+    *instr = (u16)(*instr | (1 << 5) | (immediate & 0x1F));
+}
+
+static void set_pc_offset_9(u16* instr, i16 pc_offset) {
+    *instr = (u16)(*instr | (pc_offset & 0x1FF));
+}
+
+static void set_relative_mode_and_pc_offset_11(u16* instr, i16 pc_offset) {
+    *instr = (u16)(*instr | (1 << 11) | (pc_offset & 0x7FF));
+}
+
+static void set_reg_offset_6(u16* instr, i16 pc_offset) {
+    *instr = (u16)(*instr | (pc_offset & 0x3F));
+}
+
+static void set_trap(u16* instr, Trap trap) {
+    *instr = (u16)(*instr | (trap & 0xFF));
+}
+
+static u16 get_op_branch(Instr instr) {
+    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // | 0   0   0   0 |    NZP    |             PC_OFFSET             |
+    // +---------------+-----------+-----------------------------------+
+    u16 bin_instr = 0;
+    set_op(&bin_instr, OP_BR);
+    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
+    set_pc_offset_9(&bin_instr, instr.immediate_or_offset);
+    return bin_instr;
+}
+
+static u16 get_op_add(Instr instr) {
+    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // |               |           |           | 1 |     IMMEDIATE     |
+    // | 0   0   0   1 |     R0    |     R1    +---+-------+-----------|
+    // |               |           |           | 0 |  NULL |     R2    |
+    // +---------------+-----------+-----------+---+-------+-----------+
+    u16 bin_instr = 0;
+    set_op(&bin_instr, OP_ADD);
+    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
+    set_r1(&bin_instr, instr.r1);
+    if (instr.mode) {
+        set_immediate(&bin_instr, (i8)instr.immediate_or_offset);
+    } else {
+        set_r2(&bin_instr, instr.r2);
+    }
+    return bin_instr;
+}
+
+static u16 get_op_load(Instr instr) {
+    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // | 0   0   1   0 |     R0    |             PC_OFFSET             |
+    // +---------------+-----------+-----------------------------------+
+    u16 bin_instr = 0;
+    set_op(&bin_instr, OP_LD);
+    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
+    set_pc_offset_9(&bin_instr, instr.immediate_or_offset);
+    return bin_instr;
+}
+
+static u16 get_op_store(Instr instr) {
+    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // | 0   0   1   1 |     R0    |             PC_OFFSET             |
+    // +---------------+-----------+-----------------------------------+
+    u16 bin_instr = 0;
+    set_op(&bin_instr, OP_ST);
+    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
+    set_pc_offset_9(&bin_instr, instr.immediate_or_offset);
+    return bin_instr;
+}
+
+static u16 get_op_jump_subroutine(Instr instr) {
+    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // |               | 1 |                 PC_OFFSET                 |
+    // | 0   1   0   0 +---+-------+-----------+-----------------------+
+    // |               | 0 |  NULL |     R1    |          NULL         |
+    // +---------------+---+-------+-----------+-----------------------+
+    u16 bin_instr = 0;
+    set_op(&bin_instr, OP_JSR);
+    if (instr.mode) {
+        set_relative_mode_and_pc_offset_11(&bin_instr,
+                                           instr.immediate_or_offset);
+    } else {
+        set_r1(&bin_instr, instr.r1);
+    }
+    return bin_instr;
+}
+
+static u16 get_op_and(Instr instr) {
+    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // |               |           |           | 1 |     IMMEDIATE     |
+    // | 0   1   0   1 |     R0    |     R1    +---+-------+-----------|
+    // |               |           |           | 0 |  NULL |     R2    |
+    // +---------------+-----------+-----------+---+-------+-----------+
+    u16 bin_instr = 0;
+    set_op(&bin_instr, OP_AND);
+    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
+    set_r1(&bin_instr, instr.r1);
+    if (instr.mode) {
+        set_immediate(&bin_instr, (i8)instr.immediate_or_offset);
+    } else {
+        set_r2(&bin_instr, instr.r2);
+    }
+    return bin_instr;
+}
+
+static u16 get_op_load_register(Instr instr) {
+    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // | 0   1   1   0 |     R0    |     R1    |         OFFSET        |
+    // +---------------+-----------+-----------+-----------------------+
+    u16 bin_instr = 0;
+    set_op(&bin_instr, OP_LDR);
+    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
+    set_r1(&bin_instr, instr.r1);
+    set_reg_offset_6(&bin_instr, instr.immediate_or_offset);
+    return bin_instr;
+}
+
+static u16 get_op_store_register(Instr instr) {
+    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // | 0   1   1   1 |     R0    |     R1    |         OFFSET        |
+    // +---------------+-----------+-----------+-----------------------+
+    u16 bin_instr = 0;
+    set_op(&bin_instr, OP_STR);
+    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
+    set_r1(&bin_instr, instr.r1);
+    set_reg_offset_6(&bin_instr, instr.immediate_or_offset);
+    return bin_instr;
+}
+
+static u16 get_op_not(Instr instr) {
+    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // | 1   0   0   1 |     R0    |     R1    | 1 | 1 | 1 | 1 | 1 | 1 |
+    // +---------------+-----------+-----------+---+---+---+---+---+---+
+    u16 bin_instr = 0;
+    set_op(&bin_instr, OP_NOT);
+    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
+    set_r1(&bin_instr, instr.r1);
+    set_reg_offset_6(&bin_instr, -1);
+    return bin_instr;
+}
+
+static u16 get_op_load_indirect(Instr instr) {
+    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // | 1   0   1   0 |     R0    |             PC_OFFSET             |
+    // +---------------+-----------+-----------------------------------+
+    u16 bin_instr = 0;
+    set_op(&bin_instr, OP_LDI);
+    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
+    set_pc_offset_9(&bin_instr, instr.immediate_or_offset);
+    return bin_instr;
+}
+
+static u16 get_op_store_indirect(Instr instr) {
+    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // | 1   0   1   1 |     R0    |             PC_OFFSET             |
+    // +---------------+-----------+-----------------------------------+
+    u16 bin_instr = 0;
+    set_op(&bin_instr, OP_STI);
+    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
+    set_pc_offset_9(&bin_instr, instr.immediate_or_offset);
+    return bin_instr;
+}
+
+static u16 get_op_jump(Instr instr) {
+    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // | 1   1   0   0 |    NULL   |     R1    |          NULL         |
+    // +---------------+-----------+-----------------------------------+
+    u16 bin_instr = 0;
+    set_op(&bin_instr, OP_JMP);
+    set_r1(&bin_instr, instr.r1);
+    return bin_instr;
+}
+
+static u16 get_op_load_effective_address(Instr instr) {
+    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // | 1   1   1   0 |     R0    |             PC_OFFSET             |
+    // +---------------+-----------+-----------------------------------+
+    u16 bin_instr = 0;
+    set_op(&bin_instr, OP_LEA);
+    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
+    set_pc_offset_9(&bin_instr, instr.immediate_or_offset);
+    return bin_instr;
+}
+
+static u16 get_op_trap(Instr instr) {
+    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // | 1   1   1   1 |      NULL     |              TRAP             |
+    // +---------------+---------------+-------------------------------+
+    u16 bin_instr = 0;
+    set_op(&bin_instr, OP_TRAP);
+    set_trap(&bin_instr, instr.trap);
+    return bin_instr;
+}
+
+static u16 get_bin_instr(Instr instr) {
+    switch (instr.op) {
+    case OP_BR: {
+        return get_op_branch(instr);
+    }
+    case OP_ADD: {
+        return get_op_add(instr);
+    }
+    case OP_LD: {
+        return get_op_load(instr);
+    }
+    case OP_ST: {
+        return get_op_store(instr);
+    }
+    case OP_JSR: {
+        return get_op_jump_subroutine(instr);
+    }
+    case OP_AND: {
+        return get_op_and(instr);
+    }
+    case OP_LDR: {
+        return get_op_load_register(instr);
+    }
+    case OP_STR: {
+        return get_op_store_register(instr);
+    }
+    case OP_NOT: {
+        return get_op_not(instr);
+    }
+    case OP_LDI: {
+        return get_op_load_indirect(instr);
+    }
+    case OP_STI: {
+        return get_op_store_indirect(instr);
+    }
+    case OP_JMP: {
+        return get_op_jump(instr);
+    }
+    case OP_LEA: {
+        return get_op_load_effective_address(instr);
+    }
+    case OP_TRAP: {
+        return get_op_trap(instr);
+    }
+    case OP_RES: {
+        break;
+    }
+    }
+    exit(EXIT_FAILURE);
+}
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef __FORK_H__
+#define __FORK_H__
+
+#include "fuzz.h"
+#include "server.h"
+
+#include <unistd.h>
+
+/* NOTE: `get_fork` copies a VM without copying its memory: the fork reads
+ * every page from its parent (see `get_word_at`) and takes a copy of a page
+ * only when it first stores to it. To keep that sound the parent is frozen
+ * by its first fork, and storing to a frozen VM stops it as `FAULTED`. A
+ * frozen VM can still be forked again, so to carry on running a VM and
+ * explore from it as well, fork it twice and run one of the forks.
+ *
+ * Frozen VMs never change, so forks of the same ancestors can run on any
+ * number of threads at once. Each fork holds a reference to its parent, and
+ * `do_release_vm` frees a VM once it and all of its forks are released.
+ *
+ * `--explore` uses this to search a guest's futures: the image runs until
+ * it waits for input, then is forked once for each key in `moves`, each
+ * fork given its key and run until it waits again, down to `depth` keys.
+ * Branches are taken depth first by a thread per host CPU. Every leaf
+ * prints the keys that led to it, how it stopped, and a hash of the output
+ * from its last key. */
+#define EXPLORE_DEPTH_CAP  32
+#define EXPLORE_THREAD_CAP 64
+
+typedef struct Branch Branch;
+
+struct Branch {
+    Vm*     vm;
+    Buffers buffers;
+    Branch* next;
+    char    path[EXPLORE_DEPTH_CAP + 1];
+    u32     depth;
+};
+
+typedef struct {
+    const char* moves;
+    u32         depth;
+    u64         budget;
+    Mutex       lock;
+    Cond        ready;
+    Branch*     head;
+    u32         pending;
+    u64         forks;
+    u64         leaves;
+    u64         instrs;
+    u64         copies;
+} Explorer;
+
+static Vm* get_fork(Vm* parent) {
+    do_unpack_vm(parent);
+    Vm* vm = get_vm();
+    for (u32 i = 0; i < PAGE_COUNT; ++i) {
+        const u8 flags = parent->pages[i];
+        vm->sources[i] = (flags & PAGE_SHARED)
+                             ? parent->sources[i]
+                             : &parent->mem[i << PAGE_BITS];
+        vm->pages[i] =
+            (u8)(PAGE_SHARED | (flags & (PAGE_DIRTY | PAGE_DEVICE)));
+        parent->pages[i] = (u8)(flags | PAGE_FROZEN);
+    }
+    memcpy(vm->dirty, parent->dirty, sizeof(vm->dirty));
+    memcpy(vm->reg, parent->reg, sizeof(vm->reg));
+    vm->status = parent->status;
+    vm->image = parent->image;
+    vm->io = parent->io;
+    vm->io_data = parent->io_data;
+    vm->trap = parent->trap;
+    vm->parent = parent;
+    __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    return vm;
+}
+
+/* NOTE: Use this rather than `do_free_vm` for anything that has been
+ * forked, or is a fork. */
+static void do_release_vm(Vm* vm) {
+    while (vm && !__atomic_sub_fetch(&vm->refs, 1, __ATOMIC_ACQ_REL)) {
+        Vm* parent = vm->parent;
+        do_free_vm(vm);
+        vm = parent;
+    }
+}
+
+/* NOTE: A branch waiting for input stops before its `TRAP` runs (see
+ * `handle_buffers_trap`), or as it polls `KEYBOARD_STATUS`, so a fork given
+ * input later reads it as if it had been there all along. A branch that
+ * sleeps waits for its next key, like one that reads, and goes back to
+ * sleep with the same deadline once it has the key. */
+static Bool wait_explore_char(Vm* vm, u64 deadline) {
+    if (poll_buffers_char(vm)) {
+        return TRUE;
+    }
+    vm->status = BLOCKED;
+    --vm->reg[R_PC];
+    return FALSE;
+}
+
+static const Io IO_EXPLORE = {
+    get_buffers_char,
+    poll_fuzz_char,
+    put_buffers_char,
+    flush_buffers,
+    get_host_clock,
+    wait_explore_char,
+};
+
+static void do_push_branch(Explorer* explorer, Branch* branch) {
+    pthread_mutex_lock(&explorer->lock);
+    branch->next = explorer->head;
+    explorer->head = branch;
+    ++explorer->pending;
+    pthread_cond_signal(&explorer->ready);
+    pthread_mutex_unlock(&explorer->lock);
+}
+
+/* NOTE: Returns `NULL` once every branch has been explored. */
+static Branch* pop_branch(Explorer* explorer) {
+    pthread_mutex_lock(&explorer->lock);
+    while ((explorer->head == NULL) && explorer->pending) {
+        pthread_cond_wait(&explorer->ready, &explorer->lock);
+    }
+    Branch* branch = explorer->head;
+    if (branch) {
+        explorer->head = branch->next;
+    }
+    pthread_mutex_unlock(&explorer->lock);
+    return branch;
+}
+
+static u32 get_output_hash(const Buffers* buffers) {
+    u32 hash = 2166136261u;
+    for (usize i = 0; i < buffers->output_len; ++i) {
+        hash = (hash ^ buffers->output[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void do_branch(Explorer* explorer, Branch* branch, u64 instrs) {
+    Vm* vm = branch->vm;
+    u64 copies = 0;
+    for (u32 i = 0; i < PAGE_COUNT; ++i) {
+        copies += !(vm->pages[i] & PAGE_SHARED);
+    }
+    const Bool leaf =
+        (vm->status != BLOCKED) || (explorer->depth <= branch->depth);
+    if (!leaf) {
+        for (const char* move = explorer->moves; *move; ++move) {
+            Branch* next = calloc(1, sizeof(Branch));
+            if (next == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            next->vm = get_fork(vm);
+            next->buffers.input = (const u8*)move;
+            next->buffers.input_len = 1;
+            memcpy(next->path, branch->path, branch->depth);
+            next->path[branch->depth] = *move;
+            next->depth = branch->depth + 1;
+            do_push_branch(explorer, next);
+        }
+    }
+    pthread_mutex_lock(&explorer->lock);
+    if (leaf) {
+        printf("%s %s %08X\n",
+               branch->depth ? branch->path : "-",
+               vm->status == DEAD        ? "halted"
+               : vm->status == EXHAUSTED ? "exhausted"
+               : vm->status == BLOCKED   ? "input"
+               : vm->status == FAULTED   ? "faulted"
+                                         : "stopped",
+               get_output_hash(&branch->buffers));
+        ++explorer->leaves;
+    } else {
+        explorer->forks += strlen(explorer->moves);
+    }
+    explorer->instrs += instrs;
+    explorer->copies += copies;
+    if (!--explorer->pending) {
+        pthread_cond_broadcast(&explorer->ready);
+    }
+    pthread_mutex_unlock(&explorer->lock);
+}
+
+static void* do_explore_work(void* data) {
+    Explorer* explorer = data;
+    Tier*     tier = calloc(1, sizeof(Tier));
+    if (tier == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for (Branch* branch; (branch = pop_branch(explorer));) {
+        Vm* vm = branch->vm;
+        vm->io = &IO_EXPLORE;
+        vm->io_data = &branch->buffers;
+        vm->trap = handle_buffers_trap;
+        vm->status = vm->status == BLOCKED ? ALIVE : vm->status;
+        const u64 instrs = run_tiered(vm, tier, explorer->budget, 0);
+        do_branch(explorer, branch, instrs);
+        do_release_vm(vm);
+        free(branch->buffers.output);
+        free(branch);
+    }
+    free(tier);
+    return NULL;
+}
+
+/* NOTE: `vm` is left frozen. */
+static void do_explore(Vm* vm, const char* moves, u32 depth, u64 budget) {
+    Explorer explorer = {0};
+    explorer.moves = moves;
+    explorer.depth = depth;
+    explorer.budget = budget;
+    pthread_mutex_init(&explorer.lock, NULL);
+    pthread_cond_init(&explorer.ready, NULL);
+    Branch* root = calloc(1, sizeof(Branch));
+    if (root == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    root->vm = get_fork(vm);
+    do_push_branch(&explorer, root);
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const u32  n = cpus < 1                    ? 1
+                   : EXPLORE_THREAD_CAP < cpus ? EXPLORE_THREAD_CAP
+                                               : (u32)cpus;
+    Thread     threads[EXPLORE_THREAD_CAP];
+    const u64  start = get_monotonic_ns();
+    for (u32 i = 1; i < n; ++i) {
+        if (pthread_create(&threads[i], NULL, do_explore_work, &explorer)) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    do_explore_work(&explorer);
+    for (u32 i = 1; i < n; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    fprintf(stderr,
+            "explore forks %" PRIu64 ", leaves %" PRIu64 ", instrs %" PRIu64
+            ", pages copied %" PRIu64 " (%" PRIu64 " per fork), %" PRIu64
+            " us, %u threads\n",
+            explorer.forks,
+            explorer.leaves,
+            explorer.instrs,
+            explorer.copies,
+            explorer.copies / (explorer.forks + 1),
+            (get_monotonic_ns() - start) / 1000,
+            n);
+    pthread_cond_destroy(&explorer.ready);
+    pthread_mutex_destroy(&explorer.lock);
+}
+
+#endif
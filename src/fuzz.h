@@ -0,0 +1,331 @@
+#ifndef __FUZZ_H__
+#define __FUZZ_H__
+
+#include "vm.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+typedef DIR           Dir;
+typedef struct dirent Dirent;
+
+#define MAP_SIZE   (1 << 16)
+#define INPUT_MAX  (1 << 10)
+#define CORPUS_CAP (1 << 12)
+
+#define FUZZ_BUDGET (1 << 22)
+
+typedef struct {
+    u8*   bytes;
+    usize len;
+} Input;
+
+typedef struct {
+    u8          trace[MAP_SIZE];
+    u8          virgin[MAP_SIZE];
+    u8          buffer[INPUT_MAX];
+    Input       corpus[CORPUS_CAP];
+    u32         corpus_len;
+    u32         files;
+    u32         edges;
+    u64         execs;
+    u64         hangs;
+    u64         rng;
+    const char* path;
+} Fuzz;
+
+/* NOTE: Inputs run out rather than block, so each execution ends as soon as
+ * the guest asks for more than the fuzzer gave it. */
+static i32 get_fuzz_char(Vm* vm) {
+    const i32 x = get_buffers_char(vm);
+    if (x == EOF) {
+        vm->status = BLOCKED;
+    }
+    return x;
+}
+
+static Bool poll_fuzz_char(Vm* vm) {
+    if (poll_buffers_char(vm)) {
+        return TRUE;
+    }
+    vm->status = BLOCKED;
+    return FALSE;
+}
+
+static void put_null_char(Vm* vm, char x) {
+}
+
+/* NOTE: Nothing more will arrive, so there is no point sleeping. */
+static Bool wait_fuzz_char(Vm* vm, u64 deadline) {
+    return poll_fuzz_char(vm);
+}
+
+static const Io IO_FUZZ = {
+    get_fuzz_char,
+    poll_fuzz_char,
+    put_null_char,
+    flush_buffers,
+    get_host_clock,
+    wait_fuzz_char,
+};
+
+static u64 get_random(Fuzz* fuzz) {
+    /* NOTE: See `https://en.wikipedia.org/wiki/Xorshift`. */
+    fuzz->rng ^= fuzz->rng << 13;
+    fuzz->rng ^= fuzz->rng >> 7;
+    fuzz->rng ^= fuzz->rng << 17;
+    return fuzz->rng;
+}
+
+static u8 get_bucket(u8 count) {
+    if (count < 4) {
+        return count == 3 ? 4 : count;
+    }
+    if (count < 8) {
+        return 8;
+    }
+    if (count < 16) {
+        return 16;
+    }
+    if (count < 32) {
+        return 32;
+    }
+    return count < 128 ? 64 : 128;
+}
+
+/* NOTE: Folds the last execution's trace into `virgin`, clearing the trace
+ * as it goes. Returns `TRUE` if any edge or hit-count bucket was new. */
+static Bool get_new_coverage(Fuzz* fuzz) {
+    Bool new = FALSE;
+    for (u32 i = 0; i < (MAP_SIZE / 8); ++i) {
+        u64 word;
+        memcpy(&word, &fuzz->trace[i * 8], sizeof(u64));
+        if (!word) {
+            continue;
+        }
+        for (u32 j = i * 8; j < ((i + 1) * 8); ++j) {
+            const u8 bucket = get_bucket(fuzz->trace[j]);
+            if (bucket & fuzz->virgin[j]) {
+                if (fuzz->virgin[j] == 0xFF) {
+                    ++fuzz->edges;
+                }
+                fuzz->virgin[j] &= (u8)~bucket;
+                new = TRUE;
+            }
+            fuzz->trace[j] = 0;
+        }
+    }
+    return new;
+}
+
+static void do_run_fuzz(Vm* vm, Fuzz* fuzz, usize len, u64 budget) {
+    Buffers* buffers = vm->io_data;
+    do_reset_vm(vm);
+    vm->prev_location = 0;
+    buffers->input = fuzz->buffer;
+    buffers->input_len = len;
+    buffers->input_index = 0;
+    run_vm(vm, budget, 0);
+    if (vm->status == EXHAUSTED) {
+        ++fuzz->hangs;
+    }
+    ++fuzz->execs;
+}
+
+/* NOTE: Seeds need not be numbered from `0`, or at all, so names that are
+ * taken are skipped rather than written over. */
+static void do_write_input(Fuzz* fuzz, usize len) {
+    for (;;) {
+        char path[512];
+        snprintf(path,
+                 sizeof(path),
+                 "%s/id_%06u",
+                 fuzz->path,
+                 fuzz->files++);
+        const i32 fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if ((fd == -1) && (errno == EEXIST)) {
+            continue;
+        }
+        File* file = fd == -1 ? NULL : fdopen(fd, "wb");
+        if (file) {
+            fwrite(fuzz->buffer, 1, len, file);
+            fclose(file);
+        } else if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+}
+
+static void do_save_input(Fuzz* fuzz, usize len, Bool write) {
+    if ((fuzz->corpus_len == CORPUS_CAP) || (len == 0)) {
+        return;
+    }
+    Input* input = &fuzz->corpus[fuzz->corpus_len];
+    input->bytes = malloc(len);
+    if (input->bytes == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    memcpy(input->bytes, fuzz->buffer, len);
+    input->len = len;
+    if (write) {
+        do_write_input(fuzz, len);
+    }
+    ++fuzz->corpus_len;
+}
+
+static usize get_seed(Fuzz* fuzz, const char* name) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", fuzz->path, name);
+    File* file = fopen(path, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    const usize len = fread(fuzz->buffer, 1, INPUT_MAX, file);
+    fclose(file);
+    return len;
+}
+
+/* NOTE: Stacked havoc mutations, see
+ * `https://lcamtuf.coredump.cx/afl/technical_details.txt`. */
+static usize get_mutation(Fuzz* fuzz) {
+    const Input* input = &fuzz->corpus[get_random(fuzz) % fuzz->corpus_len];
+    usize        len = input->len;
+    memcpy(fuzz->buffer, input->bytes, len);
+    const u32 n = 1u << (1 + (get_random(fuzz) % 5));
+    for (u32 i = 0; i < n; ++i) {
+        const u64 r = get_random(fuzz);
+        const u8  value = (u8)(r >> 32);
+        switch (r % 6) {
+        case 0: {
+            const usize at = (r >> 8) % len;
+            fuzz->buffer[at] ^= (u8)(1 << ((r >> 4) & 0x7));
+            break;
+        }
+        case 1: {
+            fuzz->buffer[(r >> 8) % len] = value;
+            break;
+        }
+        case 2: {
+            /* NOTE: Guests mostly read printable keys, so favor those. */
+            fuzz->buffer[(r >> 8) % len] = (u8)(' ' + (value % 95));
+            break;
+        }
+        case 3: {
+            if (len < INPUT_MAX) {
+                const usize at = (r >> 8) % (len + 1);
+                memmove(&fuzz->buffer[at + 1],
+                        &fuzz->buffer[at],
+                        len - at);
+                fuzz->buffer[at] = fuzz->buffer[(r >> 40) % (len + 1)];
+                ++len;
+            }
+            break;
+        }
+        case 4: {
+            if (1 < len) {
+                const usize at = (r >> 8) % len;
+                memmove(&fuzz->buffer[at],
+                        &fuzz->buffer[at + 1],
+                        len - at - 1);
+                --len;
+            }
+            break;
+        }
+        default: {
+            const Input* other =
+                &fuzz->corpus[(r >> 8) % fuzz->corpus_len];
+            const usize at = (r >> 24) % len;
+            usize       n_bytes = other->len < len - at ? other->len
+                                                        : len - at;
+            memcpy(&fuzz->buffer[at], other->bytes, n_bytes);
+        }
+        }
+    }
+    return len;
+}
+
+/* NOTE: Fuzzes the guest's input in-process. Every execution starts from the
+ * post-load snapshot via `do_reset_vm`, so nothing is re-exec'd. Inputs that
+ * reach new edges are kept in the corpus and written to the directory at
+ * `path`, whose existing files are used as seeds. */
+static void do_fuzz(Vm* vm, const char* path, u64 budget, u64 runs) {
+    Fuzz* fuzz = calloc(1, sizeof(Fuzz));
+    if (fuzz == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    Buffers buffers = {0};
+    memset(fuzz->virgin, 0xFF, sizeof(fuzz->virgin));
+    fuzz->path = path;
+    fuzz->rng = get_monotonic_ns() | 1;
+    vm->io = &IO_FUZZ;
+    vm->io_data = &buffers;
+    vm->coverage = fuzz->trace;
+    if (budget == U64_MAX) {
+        budget = FUZZ_BUDGET;
+    }
+    mkdir(path, 0755);
+    Dir* directory = opendir(path);
+    if (directory == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for (Dirent* entry; (entry = readdir(directory));) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        const usize len = get_seed(fuzz, entry->d_name);
+        do_run_fuzz(vm, fuzz, len, budget);
+        if (get_new_coverage(fuzz)) {
+            do_save_input(fuzz, len, FALSE);
+        }
+        ++fuzz->files;
+    }
+    closedir(directory);
+    if (fuzz->corpus_len == 0) {
+        fuzz->buffer[0] = '\n';
+        do_run_fuzz(vm, fuzz, 1, budget);
+        get_new_coverage(fuzz);
+        do_save_input(fuzz, 1, TRUE);
+    }
+    const u64 start = get_monotonic_ns();
+    u64       report = start;
+    while (fuzz->execs < runs) {
+        const usize len = get_mutation(fuzz);
+        do_run_fuzz(vm, fuzz, len, budget);
+        if (get_new_coverage(fuzz)) {
+            do_save_input(fuzz, len, TRUE);
+        }
+        if ((fuzz->execs & 0x3FF) == 0) {
+            const u64 now = get_monotonic_ns();
+            if (SECOND_NS <= (now - report)) {
+                fprintf(stderr,
+                        "execs %" PRIu64 " (%" PRIu64 "/s), corpus %u, "
+                        "edges %u, hangs %" PRIu64 "\n",
+                        fuzz->execs,
+                        (fuzz->execs * SECOND_NS) / (now - start),
+                        fuzz->corpus_len,
+                        fuzz->edges,
+                        fuzz->hangs);
+                report = now;
+            }
+        }
+    }
+    const u64 elapsed = get_monotonic_ns() - start;
+    fprintf(stderr,
+            "execs %" PRIu64 " (%" PRIu64 "/s), corpus %u, edges %u, "
+            "hangs %" PRIu64 "\n",
+            fuzz->execs,
+            (fuzz->execs * SECOND_NS) / (elapsed ? elapsed : 1),
+            fuzz->corpus_len,
+            fuzz->edges,
+            fuzz->hangs);
+    for (u32 i = 0; i < fuzz->corpus_len; ++i) {
+        free(fuzz->corpus[i].bytes);
+    }
+    vm->coverage = NULL;
+    free(fuzz);
+}
+
+#endif
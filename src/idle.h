@@ -0,0 +1,130 @@
+#ifndef __IDLE_H__
+#define __IDLE_H__
+
+#include "arena.h"
+
+/* NOTE: `--pack-idle` packs the guest's memory (see `do_pack_vm`) once it
+ * has been waiting on input for `after_ms`, whether to read a key or in
+ * `TRAP_SLEEP`, so a session left sitting at a prompt holds little more
+ * than its registers. `IO_IDLE` passes everything through to the guest's
+ * own `Io`, and the guest unpacks whatever it touches once it runs again. */
+typedef struct {
+    const Io* io;
+    void*     io_data;
+    u64       after_ms;
+    u64       packs;
+    u64       pages;
+    u64       released;
+    usize     held;
+} Idle;
+
+static u32 get_moved_pages(const Vm* vm) {
+    u32 n = 0;
+    for (u32 i = 0; i < PAGE_COUNT; ++i) {
+        n += (vm->pages[i] & (PAGE_SHARED | PAGE_PACKED)) != 0;
+    }
+    return n;
+}
+
+/* NOTE: Called with the guest's own `io_data` in place. Packing only ever
+ * moves pages out of `mem`, so the pages it moved are the difference in
+ * the count, and pages left packed since the last pack are not counted
+ * again. */
+static void do_pack_idle(Idle* idle, Vm* vm) {
+    usize     released;
+    const u32 before = get_moved_pages(vm);
+    idle->held = do_pack_vm(vm, &released);
+    idle->released += released;
+    ++idle->packs;
+    idle->pages += get_moved_pages(vm) - before;
+}
+
+static i32 get_idle_char(Vm* vm) {
+    Idle* idle = vm->io_data;
+    vm->io_data = idle->io_data;
+    const u64 deadline = idle->io->get_clock(vm, CLOCK_MS) + idle->after_ms;
+    if (!idle->io->wait_char(vm, deadline)) {
+        do_pack_idle(idle, vm);
+    }
+    const i32 x = idle->io->get_char(vm);
+    vm->io_data = idle;
+    return x;
+}
+
+static Bool poll_idle_char(Vm* vm) {
+    Idle* idle = vm->io_data;
+    vm->io_data = idle->io_data;
+    const Bool x = idle->io->poll_char(vm);
+    vm->io_data = idle;
+    return x;
+}
+
+static void put_idle_char(Vm* vm, char x) {
+    Idle* idle = vm->io_data;
+    vm->io_data = idle->io_data;
+    idle->io->put_char(vm, x);
+    vm->io_data = idle;
+}
+
+static void flush_idle(Vm* vm) {
+    Idle* idle = vm->io_data;
+    vm->io_data = idle->io_data;
+    idle->io->flush(vm);
+    vm->io_data = idle;
+}
+
+static u64 get_idle_clock(Vm* vm, Clock clock) {
+    Idle* idle = vm->io_data;
+    vm->io_data = idle->io_data;
+    const u64 x = idle->io->get_clock(vm, clock);
+    vm->io_data = idle;
+    return x;
+}
+
+static Bool wait_idle_char(Vm* vm, u64 deadline) {
+    Idle* idle = vm->io_data;
+    vm->io_data = idle->io_data;
+    const u64 idle_deadline =
+        idle->io->get_clock(vm, CLOCK_MS) + idle->after_ms;
+    Bool x;
+    if (deadline <= idle_deadline) {
+        x = idle->io->wait_char(vm, deadline);
+    } else {
+        x = idle->io->wait_char(vm, idle_deadline);
+        if (!x) {
+            do_pack_idle(idle, vm);
+            x = idle->io->wait_char(vm, deadline);
+        }
+    }
+    vm->io_data = idle;
+    return x;
+}
+
+static const Io IO_IDLE = {
+    get_idle_char,
+    poll_idle_char,
+    put_idle_char,
+    flush_idle,
+    get_idle_clock,
+    wait_idle_char,
+};
+
+static void set_idle(Idle* idle, Vm* vm, u64 after_ms) {
+    idle->io = vm->io;
+    idle->io_data = vm->io_data;
+    idle->after_ms = after_ms;
+    vm->io = &IO_IDLE;
+    vm->io_data = idle;
+}
+
+static void do_print_idle_stats(const Idle* idle, File* file) {
+    fprintf(file,
+            "idle packs %" PRIu64 ", pages moved %" PRIu64
+            ", bytes released %" PRIu64 ", bytes held %zu\n",
+            idle->packs,
+            idle->pages,
+            idle->released,
+            idle->held);
+}
+
+#endif
@@ -0,0 +1,769 @@
+#ifndef __IR_H__
+#define __IR_H__
+
+#include "native.h"
+
+/* NOTE: The straight-line part of a hot block (everything up to its final
+ * branch, jump or trap) is lifted into a small SSA form, where every
+ * instruction defines one value and values are numbered by position.
+ * Lifting runs the passes as it goes:
+ *     - register promotion: guest registers are read into values on first
+ *       use and written back only where the block is left
+ *     - constant propagation: `LEA`, `AND x, #0` and friends become
+ *       constants, and immediates fold into the addresses built from them
+ *     - value numbering: an expression already computed is reused
+ *     - redundant load/store elimination: loads from known addresses reuse
+ *       what was last loaded from or stored there, and a store of the value
+ *       a word already holds only touches its page (`IR_TOUCH_CONST`), so
+ *       the page is still marked dirty and watchpoints still fire
+ *     - dead flag elimination: `set_flags` turns into a `IR_FLAGS` value
+ *       that is never run; a branch or exit that observes the flags works
+ *       them out from its operand
+ * What is left once dead values are swept is run by `run_ir`. Only
+ * addresses below the memory-mapped registers are tracked, since reading a
+ * device has side effects.
+ *
+ * A block that branches back to its own start is run as a loop: entry
+ * reads and constants are hoisted out of it, and the registers it changes
+ * are carried from one iteration to the next without going through the
+ * guest's registers. */
+#define IR_GUEST_CAP  64
+#define IR_CAP        (R_SIZE + (IR_GUEST_CAP * 4))
+#define IR_MEMORY_CAP 32
+
+#define IR_NONE 0xFFFF
+#define NO_EXIT 0xFF
+
+/* NOTE: Writes back to the guest are packed as a register and a value. */
+#define WRITE_BITS 12
+#define WRITE_MASK ((1 << WRITE_BITS) - 1)
+
+typedef enum {
+    IR_GET = 0,       // register `a` as it was on entry
+    IR_CONST,         // `a`
+    IR_ADD,           // values `a` + `b`
+    IR_ADD_IMMEDIATE, // value `a` + `b`
+    IR_AND,           // values `a` & `b`
+    IR_AND_IMMEDIATE, // value `a` & `b`
+    IR_NOT,           // ~value `a`
+    IR_FLAGS,         // condition codes of value `a`, never run
+    IR_LOAD,          // word at value `a`
+    IR_LOAD_CONST,    // word at address `a`, which is plain memory
+    IR_STORE,         // value `b` to the word at value `a`
+    IR_STORE_CONST,   // value `b` to the word at address `a`
+    IR_TOUCH_CONST,   // the word at address `a` as if stored to, unchanged
+} IrOp;
+
+/* NOTE: Loads and stores that can stop the guest carry the exit to take if
+ * they do. */
+typedef struct {
+    IrOp op;
+    u8   exit;
+    u16  a;
+    u16  b;
+} IrInstr;
+
+typedef struct {
+    u16 writes[R_SIZE];
+    u16 pc;
+    u8  len;
+    u8  count;
+} IrExit;
+
+/* NOTE: `start` is where the loop body begins, after the hoisted values;
+ * `from` and `to` are the values carried between iterations. */
+typedef struct {
+    const IrInstr* code;
+    const IrExit*  exits;
+    IrExit         end;
+    u16            from[R_COND];
+    u16            to[R_COND];
+    u16            flags;
+    u16            len;
+    u16            start;
+    u8             exit_len;
+    u8             carry_len;
+    u8             nzp;
+} IrBlock;
+
+typedef struct {
+    u64 blocks;
+    u64 guest;
+    u64 emitted;
+    u64 scheduled;
+    u64 forwarded;
+    u64 dropped;
+    u64 flags;
+    u64 instrs;
+} IrStats;
+
+typedef struct {
+    IrInstr code[IR_CAP];
+    IrExit  exits[IR_GUEST_CAP];
+    u16     regs[R_SIZE];
+    u16     addresses[IR_MEMORY_CAP];
+    u16     values[IR_MEMORY_CAP];
+    u16     len;
+    u16     guard;
+    u8      exit_len;
+    u8      memory_len;
+    u8      lifted;
+    IrStats stats;
+} IrBuilder;
+
+static Bool get_pure(IrOp op) {
+    switch (op) {
+    case IR_GET:
+    case IR_CONST:
+    case IR_ADD:
+    case IR_ADD_IMMEDIATE:
+    case IR_AND:
+    case IR_AND_IMMEDIATE:
+    case IR_NOT:
+    case IR_FLAGS: {
+        return TRUE;
+    }
+    case IR_LOAD:
+    case IR_LOAD_CONST:
+    case IR_STORE:
+    case IR_STORE_CONST:
+    case IR_TOUCH_CONST:
+    default: {
+        return FALSE;
+    }
+    }
+}
+
+/* NOTE: Whether `a` and `b` name values, rather than registers, constants
+ * or addresses. */
+static Bool get_a_value(IrOp op) {
+    switch (op) {
+    case IR_ADD:
+    case IR_ADD_IMMEDIATE:
+    case IR_AND:
+    case IR_AND_IMMEDIATE:
+    case IR_NOT:
+    case IR_FLAGS:
+    case IR_LOAD:
+    case IR_STORE: {
+        return TRUE;
+    }
+    case IR_GET:
+    case IR_CONST:
+    case IR_LOAD_CONST:
+    case IR_STORE_CONST:
+    case IR_TOUCH_CONST:
+    default: {
+        return FALSE;
+    }
+    }
+}
+
+static Bool get_b_value(IrOp op) {
+    switch (op) {
+    case IR_ADD:
+    case IR_AND:
+    case IR_STORE:
+    case IR_STORE_CONST: {
+        return TRUE;
+    }
+    case IR_GET:
+    case IR_CONST:
+    case IR_ADD_IMMEDIATE:
+    case IR_AND_IMMEDIATE:
+    case IR_NOT:
+    case IR_FLAGS:
+    case IR_LOAD:
+    case IR_LOAD_CONST:
+    case IR_TOUCH_CONST:
+    default: {
+        return FALSE;
+    }
+    }
+}
+
+static u16 do_emit_ir(IrBuilder* builder, IrOp op, u16 a, u16 b) {
+    IrInstr* instr = &builder->code[builder->len];
+    instr->op = op;
+    instr->exit = NO_EXIT;
+    instr->a = a;
+    instr->b = b;
+    ++builder->stats.emitted;
+    return builder->len++;
+}
+
+/* NOTE: Pure values are numbered, so asking for one twice gives back the
+ * first. */
+static u16 get_ir_value(IrBuilder* builder, IrOp op, u16 a, u16 b) {
+    for (u16 i = 0; i < builder->len; ++i) {
+        const IrInstr* instr = &builder->code[i];
+        if ((instr->op == op) && (instr->a == a) && (instr->b == b)) {
+            return i;
+        }
+    }
+    return do_emit_ir(builder, op, a, b);
+}
+
+static Bool get_ir_known(const IrBuilder* builder, u16 value, u16* known) {
+    if (builder->code[value].op != IR_CONST) {
+        return FALSE;
+    }
+    *known = builder->code[value].a;
+    return TRUE;
+}
+
+static u16 get_ir_const(IrBuilder* builder, u16 known) {
+    return get_ir_value(builder, IR_CONST, known, 0);
+}
+
+static u16 get_ir_add_immediate(IrBuilder* builder, u16 a, u16 immediate) {
+    u16 known;
+    if (get_ir_known(builder, a, &known)) {
+        return get_ir_const(builder, (u16)(known + immediate));
+    }
+    if (immediate == 0) {
+        return a;
+    }
+    /* NOTE: `(x + j) + k` is `x + (j + k)`, which walks pointers without a
+     * chain of adds. */
+    const IrInstr* instr = &builder->code[a];
+    if (instr->op == IR_ADD_IMMEDIATE) {
+        return get_ir_add_immediate(builder,
+                                    instr->a,
+                                    (u16)(instr->b + immediate));
+    }
+    return get_ir_value(builder, IR_ADD_IMMEDIATE, a, immediate);
+}
+
+static u16 get_ir_add(IrBuilder* builder, u16 a, u16 b) {
+    u16 known;
+    if (get_ir_known(builder, b, &known)) {
+        return get_ir_add_immediate(builder, a, known);
+    }
+    if (get_ir_known(builder, a, &known)) {
+        return get_ir_add_immediate(builder, b, known);
+    }
+    return a < b ? get_ir_value(builder, IR_ADD, a, b)
+                 : get_ir_value(builder, IR_ADD, b, a);
+}
+
+static u16 get_ir_and_immediate(IrBuilder* builder, u16 a, u16 immediate) {
+    u16 known;
+    if (get_ir_known(builder, a, &known)) {
+        return get_ir_const(builder, known & immediate);
+    }
+    if (immediate == 0) {
+        return get_ir_const(builder, 0);
+    }
+    if (immediate == U16_MAX) {
+        return a;
+    }
+    return get_ir_value(builder, IR_AND_IMMEDIATE, a, immediate);
+}
+
+static u16 get_ir_and(IrBuilder* builder, u16 a, u16 b) {
+    u16 known;
+    if (get_ir_known(builder, b, &known)) {
+        return get_ir_and_immediate(builder, a, known);
+    }
+    if (get_ir_known(builder, a, &known)) {
+        return get_ir_and_immediate(builder, b, known);
+    }
+    if (a == b) {
+        return a;
+    }
+    return a < b ? get_ir_value(builder, IR_AND, a, b)
+                 : get_ir_value(builder, IR_AND, b, a);
+}
+
+static u16 get_ir_not(IrBuilder* builder, u16 a) {
+    u16 known;
+    if (get_ir_known(builder, a, &known)) {
+        return get_ir_const(builder, (u16)~known);
+    }
+    if (builder->code[a].op == IR_NOT) {
+        return builder->code[a].a;
+    }
+    return get_ir_value(builder, IR_NOT, a, 0);
+}
+
+static u16 get_ir_reg(IrBuilder* builder, u8 r) {
+    if (builder->regs[r] == IR_NONE) {
+        builder->regs[r] = get_ir_value(builder, IR_GET, r, 0);
+    }
+    return builder->regs[r];
+}
+
+static void set_ir_reg(IrBuilder* builder, u8 r, u16 value) {
+    builder->regs[r] = value;
+    builder->regs[R_COND] = get_ir_value(builder, IR_FLAGS, value, 0);
+    ++builder->stats.flags;
+}
+
+static u16 do_guard_ir(IrBuilder* builder, u16 value) {
+    builder->guard = value;
+    return value;
+}
+
+static u16* get_ir_memory(IrBuilder* builder, u16 address) {
+    for (u8 i = 0; i < builder->memory_len; ++i) {
+        if (builder->addresses[i] == address) {
+            return &builder->values[i];
+        }
+    }
+    return NULL;
+}
+
+static void set_ir_memory(IrBuilder* builder, u16 address, u16 value) {
+    u16* known = get_ir_memory(builder, address);
+    if (known) {
+        *known = value;
+    } else if (builder->memory_len < IR_MEMORY_CAP) {
+        builder->addresses[builder->memory_len] = address;
+        builder->values[builder->memory_len++] = value;
+    }
+}
+
+static u16 get_ir_load_at(IrBuilder* builder, u16 address) {
+    if (KEYBOARD_STATUS <= address) {
+        return do_guard_ir(builder,
+                           do_emit_ir(builder,
+                                      IR_LOAD,
+                                      get_ir_const(builder, address),
+                                      0));
+    }
+    const u16* known = get_ir_memory(builder, address);
+    if (known) {
+        ++builder->stats.forwarded;
+        return *known;
+    }
+    const u16 value = do_emit_ir(builder, IR_LOAD_CONST, address, 0);
+    set_ir_memory(builder, address, value);
+    return value;
+}
+
+static u16 get_ir_load(IrBuilder* builder, u16 address) {
+    u16 known;
+    if (get_ir_known(builder, address, &known)) {
+        return get_ir_load_at(builder, known);
+    }
+    return do_guard_ir(builder, do_emit_ir(builder, IR_LOAD, address, 0));
+}
+
+static void do_ir_store(IrBuilder* builder, u16 address, u16 value) {
+    u16 known;
+    if (!get_ir_known(builder, address, &known)) {
+        /* NOTE: Could be any word, so nothing is known any more. */
+        builder->memory_len = 0;
+        do_guard_ir(builder, do_emit_ir(builder, IR_STORE, address, value));
+        return;
+    }
+    if (KEYBOARD_STATUS <= known) {
+        do_guard_ir(builder,
+                    do_emit_ir(builder, IR_STORE_CONST, known, value));
+        return;
+    }
+    const u16* held = get_ir_memory(builder, known);
+    if (held && (*held == value)) {
+        ++builder->stats.dropped;
+        do_guard_ir(builder, do_emit_ir(builder, IR_TOUCH_CONST, known, 0));
+        return;
+    }
+    do_guard_ir(builder, do_emit_ir(builder, IR_STORE_CONST, known, value));
+    set_ir_memory(builder, known, value);
+}
+
+/* NOTE: Records what the guest's registers hold after the current guest
+ * instruction. Registers that still hold their entry value are left out,
+ * and the flags are written from the value that set them. */
+static void set_ir_exit(const IrBuilder* builder,
+                        IrExit*          exit,
+                        u16              pc,
+                        u8               count) {
+    exit->pc = pc;
+    exit->count = count;
+    exit->len = 0;
+    for (u8 r = R_0; r <= R_7; ++r) {
+        const u16 value = builder->regs[r];
+        if ((value == IR_NONE) || ((builder->code[value].op == IR_GET) &&
+                                   (builder->code[value].a == r)))
+        {
+            continue;
+        }
+        exit->writes[exit->len++] = (u16)((r << WRITE_BITS) | value);
+    }
+    if (builder->regs[R_COND] != IR_NONE) {
+        exit->writes[exit->len++] =
+            (u16)((R_COND << WRITE_BITS) |
+                  builder->code[builder->regs[R_COND]].a);
+    }
+}
+
+static void set_ir_builder(IrBuilder* builder) {
+    builder->len = 0;
+    builder->exit_len = 0;
+    builder->memory_len = 0;
+    builder->lifted = 0;
+    for (u8 r = 0; r < R_SIZE; ++r) {
+        builder->regs[r] = IR_NONE;
+    }
+}
+
+/* NOTE: Lifts one instruction that neither branches nor traps. */
+static void do_lift(IrBuilder* builder, u16 pc, const Predecoded* lifted) {
+    const u16 instr = lifted->instr;
+    const u8  r0 = lifted->r0;
+    builder->guard = IR_NONE;
+    switch (get_op(instr)) {
+    case OP_ADD: {
+        const u16 a = get_ir_reg(builder, lifted->r1);
+        set_ir_reg(builder,
+                   r0,
+                   get_immediate_mode(instr)
+                       ? get_ir_add_immediate(builder, a, lifted->value)
+                       : get_ir_add(builder,
+                                    a,
+                                    get_ir_reg(builder, lifted->r2)));
+        break;
+    }
+    case OP_AND: {
+        const u16 a = get_ir_reg(builder, lifted->r1);
+        set_ir_reg(builder,
+                   r0,
+                   get_immediate_mode(instr)
+                       ? get_ir_and_immediate(builder, a, lifted->value)
+                       : get_ir_and(builder,
+                                    a,
+                                    get_ir_reg(builder, lifted->r2)));
+        break;
+    }
+    case OP_NOT: {
+        set_ir_reg(builder,
+                   r0,
+                   get_ir_not(builder, get_ir_reg(builder, lifted->r1)));
+        break;
+    }
+    case OP_LEA: {
+        set_ir_reg(builder, r0, get_ir_const(builder, lifted->value));
+        break;
+    }
+    case OP_LD: {
+        set_ir_reg(builder, r0, get_ir_load_at(builder, lifted->value));
+        break;
+    }
+    case OP_LDR: {
+        set_ir_reg(
+            builder,
+            r0,
+            get_ir_load(builder,
+                        get_ir_add_immediate(builder,
+                                             get_ir_reg(builder, lifted->r1),
+                                             lifted->value)));
+        break;
+    }
+    case OP_LDI: {
+        set_ir_reg(
+            builder,
+            r0,
+            get_ir_load(builder, get_ir_load_at(builder, lifted->value)));
+        break;
+    }
+    case OP_ST: {
+        do_ir_store(builder,
+                    get_ir_const(builder, lifted->value),
+                    get_ir_reg(builder, r0));
+        break;
+    }
+    case OP_STR: {
+        do_ir_store(builder,
+                    get_ir_add_immediate(builder,
+                                         get_ir_reg(builder, lifted->r1),
+                                         lifted->value),
+                    get_ir_reg(builder, r0));
+        break;
+    }
+    case OP_STI: {
+        do_ir_store(builder,
+                    get_ir_load_at(builder, lifted->value),
+                    get_ir_reg(builder, r0));
+        break;
+    }
+    case OP_BR:
+    case OP_JSR:
+    case OP_JMP:
+    case OP_RES:
+    case OP_TRAP:
+    default: {
+        exit(EXIT_FAILURE);
+    }
+    }
+    ++builder->lifted;
+    ++builder->stats.guest;
+    if (builder->guard != IR_NONE) {
+        const u8 i = builder->exit_len++;
+        set_ir_exit(builder,
+                    &builder->exits[i],
+                    (u16)(pc + 1),
+                    builder->lifted);
+        builder->code[builder->guard].exit = i;
+    }
+}
+
+static void do_mark_ir(const IrExit* exit, Bool* live) {
+    for (u8 i = 0; i < exit->len; ++i) {
+        live[exit->writes[i] & WRITE_MASK] = TRUE;
+    }
+}
+
+static void do_renumber_ir(IrExit* exit, const u16* numbers) {
+    for (u8 i = 0; i < exit->len; ++i) {
+        const u16 write = exit->writes[i];
+        exit->writes[i] = (u16)((write & ~WRITE_MASK) |
+                                numbers[write & WRITE_MASK]);
+    }
+}
+
+static void do_write_ir(IrExit* exit, u8 r, u16 value) {
+    for (u8 i = 0; i < exit->len; ++i) {
+        if ((exit->writes[i] >> WRITE_BITS) == r) {
+            return;
+        }
+    }
+    exit->writes[exit->len++] = (u16)((r << WRITE_BITS) | value);
+}
+
+/* NOTE: In a loop the guest's registers hold what they did on entry to the
+ * first iteration, not the current one, so every register the body writes
+ * gets an entry value to be carried in, and every exit writes it back. */
+static void do_carry_ir(IrBuilder* builder, const IrExit* end) {
+    for (u8 i = 0; i < end->len; ++i) {
+        const u8 r = (u8)(end->writes[i] >> WRITE_BITS);
+        if (r == R_COND) {
+            continue;
+        }
+        const u16 value = get_ir_value(builder, IR_GET, r, 0);
+        for (u8 j = 0; j < builder->exit_len; ++j) {
+            do_write_ir(&builder->exits[j], r, value);
+        }
+    }
+}
+
+static Bool get_hoisted(IrOp op) {
+    return (op == IR_GET) || (op == IR_CONST);
+}
+
+/* NOTE: Ends the block, sweeps away every value nothing observes, and
+ * copies what is left into `code` and `exits`, which need room for
+ * `IR_CAP` and `IR_GUEST_CAP` entries. Exits take the flags straight from
+ * the value that set them, so `IR_FLAGS` values are always swept. `nzp` is
+ * the condition under which the block loops back to its start, if it
+ * does. */
+static void do_schedule_ir(IrBuilder* builder,
+                           IrBlock*   block,
+                           IrInstr*   code,
+                           IrExit*    exits,
+                           u8         nzp) {
+    Bool live[IR_CAP] = {0};
+    u16  numbers[IR_CAP];
+    set_ir_exit(builder, &block->end, 0, builder->lifted);
+    if (nzp) {
+        do_carry_ir(builder, &block->end);
+    }
+    do_mark_ir(&block->end, live);
+    for (u8 i = 0; i < builder->exit_len; ++i) {
+        do_mark_ir(&builder->exits[i], live);
+    }
+    for (u16 i = builder->len; i;) {
+        const IrInstr* instr = &builder->code[--i];
+        if (!get_pure(instr->op) && (instr->op != IR_LOAD_CONST)) {
+            live[i] = TRUE;
+        }
+        if (!live[i]) {
+            continue;
+        }
+        if (get_a_value(instr->op)) {
+            live[instr->a] = TRUE;
+        }
+        if (get_b_value(instr->op)) {
+            live[instr->b] = TRUE;
+        }
+    }
+    u16 len = 0;
+    for (u16 i = 0; i < builder->len; ++i) {
+        if (live[i] && get_hoisted(builder->code[i].op)) {
+            numbers[i] = len;
+            code[len++] = builder->code[i];
+        }
+    }
+    block->start = len;
+    for (u16 i = 0; i < builder->len; ++i) {
+        const IrInstr* instr = &builder->code[i];
+        if (!live[i] || get_hoisted(instr->op)) {
+            continue;
+        }
+        numbers[i] = len;
+        code[len] = *instr;
+        if (get_a_value(instr->op)) {
+            code[len].a = numbers[instr->a];
+        }
+        if (get_b_value(instr->op)) {
+            code[len].b = numbers[instr->b];
+        }
+        ++len;
+    }
+    /* NOTE: A register read on entry and changed by the body is carried
+     * into the next iteration through the value that read it. */
+    block->nzp = nzp;
+    block->carry_len = 0;
+    block->flags = IR_NONE;
+    for (u8 i = 0; i < block->end.len; ++i) {
+        const u16 write = block->end.writes[i];
+        const u8  r = (u8)(write >> WRITE_BITS);
+        if (r == R_COND) {
+            block->flags = numbers[write & WRITE_MASK];
+            continue;
+        }
+        for (u16 j = 0; nzp && (j < builder->len); ++j) {
+            const IrInstr* instr = &builder->code[j];
+            if (live[j] && (instr->op == IR_GET) && (instr->a == r)) {
+                block->from[block->carry_len] = numbers[write & WRITE_MASK];
+                block->to[block->carry_len++] = numbers[j];
+            }
+        }
+    }
+    memcpy(exits, builder->exits, builder->exit_len * sizeof(IrExit));
+    for (u8 i = 0; i < builder->exit_len; ++i) {
+        do_renumber_ir(&exits[i], numbers);
+    }
+    do_renumber_ir(&block->end, numbers);
+    block->code = code;
+    block->exits = exits;
+    block->len = len;
+    block->exit_len = builder->exit_len;
+    ++builder->stats.blocks;
+    builder->stats.scheduled += len;
+}
+
+static u16 get_ir_flags(u16 value) {
+    return value == 0 ? FL_ZERO : value >> 15 ? FL_NEG : FL_POS;
+}
+
+static void do_ir_writes(Vm* vm, const IrExit* exit, const u16* values) {
+    for (u8 i = 0; i < exit->len; ++i) {
+        const u16 write = exit->writes[i];
+        const u8  r = (u8)(write >> WRITE_BITS);
+        const u16 value = values[write & WRITE_MASK];
+        vm->reg[r] = r == R_COND ? get_ir_flags(value) : value;
+    }
+}
+
+/* NOTE: Loops back while the block's branch would, as long as another whole
+ * iteration fits in `budget` behind this one. Coverage is recorded per
+ * branch, so loops do not loop while it is on. */
+static Bool get_ir_loops(Vm*            vm,
+                         const IrBlock* block,
+                         const u16*     values,
+                         u64            budget) {
+    const u16 flags = block->flags == IR_NONE
+                          ? vm->reg[R_COND]
+                          : get_ir_flags(values[block->flags]);
+    return (flags & block->nzp) && !vm->coverage &&
+           ((2 * ((u64)block->end.count + 1)) <= budget);
+}
+
+/* NOTE: Runs `block` and returns how many guest instructions it completed,
+ * within `budget`. Unless a load or store stopped the guest partway
+ * through, that ends with the body of the last iteration, and `R_PC` is
+ * left for the block's last instruction to set. */
+static u64 run_ir(Vm* vm, const IrBlock* block, u64 budget) {
+    u16 values[IR_CAP];
+    u64 n = 0;
+    for (u16 i = 0;; i = block->start) {
+        for (; i < block->len; ++i) {
+            const IrInstr* instr = &block->code[i];
+            switch (instr->op) {
+            case IR_GET: {
+                values[i] = vm->reg[instr->a];
+                break;
+            }
+            case IR_CONST: {
+                values[i] = instr->a;
+                break;
+            }
+            case IR_ADD: {
+                values[i] = (u16)(values[instr->a] + values[instr->b]);
+                break;
+            }
+            case IR_ADD_IMMEDIATE: {
+                values[i] = (u16)(values[instr->a] + instr->b);
+                break;
+            }
+            case IR_AND: {
+                values[i] = values[instr->a] & values[instr->b];
+                break;
+            }
+            case IR_AND_IMMEDIATE: {
+                values[i] = values[instr->a] & instr->b;
+                break;
+            }
+            case IR_NOT: {
+                values[i] = (u16)~values[instr->a];
+                break;
+            }
+            case IR_LOAD_CONST: {
+                values[i] = get_word_at(vm, instr->a);
+                break;
+            }
+            case IR_LOAD: {
+                values[i] = get_mem_at(vm, values[instr->a]);
+                break;
+            }
+            case IR_STORE: {
+                set_mem_at(vm, values[instr->a], values[instr->b]);
+                break;
+            }
+            case IR_STORE_CONST: {
+                set_mem_at(vm, instr->a, values[instr->b]);
+                break;
+            }
+            case IR_TOUCH_CONST: {
+                if (vm->pages[instr->a >> PAGE_BITS] != PAGE_DIRTY) {
+                    do_touch_page(vm, instr->a);
+                }
+                break;
+            }
+            case IR_FLAGS:
+            default: {
+                exit(EXIT_FAILURE);
+            }
+            }
+            if ((instr->exit != NO_EXIT) &&
+                ((vm->status != ALIVE) || vm->stale))
+            {
+                const IrExit* exit = &block->exits[instr->exit];
+                do_ir_writes(vm, exit, values);
+                vm->reg[R_PC] = exit->pc;
+                return n + exit->count;
+            }
+        }
+        if (!get_ir_loops(vm, block, values, budget - n)) {
+            break;
+        }
+        u16 carried[R_COND];
+        for (u8 j = 0; j < block->carry_len; ++j) {
+            carried[j] = values[block->from[j]];
+        }
+        for (u8 j = 0; j < block->carry_len; ++j) {
+            values[block->to[j]] = carried[j];
+        }
+        /* NOTE: Exits early in the next iteration expect these flags. */
+        if (block->flags != IR_NONE) {
+            vm->reg[R_COND] = get_ir_flags(values[block->flags]);
+        }
+        n += (u64)block->end.count + 1;
+    }
+    do_ir_writes(vm, &block->end, values);
+    return n + block->end.count;
+}
+
+#endif
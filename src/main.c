@@ -1,25 +1,270 @@
-#include "vm.h"
+#define _GNU_SOURCE
+
+#include "bench.h"
+#include "cores.h"
+#include "debug.h"
+#include "fork.h"
+#include "fuzz.h"
+#include "idle.h"
+#include "profile.h"
+#include "ring.h"
+#include "screen.h"
+#include "session.h"
+#include "tier.h"
+#include "verify.h"
 
 i32 main(i32 n, const char** args) {
-    {
-        if (n < 2) {
+    if (n < 2) {
+        exit(EXIT_FAILURE);
+    }
+    if (!strcmp(args[1], "--serve")) {
+        if (n < 4) {
+            exit(EXIT_FAILURE);
+        }
+        do_serve(args[2], &args[3], (u32)(n - 3));
+    }
+    if (!strcmp(args[1], "--sessions")) {
+        /* NOTE: `--sessions <socket> <image>` */
+        if (n != 4) {
+            exit(EXIT_FAILURE);
+        }
+        do_run_sessions(args[2], args[3]);
+    }
+    if (!strcmp(args[1], "--convert")) {
+        /* NOTE: `--convert <obj> <out> [sym]` */
+        if ((n < 4) || (5 < n)) {
+            exit(EXIT_FAILURE);
+        }
+        do_convert(args[2], n == 5 ? args[4] : NULL, args[3]);
+        return EXIT_SUCCESS;
+    }
+    if (!strcmp(args[1], "--assemble")) {
+        /* NOTE: `--assemble <asm> <obj>` */
+        if (n != 4) {
+            exit(EXIT_FAILURE);
+        }
+        do_assemble(args[2], args[3]);
+        return EXIT_SUCCESS;
+    }
+    u64         budget = U64_MAX;
+    u64         timeout_ms = 0;
+    u64         runs = U64_MAX;
+    u64         cores = 1;
+    u64         depth = 2;
+    u64         verify = 0;
+    u64         pack_idle = 0;
+    const char* debug = NULL;
+    const char* fuzz = NULL;
+    const char* profile = NULL;
+    const char* bench = NULL;
+    const char* explore = NULL;
+    Bool        stats = FALSE;
+    Bool        screen = FALSE;
+    Bool        headless = FALSE;
+    Bool        compile = FALSE;
+    i32         i = 1;
+    for (; i < (n - 1); ++i) {
+        if (!strcmp(args[i], "--stats")) {
+            stats = TRUE;
+            continue;
+        }
+        /* NOTE: `--screen` draws the guest's output through a `Screen`,
+         * `--headless` does the same without a terminal and prints the last
+         * screen when the guest stops. */
+        if (!strcmp(args[i], "--screen")) {
+            screen = TRUE;
+            continue;
+        }
+        if (!strcmp(args[i], "--headless")) {
+            headless = TRUE;
+            continue;
+        }
+        /* NOTE: Decodes and lifts blocks on a thread of their own. */
+        if (!strcmp(args[i], "--compile-thread")) {
+            compile = TRUE;
+            continue;
+        }
+        if (n - 2 <= i) {
             exit(EXIT_FAILURE);
         }
-        File* file = fopen(args[1], "rb");
-        if (file == NULL) {
+        if (!strcmp(args[i], "--budget")) {
+            budget = strtoull(args[++i], NULL, 10);
+        } else if (!strcmp(args[i], "--timeout")) {
+            timeout_ms = strtoull(args[++i], NULL, 10);
+        } else if (!strcmp(args[i], "--debug")) {
+            /* NOTE: `-` debugs on the terminal, anything else is the path of
+             * a socket to wait on for a remote session. */
+            debug = args[++i];
+        } else if (!strcmp(args[i], "--fuzz")) {
+            fuzz = args[++i];
+        } else if (!strcmp(args[i], "--profile")) {
+            /* NOTE: Folded stacks go to the file at this path, the flat
+             * profile to `stderr`. */
+            profile = args[++i];
+        } else if (!strcmp(args[i], "--bench")) {
+            /* NOTE: The path of the file to use as input. */
+            bench = args[++i];
+        } else if (!strcmp(args[i], "--cores")) {
+            cores = strtoull(args[++i], NULL, 10);
+        } else if (!strcmp(args[i], "--runs")) {
+            runs = strtoull(args[++i], NULL, 10);
+        } else if (!strcmp(args[i], "--explore")) {
+            /* NOTE: The keys to try at every point the guest waits for
+             * input, down to `--depth` of them. */
+            explore = args[++i];
+        } else if (!strcmp(args[i], "--depth")) {
+            depth = strtoull(args[++i], NULL, 10);
+        } else if (!strcmp(args[i], "--verify")) {
+            /* NOTE: About how many instructions to run between windows
+             * checked against the reference interpreter. */
+            verify = strtoull(args[++i], NULL, 10);
+        } else if (!strcmp(args[i], "--pack-idle")) {
+            /* NOTE: How many milliseconds the guest waits on input before
+             * its memory is packed. */
+            pack_idle = strtoull(args[++i], NULL, 10);
+        } else {
             exit(EXIT_FAILURE);
-        };
-        set_bytecode(file);
-        fclose(file);
+        }
     }
+    /* NOTE: Cores share the terminal, so they only run plainly, and in the
+     * interpreter, which leaves a compile thread nothing to do. The other
+     * modes run a single core of their own. Packing needs the guest's
+     * memory to itself. */
+    if ((i != (n - 1)) || (cores == 0) || (CORE_CAP < cores) ||
+        ((1 < cores) && (screen || headless || profile || verify ||
+                         compile || bench || fuzz || explore || debug)) ||
+        (pack_idle && ((1 < cores) || verify || compile)) ||
+        (EXPLORE_DEPTH_CAP < depth) || (explore && !*explore))
     {
+        exit(EXIT_FAILURE);
+    }
+    Vm*    vm = get_vm();
+    Image* image = calloc(1, sizeof(Image));
+    if (image == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    set_image(image, args[i]);
+    set_vm(vm, image);
+    vm->io = &IO_STDIO;
+    if (bench) {
+        do_bench(vm, args[i], bench, budget, timeout_ms);
+    } else if (fuzz) {
+        do_fuzz(vm, fuzz, budget, runs);
+    } else if (explore) {
+        do_explore(vm, explore, (u32)depth, budget);
+    } else if (debug) {
         signal(SIGINT, handle_interrupt);
+        if (!strcmp(debug, "-")) {
+            do_debug(vm, stdin, stderr);
+        } else {
+            do_debug_remote(vm, debug);
+        }
+    } else {
+        Tier*     tier = calloc(1, sizeof(Tier));
+        Screen*   frame = calloc(1, sizeof(Screen));
+        Profile*  sampler = calloc(1, sizeof(Profile));
+        Verifier* verifier = calloc(1, sizeof(Verifier));
+        Idle*     idle = calloc(1, sizeof(Idle));
+        Ring*     ring = calloc(1, sizeof(Ring));
+        if ((tier == NULL) || (frame == NULL) || (sampler == NULL) ||
+            (verifier == NULL) || (idle == NULL) || (ring == NULL))
+        {
+            exit(EXIT_FAILURE);
+        }
+        if (compile) {
+            do_start_compiler(tier);
+            set_tier_vm(vm, tier);
+        }
+        /* NOTE: Several cores would all be writing to the ring at once,
+         * and a screen is already drawn a frame at a time. */
+        const Bool output = !(screen || headless) && (cores == 1);
+        if (screen || headless) {
+            set_screen(frame, headless ? NULL : stdout);
+            vm->io = &IO_SCREEN;
+            vm->io_data = frame;
+        } else if (output) {
+            do_start_ring(ring, vm, STDOUT_FILENO);
+        }
+        if (verify) {
+            do_start_verifier(verifier, vm, verify);
+        }
+        if (pack_idle) {
+            set_idle(idle, vm, pack_idle);
+        }
+        set_run_interrupt(NULL);
         disable_input_buffering();
-        REG[R_PC] = PC_START;
-        while (STATUS) {
-            do_bin_instr(get_mem_at(REG[R_PC]++));
+        const u64 deadline = get_deadline(timeout_ms);
+        if (profile) {
+            do_start_profile(sampler, vm, PROFILE_HZ);
+        }
+        const u64 start = get_monotonic_ns();
+        const u64 instrs =
+            1 < cores ? run_cores(vm, (u16)cores, budget, deadline)
+            : verify  ? run_verified(verifier, vm, tier, budget, deadline)
+                      : run_tiered(vm, tier, budget, deadline);
+        const u64 elapsed = get_monotonic_ns() - start;
+        if (verify) {
+            do_stop_verifier(verifier, vm);
+        }
+        if (profile) {
+            do_stop_profile(sampler, vm);
+        }
+        if (output) {
+            do_stop_ring(ring, vm);
         }
         restore_input_buffering();
+        if (vm->status == INTERRUPTED) {
+            printf("\n");
+        }
+        if (screen || headless) {
+            do_present_screen(frame);
+        }
+        if (headless) {
+            do_print_screen(frame, stdout);
+        }
+        if (stats) {
+            fprintf(stderr,
+                    "instrs %" PRIu64 ", %" PRIu64 " us\n",
+                    instrs,
+                    elapsed / 1000);
+            do_print_tier_stats(tier, stderr);
+            if (verify) {
+                do_print_verify_stats(verifier, stderr);
+            }
+            if (pack_idle) {
+                do_print_idle_stats(idle, stderr);
+            }
+            if (output) {
+                do_print_ring_stats(ring, stderr);
+            }
+            if (screen || headless) {
+                do_print_screen_stats(frame, stderr);
+            }
+        }
+        if (profile) {
+            File* folded = fopen(profile, "w");
+            if (folded == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            do_print_profile(sampler, stderr, folded);
+            fclose(folded);
+        }
+        if (tier->background) {
+            do_stop_compiler(tier);
+        }
+        free(ring);
+        free(idle);
+        free(verifier);
+        free(sampler);
+        free(frame);
+        free(tier);
     }
-    return EXIT_SUCCESS;
+    /* NOTE: A plain run exits with `EXHAUSTED` or `EXPIRED` when a limit
+     * stopped the guest, and with `INTERRUPTED` after `SIGINT`. */
+    const Status status =
+        (bench || fuzz || explore || debug) ? DEAD : vm->status;
+    do_free_vm(vm);
+    do_free_native(image);
+    free(image);
+    return (i32)status;
 }
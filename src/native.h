@@ -0,0 +1,554 @@
+#ifndef __NATIVE_H__
+#define __NATIVE_H__
+
+#include "asm.h"
+#include "vm.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* NOTE: Native images are `.obj` files worked over ahead of time, laid out
+ * as:
+ *     NativeHeader
+ *     NativeSegment[segment_count]
+ *     u64 blocks[MEM_SIZE / 64]
+ *     per segment: u16 words[len] (padded to 8 bytes), Predecoded[len]
+ *     NativeSymbol[symbol_count]
+ *     char names[names_size]
+ * Everything is host-endian and 8-byte aligned, so loading is an `mmap`,
+ * a checksum and a copy of the segments into place. The checksum covers the
+ * header too, with its own `checksum` taken as `0`. It only catches files
+ * damaged by accident, so every table entry is also checked against its
+ * word before the tier trusts it. The mapping stays up until
+ * `do_free_native`. */
+#define NATIVE_MAGIC 0x31474D494D56427Fllu
+#define FNV_BASIS    0xCBF29CE484222325llu
+
+#define NAME_CAP   64
+#define SYMBOL_CAP (1 << 12)
+
+typedef struct stat Stat;
+
+typedef struct {
+    u64 magic;
+    u64 checksum;
+    u64 size;
+    u64 symbols;
+    u64 names;
+    u32 segment_count;
+    u32 symbol_count;
+    u32 names_size;
+    u32 reserved;
+} NativeHeader;
+
+typedef struct {
+    u64 words;
+    u64 table;
+    u32 len;
+    u16 origin;
+    u16 reserved;
+} NativeSegment;
+
+typedef struct {
+    u32 name;
+    u16 address;
+    u16 reserved;
+} NativeSymbol;
+
+/* NOTE: Everything about an instruction that does not depend on the
+ * registers, with PC-relative targets already resolved. */
+typedef struct {
+    u16 instr;
+    u16 value;
+    u8  op;
+    u8  r0;
+    u8  r1;
+    u8  r2;
+} Predecoded;
+
+struct Native {
+    const NativeHeader*  header;
+    const NativeSegment* segments;
+    const u64*           blocks;
+    const NativeSymbol*  symbols;
+    const char*          names;
+    const u8*            map;
+};
+
+static Predecoded get_predecoded(u16 pc, u16 instr) {
+    const u16  next = (u16)(pc + 1);
+    Predecoded predecoded;
+    predecoded.instr = instr;
+    predecoded.value = 0;
+    predecoded.op = get_op(instr);
+    predecoded.r0 = get_r0_or_nzp(instr);
+    predecoded.r1 = get_r1(instr);
+    predecoded.r2 = get_r2(instr);
+    switch (get_op(instr)) {
+    case OP_BR:
+    case OP_LD:
+    case OP_ST:
+    case OP_LDI:
+    case OP_STI:
+    case OP_LEA: {
+        predecoded.value = (u16)(next + get_pc_offset_9(instr));
+        break;
+    }
+    case OP_ADD:
+    case OP_AND: {
+        predecoded.value = (u16)get_immediate(instr);
+        break;
+    }
+    case OP_JSR: {
+        predecoded.value = (u16)(next + get_pc_offset_11(instr));
+        break;
+    }
+    case OP_LDR:
+    case OP_STR: {
+        predecoded.value = (u16)get_reg_offset_6(instr);
+        break;
+    }
+    case OP_NOT:
+    case OP_JMP:
+    case OP_RES:
+    case OP_TRAP:
+    default: {
+    }
+    }
+    return predecoded;
+}
+
+/* NOTE: FNV-1a, a word at a time, carrying on from `hash`. */
+static u64 get_checksum(u64 hash, const u8* bytes, usize size) {
+    for (usize i = 0; i < size; i += sizeof(u64)) {
+        u64 word;
+        memcpy(&word, &bytes[i], sizeof(u64));
+        hash = (hash ^ word) * 0x100000001B3llu;
+    }
+    return hash;
+}
+
+static u64 get_native_checksum(const u8* bytes, usize size) {
+    NativeHeader header;
+    memcpy(&header, bytes, sizeof(NativeHeader));
+    header.checksum = 0;
+    return get_checksum(get_checksum(FNV_BASIS,
+                                     (const u8*)&header,
+                                     sizeof(NativeHeader)),
+                        &bytes[sizeof(NativeHeader)],
+                        size - sizeof(NativeHeader));
+}
+
+static usize get_padded(usize size) {
+    return (size + 7) & ~(usize)7;
+}
+
+static Bool get_block_bit(const u64* bits, u16 address) {
+    return (bits[address >> 6] >> (address & 0x3F)) & 1;
+}
+
+static void set_block_bit(u64* bits, u16 address) {
+    bits[address >> 6] |= 1llu << (address & 0x3F);
+}
+
+/* NOTE: Follows control flow from `PC_START` to find where basic blocks
+ * begin. Indirect jumps are not followed, so anything only reached through
+ * `JMP` or `JSRR` is left to the tier to discover at runtime. */
+static void set_blocks(u64* blocks, const Image* image) {
+    u64* seen = calloc(MEM_SIZE / 64, sizeof(u64));
+    u16* stack = malloc(MEM_SIZE * sizeof(u16));
+    if ((seen == NULL) || (stack == NULL)) {
+        exit(EXIT_FAILURE);
+    }
+    u32 len = 0;
+    stack[len++] = PC_START;
+    set_block_bit(blocks, PC_START);
+    while (len) {
+        for (u16 pc = stack[--len];
+             (pc < KEYBOARD_STATUS) && !get_block_bit(seen, pc);)
+        {
+            set_block_bit(seen, pc);
+            const u16        instr = image->mem[pc];
+            const Predecoded predecoded = get_predecoded(pc, instr);
+            ++pc;
+            Bool next = TRUE;
+            Bool target = FALSE;
+            switch (get_op(instr)) {
+            case OP_BR: {
+                target = predecoded.r0 != 0;
+                next = predecoded.r0 != 0x7;
+                break;
+            }
+            case OP_JSR: {
+                target = get_relative_mode(instr);
+                break;
+            }
+            case OP_JMP: {
+                next = FALSE;
+                break;
+            }
+            case OP_TRAP: {
+                next = get_trap(instr) != TRAP_HALT;
+                break;
+            }
+            case OP_RES: {
+                next = FALSE;
+                break;
+            }
+            case OP_ADD:
+            case OP_LD:
+            case OP_ST:
+            case OP_AND:
+            case OP_LDR:
+            case OP_STR:
+            case OP_NOT:
+            case OP_LDI:
+            case OP_STI:
+            case OP_LEA:
+            default: {
+                continue;
+            }
+            }
+            if (target && (len < MEM_SIZE)) {
+                set_block_bit(blocks, predecoded.value);
+                stack[len++] = predecoded.value;
+            }
+            if (!next) {
+                break;
+            }
+            set_block_bit(blocks, pc);
+        }
+    }
+    free(seen);
+    free(stack);
+}
+
+static u32 get_symbols(NativeSymbol* symbols,
+                       char*         names,
+                       u32*          names_size,
+                       const char*   path) {
+    File* file = fopen(path, "r");
+    if (file == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    /* NOTE: Reads the `.sym` files `lc3as` writes, whose entries are a `//`,
+     * a tab, then the name and address in hex. */
+    u32  n = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file) && (n < SYMBOL_CAP)) {
+        char name[NAME_CAP];
+        u32  address;
+        if (sscanf(line, "//%*[ \t]%63s %x", name, &address) != 2) {
+            continue;
+        }
+        symbols[n].name = *names_size;
+        symbols[n].address = (u16)address;
+        symbols[n].reserved = 0;
+        const usize len = strlen(name) + 1;
+        memcpy(&names[*names_size], name, len);
+        *names_size += (u32)len;
+        ++n;
+    }
+    fclose(file);
+    return n;
+}
+
+/* NOTE: Writes the native image for the `.obj` at `obj_path`, with symbols
+ * from the `.sym` at `sym_path` if there is one. */
+static void do_convert(const char* obj_path,
+                       const char* sym_path,
+                       const char* out_path) {
+    Image* image = calloc(1, sizeof(Image));
+    File*  input = fopen(obj_path, "rb");
+    if ((image == NULL) || (input == NULL)) {
+        exit(EXIT_FAILURE);
+    }
+    u16       origin;
+    const u32 len = (u32)set_bytecode(image, input, &origin);
+    fclose(input);
+    NativeSymbol* symbols = calloc(SYMBOL_CAP, sizeof(NativeSymbol));
+    char*         names = calloc(SYMBOL_CAP, NAME_CAP);
+    if ((symbols == NULL) || (names == NULL)) {
+        exit(EXIT_FAILURE);
+    }
+    u32       names_size = 0;
+    const u32 symbol_count =
+        sym_path ? get_symbols(symbols, names, &names_size, sym_path) : 0;
+    const usize words = sizeof(NativeHeader) + sizeof(NativeSegment) +
+                        ((MEM_SIZE / 64) * sizeof(u64));
+    const usize table = words + get_padded(len * sizeof(u16));
+    const usize symbols_at = table + (len * sizeof(Predecoded));
+    const usize names_at =
+        symbols_at + (symbol_count * sizeof(NativeSymbol));
+    const usize size = get_padded(names_at + names_size);
+    u8*         bytes = calloc(1, size);
+    if (bytes == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    NativeHeader* header = (NativeHeader*)(void*)bytes;
+    header->magic = NATIVE_MAGIC;
+    header->size = size;
+    header->symbols = symbols_at;
+    header->names = names_at;
+    header->segment_count = 1;
+    header->symbol_count = symbol_count;
+    header->names_size = names_size;
+    NativeSegment* segment =
+        (NativeSegment*)(void*)&bytes[sizeof(NativeHeader)];
+    segment->words = words;
+    segment->table = table;
+    segment->len = len;
+    segment->origin = origin;
+    set_blocks((u64*)(void*)&segment[1], image);
+    memcpy(&bytes[words], &image->mem[origin], len * sizeof(u16));
+    Predecoded* predecoded = (Predecoded*)(void*)&bytes[table];
+    for (u32 i = 0; i < len; ++i) {
+        const u16 pc = (u16)(origin + i);
+        predecoded[i] = get_predecoded(pc, image->mem[pc]);
+    }
+    memcpy(&bytes[symbols_at], symbols, symbol_count * sizeof(NativeSymbol));
+    memcpy(&bytes[names_at], names, names_size);
+    header->checksum = get_native_checksum(bytes, size);
+    File* output = fopen(out_path, "wb");
+    if ((output == NULL) || (fwrite(bytes, 1, size, output) != size)) {
+        exit(EXIT_FAILURE);
+    }
+    fclose(output);
+    free(bytes);
+    free(names);
+    free(symbols);
+    free(image);
+}
+
+/* NOTE: Whether `len` bytes at `offset` lie within `size`, and start on a
+ * multiple of `align`. Offsets come from the file, so nothing here may
+ * overflow. */
+static Bool get_in_map(usize size, u64 offset, u64 len, u64 align) {
+    return (offset <= size) && (len <= (size - offset)) &&
+           !(offset % align);
+}
+
+/* NOTE: Returns `FALSE` if `fd` is not a native image at all; anything that
+ * claims to be one but does not check out is fatal. */
+static Bool set_native_image(Image* image, i32 fd) {
+    Stat info;
+    if ((fstat(fd, &info) == -1) ||
+        ((usize)info.st_size < sizeof(NativeHeader)))
+    {
+        return FALSE;
+    }
+    const usize size = (usize)info.st_size;
+    u8*         map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        exit(EXIT_FAILURE);
+    }
+    const NativeHeader* header = (const NativeHeader*)(const void*)map;
+    if (header->magic != NATIVE_MAGIC) {
+        munmap(map, size);
+        return FALSE;
+    }
+    if ((header->size != size) || (size % sizeof(u64)) ||
+        (get_native_checksum(map, size) != header->checksum) ||
+        !get_in_map(size,
+                    sizeof(NativeHeader),
+                    (header->segment_count * (u64)sizeof(NativeSegment)) +
+                        ((MEM_SIZE / 64) * sizeof(u64)),
+                    sizeof(u64)) ||
+        !get_in_map(size,
+                    header->symbols,
+                    header->symbol_count * (u64)sizeof(NativeSymbol),
+                    sizeof(u64)) ||
+        !get_in_map(size, header->names, header->names_size, 1) ||
+        (header->names_size && map[header->names + header->names_size - 1]))
+    {
+        exit(EXIT_FAILURE);
+    }
+    Native* native = calloc(1, sizeof(Native));
+    if (native == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    native->header = header;
+    native->segments =
+        (const NativeSegment*)(const void*)&map[sizeof(NativeHeader)];
+    native->blocks =
+        (const u64*)(const void*)&native->segments[header->segment_count];
+    native->symbols =
+        (const NativeSymbol*)(const void*)&map[header->symbols];
+    native->names = (const char*)&map[header->names];
+    native->map = map;
+    /* NOTE: Names end in a `NUL` (checked above), so any name that starts
+     * inside them ends inside them too. */
+    for (u32 i = 0; i < header->symbol_count; ++i) {
+        if (header->names_size <= native->symbols[i].name) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (u32 i = 0; i < header->segment_count; ++i) {
+        const NativeSegment* segment = &native->segments[i];
+        if ((MEM_SIZE < (segment->origin + segment->len)) ||
+            !get_in_map(size,
+                        segment->words,
+                        segment->len * (u64)sizeof(u16),
+                        sizeof(u64)) ||
+            !get_in_map(size,
+                        segment->table,
+                        segment->len * (u64)sizeof(Predecoded),
+                        sizeof(u64)))
+        {
+            exit(EXIT_FAILURE);
+        }
+        const u16*        words =
+            (const u16*)(const void*)&map[segment->words];
+        const Predecoded* table =
+            (const Predecoded*)(const void*)&map[segment->table];
+        for (u32 j = 0; j < segment->len; ++j) {
+            const Predecoded predecoded =
+                get_predecoded((u16)(segment->origin + j), words[j]);
+            if (memcmp(&predecoded, &table[j], sizeof(Predecoded))) {
+                exit(EXIT_FAILURE);
+            }
+        }
+        memcpy(&image->mem[segment->origin],
+               words,
+               segment->len * sizeof(u16));
+    }
+    image->native = native;
+    return TRUE;
+}
+
+/* NOTE: Assembles the source at `path` into `image`, reporting the first
+ * error as `path:line: error`. The source is mapped rather than read. */
+static void set_source_image(Image*      image,
+                             Assembler*  assembler,
+                             i32         fd,
+                             const char* path) {
+    Stat info;
+    if (fstat(fd, &info) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    const usize size = (usize)info.st_size;
+    const char* source =
+        size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    if (source == MAP_FAILED) {
+        exit(EXIT_FAILURE);
+    }
+    const Bool assembled = set_assembly(assembler, image->mem, source, size);
+    if (size) {
+        munmap((void*)(usize)source, size);
+    }
+    if (!assembled) {
+        fprintf(stderr,
+                "%s:%u: %s\n",
+                path,
+                assembler->line,
+                assembler->error);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static Bool get_source_path(const char* path) {
+    const usize len = strlen(path);
+    return (4 <= len) && !strcmp(&path[len - 4], ".asm");
+}
+
+/* NOTE: Writes the `.obj` for the source at `asm_path`, from the lowest
+ * word assembled to the highest. */
+static void do_assemble(const char* asm_path, const char* out_path) {
+    Image*    image = calloc(1, sizeof(Image));
+    Assembler assembler = {0};
+    const i32 fd = open(asm_path, O_RDONLY | O_CLOEXEC);
+    if ((image == NULL) || (fd == -1)) {
+        exit(EXIT_FAILURE);
+    }
+    set_source_image(image, &assembler, fd, asm_path);
+    close(fd);
+    if (assembler.high <= assembler.low) {
+        exit(EXIT_FAILURE);
+    }
+    const u16 origin = (u16)assembler.low;
+    const u32 len = assembler.high - assembler.low;
+    u16*      words = calloc(len + 1, sizeof(u16));
+    if (words == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    words[0] = __builtin_bswap16(origin);
+    for (u32 i = 0; i < len; ++i) {
+        words[i + 1] = __builtin_bswap16(image->mem[origin + i]);
+    }
+    File* output = fopen(out_path, "wb");
+    if ((output == NULL) ||
+        (fwrite(words, sizeof(u16), len + 1, output) != (len + 1)))
+    {
+        exit(EXIT_FAILURE);
+    }
+    fclose(output);
+    free(words);
+    do_free_assembler(&assembler);
+    free(image);
+}
+
+/* NOTE: Unmaps the native image `set_image` left in `image`, if any. The
+ * words it loaded stay where they are. */
+static void do_free_native(Image* image) {
+    const Native* native = image->native;
+    if (native == NULL) {
+        return;
+    }
+    munmap((void*)(usize)native->map, native->header->size);
+    free((void*)(usize)native);
+    image->native = NULL;
+}
+
+/* NOTE: Loads a native image, an `.obj`, or (going by the extension) LC-3
+ * source. */
+static void set_image(Image* image, const char* path) {
+    const i32 fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        exit(EXIT_FAILURE);
+    }
+    if (get_source_path(path)) {
+        Assembler assembler = {0};
+        set_source_image(image, &assembler, fd, path);
+        do_free_assembler(&assembler);
+        close(fd);
+        return;
+    }
+    if (set_native_image(image, fd)) {
+        close(fd);
+        return;
+    }
+    File* file = fdopen(fd, "rb");
+    if (file == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    u16 origin;
+    set_bytecode(image, file, &origin);
+    fclose(file);
+}
+
+static const Predecoded* get_native_decoded(const Native* native, u16 pc) {
+    for (u32 i = 0; i < native->header->segment_count; ++i) {
+        const NativeSegment* segment = &native->segments[i];
+        if ((segment->origin <= pc) &&
+            (pc < (segment->origin + segment->len)))
+        {
+            return &((const Predecoded*)(const void*)&native
+                         ->map[segment->table])[pc - segment->origin];
+        }
+    }
+    return NULL;
+}
+
+static const char* get_symbol(const Native* native, u16 address) {
+    for (u32 i = 0; i < native->header->symbol_count; ++i) {
+        if ((native->symbols[i].address == address) &&
+            (native->symbols[i].name < native->header->names_size))
+        {
+            return &native->names[native->symbols[i].name];
+        }
+    }
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef __PACK_H__
+#define __PACK_H__
+
+#include "pre_vm.h"
+
+/* NOTE: Packs a page of words as its difference (`^`) from a base page,
+ * usually the same page of the image, so whatever the guest has left alone
+ * packs down to nothing. The difference is run-length coded: a header word
+ * with its top bit set repeats the word after it that many times (less the
+ * top bit), and one without is followed by that many words as they are. */
+#define PACK_RUN  (1 << 15)
+#define PACK_MIN  3
+#define PACK_SPAN (1 << 8)
+
+/* NOTE: Writes at most `cap` words to `packed` and returns how many, or `0`
+ * if they would not fit. */
+static u32 get_packed(const u16* words,
+                      const u16* base,
+                      u32        len,
+                      u16*       packed,
+                      u32        cap) {
+    u32  n = 0;
+    u32  literal = 0;
+    Bool open = FALSE;
+    for (u32 i = 0; i < len;) {
+        const u16 x = words[i] ^ base[i];
+        u32       run = 1;
+        while (((i + run) < len) && ((words[i + run] ^ base[i + run]) == x))
+        {
+            ++run;
+        }
+        if (run < PACK_MIN) {
+            if (!open || (packed[literal] == (PACK_SPAN - 1))) {
+                if (cap <= n) {
+                    return 0;
+                }
+                literal = n;
+                packed[n++] = 0;
+                open = TRUE;
+            }
+            if (cap <= n) {
+                return 0;
+            }
+            ++packed[literal];
+            packed[n++] = x;
+            ++i;
+            continue;
+        }
+        if (cap < (n + 2)) {
+            return 0;
+        }
+        packed[n++] = (u16)(PACK_RUN | run);
+        packed[n++] = x;
+        open = FALSE;
+        i += run;
+    }
+    return n;
+}
+
+static void do_unpack(const u16* packed,
+                      const u16* base,
+                      u32        len,
+                      u16*       words) {
+    for (u32 i = 0; i < len;) {
+        const u16 header = *packed++;
+        const u32 count = (u32)(header & ~PACK_RUN);
+        if (header & PACK_RUN) {
+            const u16 x = *packed++;
+            for (u32 j = 0; j < count; ++j, ++i) {
+                words[i] = base[i] ^ x;
+            }
+        } else {
+            for (u32 j = 0; j < count; ++j, ++i) {
+                words[i] = base[i] ^ *packed++;
+            }
+        }
+    }
+}
+
+/* NOTE: Reads one word without unpacking the rest. */
+static u16 get_unpacked(const u16* packed, const u16* base, u32 index) {
+    for (u32 i = 0;;) {
+        const u16 header = *packed++;
+        const u32 count = (u32)(header & ~PACK_RUN);
+        if (index < (i + count)) {
+            return base[index] ^
+                   ((header & PACK_RUN) ? packed[0] : packed[index - i]);
+        }
+        i += count;
+        packed += (header & PACK_RUN) ? 1 : count;
+    }
+}
+
+#endif
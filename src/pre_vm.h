@@ -11,9 +11,12 @@ typedef struct timeval TimeVal;
 
 typedef uint8_t  u8;
 typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
 typedef size_t   usize;
 
 #define U16_MAX 0xFFFF
+#define U64_MAX 0xFFFFFFFFFFFFFFFFllu
 
 typedef int8_t  i8;
 typedef int16_t i16;
@@ -52,9 +55,9 @@ typedef enum {
     OP_LDI,     // load indirect
     OP_STI,     // store indirect
     OP_JMP,     // jump
-    // OP_RES,   // reserved (unused)
-    OP_LEA = 14, // load effective address
-    OP_TRAP,     // execute trap
+    OP_RES,     // reserved (breakpoint)
+    OP_LEA,     // load effective address
+    OP_TRAP,    // execute trap
 } OpCode;
 
 typedef enum {
@@ -64,11 +67,19 @@ typedef enum {
     TRAP_IN = 0x23,    // get char from keyboard, echoed onto the terminal
     TRAP_PUTSP = 0x24, // output a byte string
     TRAP_HALT = 0x25,  // halt the program
+    TRAP_SLEEP = 0x26, // wait for the clock or for input, whichever is first
+    TRAP_CAS = 0x27,   // compare-and-swap a word of memory
 } Trap;
 
 typedef enum {
     KEYBOARD_STATUS = 0xFE00,
     KEYBOARD_DATA = 0xFE02,
+    CORE_ID = 0xFE10,
+    CORE_COUNT = 0xFE12,
+    TIMER_CYCLES = 0xFE20,
+    TIMER_CYCLES_HIGH = 0xFE22,
+    TIMER_MS = 0xFE24,
+    TIMER_MS_HIGH = 0xFE26,
 } MemoryMap;
 
 typedef enum {
@@ -80,12 +91,14 @@ typedef enum {
 typedef enum {
     DEAD = 0,
     ALIVE,
+    EXHAUSTED,   // ran out of instruction budget
+    EXPIRED,     // ran past its wall-clock deadline
+    STOPPED,     // hit a breakpoint or watchpoint
+    BLOCKED,     // waiting on input that has not arrived
+    INTERRUPTED, // stopped by `SIGINT`
+    FAULTED,     // stored to a frozen page
 } Status;
 
-static u16    MEM[U16_MAX] = {0};
-static u16    REG[R_SIZE] = {0};
-static Status STATUS = ALIVE;
-
 #define PC_START 0x3000
 
 static u16 get_sign_extend(u16 x, u16 bit_count) {
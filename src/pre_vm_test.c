@@ -1,16 +1,15 @@
-#include <string.h>
+#define _GNU_SOURCE
 
-#include "pre_vm.h"
+#include <string.h>
+#include <sys/wait.h>
 
-typedef struct {
-    i16    immediate_or_offset;
-    u8     r0_or_nzp;
-    u8     r1;
-    u8     r2;
-    Trap   trap;
-    Bool   mode;
-    OpCode op;
-} Instr;
+#include "asm.h"
+#include "cores.h"
+#include "fork.h"
+#include "ring.h"
+#include "screen.h"
+#include "session.h"
+#include "verify.h"
 
 #define FAIL(test)               \
     {                            \
@@ -18,279 +17,6 @@ typedef struct {
         exit(EXIT_FAILURE);      \
     }
 
-static void set_op(u16* instr, OpCode op) {
-    *instr = (u16)(*instr | (op << 12));
-}
-
-static void set_r0_or_nzp(u16* instr, u8 r0_or_nzp) {
-    *instr = (u16)(*instr | ((r0_or_nzp & 0x7) << 9));
-}
-
-static void set_r1(u16* instr, u8 r1) {
-    *instr = (u16)(*instr | ((r1 & 0x7) << 6));
-}
-
-static void set_r2(u16* instr, u8 r2) {
-    *instr = (u16)(*instr | (r2 & 0x7));
-}
-
-static void set_immediate(u16* instr, i8 immediate) {
-    *instr = (u16)(*instr | (1 << 5) | (immediate & 0x1F));
-}
-
-static void set_pc_offset_9(u16* instr, i16 pc_offset) {
-    *instr = (u16)(*instr | (pc_offset & 0x1FF));
-}
-
-static void set_relative_mode_and_pc_offset_11(u16* instr, i16 pc_offset) {
-    *instr = (u16)(*instr | (1 << 11) | (pc_offset & 0x7FF));
-}
-
-static void set_reg_offset_6(u16* instr, i16 pc_offset) {
-    *instr = (u16)(*instr | (pc_offset & 0x3F));
-}
-
-static void set_trap(u16* instr, Trap trap) {
-    *instr = (u16)(*instr | (trap & 0xFF));
-}
-
-static u16 get_op_branch(Instr instr) {
-    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-    // | 0   0   0   0 |    NZP    |             PC_OFFSET             |
-    // +---------------+-----------+-----------------------------------+
-    u16 bin_instr = 0;
-    set_op(&bin_instr, OP_BR);
-    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
-    set_pc_offset_9(&bin_instr, instr.immediate_or_offset);
-    return bin_instr;
-}
-
-static u16 get_op_add(Instr instr) {
-    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-    // |               |           |           | 1 |     IMMEDIATE     |
-    // | 0   0   0   1 |     R0    |     R1    +---+-------+-----------|
-    // |               |           |           | 0 |  NULL |     R2    |
-    // +---------------+-----------+-----------+---+-------+-----------+
-    u16 bin_instr = 0;
-    set_op(&bin_instr, OP_ADD);
-    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
-    set_r1(&bin_instr, instr.r1);
-    if (instr.mode) {
-        set_immediate(&bin_instr, (i8)instr.immediate_or_offset);
-    } else {
-        set_r2(&bin_instr, instr.r2);
-    }
-    return bin_instr;
-}
-
-static u16 get_op_load(Instr instr) {
-    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-    // | 0   0   1   0 |     R0    |             PC_OFFSET             |
-    // +---------------+-----------+-----------------------------------+
-    u16 bin_instr = 0;
-    set_op(&bin_instr, OP_LD);
-    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
-    set_pc_offset_9(&bin_instr, instr.immediate_or_offset);
-    return bin_instr;
-}
-
-static u16 get_op_store(Instr instr) {
-    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-    // | 0   0   1   1 |     R0    |             PC_OFFSET             |
-    // +---------------+-----------+-----------------------------------+
-    u16 bin_instr = 0;
-    set_op(&bin_instr, OP_ST);
-    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
-    set_pc_offset_9(&bin_instr, instr.immediate_or_offset);
-    return bin_instr;
-}
-
-static u16 get_op_jump_subroutine(Instr instr) {
-    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-    // |               | 1 |                 PC_OFFSET                 |
-    // | 0   1   0   0 +---+-------+-----------+-----------------------+
-    // |               | 0 |  NULL |     R1    |          NULL         |
-    // +---------------+---+-------+-----------+-----------------------+
-    u16 bin_instr = 0;
-    set_op(&bin_instr, OP_JSR);
-    if (instr.mode) {
-        set_relative_mode_and_pc_offset_11(&bin_instr,
-                                           instr.immediate_or_offset);
-    } else {
-        set_r1(&bin_instr, instr.r1);
-    }
-    return bin_instr;
-}
-
-static u16 get_op_and(Instr instr) {
-    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-    // |               |           |           | 1 |     IMMEDIATE     |
-    // | 0   1   0   1 |     R0    |     R1    +---+-------+-----------|
-    // |               |           |           | 0 |  NULL |     R2    |
-    // +---------------+-----------+-----------+---+-------+-----------+
-    u16 bin_instr = 0;
-    set_op(&bin_instr, OP_AND);
-    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
-    set_r1(&bin_instr, instr.r1);
-    if (instr.mode) {
-        set_immediate(&bin_instr, (i8)instr.immediate_or_offset);
-    } else {
-        set_r2(&bin_instr, instr.r2);
-    }
-    return bin_instr;
-}
-
-static u16 get_op_load_register(Instr instr) {
-    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-    // | 0   1   1   0 |     R0    |     R1    |         OFFSET        |
-    // +---------------+-----------+-----------+-----------------------+
-    u16 bin_instr = 0;
-    set_op(&bin_instr, OP_LDR);
-    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
-    set_r1(&bin_instr, instr.r1);
-    set_reg_offset_6(&bin_instr, instr.immediate_or_offset);
-    return bin_instr;
-}
-
-static u16 get_op_store_register(Instr instr) {
-    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-    // | 0   1   1   1 |     R0    |     R1    |         OFFSET        |
-    // +---------------+-----------+-----------+-----------------------+
-    u16 bin_instr = 0;
-    set_op(&bin_instr, OP_STR);
-    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
-    set_r1(&bin_instr, instr.r1);
-    set_reg_offset_6(&bin_instr, instr.immediate_or_offset);
-    return bin_instr;
-}
-
-static u16 get_op_not(Instr instr) {
-    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-    // | 1   0   0   1 |     R0    |     R1    | 1 | 1 | 1 | 1 | 1 | 1 |
-    // +---------------+-----------+-----------+---+---+---+---+---+---+
-    u16 bin_instr = 0;
-    set_op(&bin_instr, OP_NOT);
-    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
-    set_r1(&bin_instr, instr.r1);
-    set_reg_offset_6(&bin_instr, -1);
-    return bin_instr;
-}
-
-static u16 get_op_load_indirect(Instr instr) {
-    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-    // | 1   0   1   0 |     R0    |             PC_OFFSET             |
-    // +---------------+-----------+-----------------------------------+
-    u16 bin_instr = 0;
-    set_op(&bin_instr, OP_LDI);
-    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
-    set_pc_offset_9(&bin_instr, instr.immediate_or_offset);
-    return bin_instr;
-}
-
-static u16 get_op_store_indirect(Instr instr) {
-    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-    // | 1   0   1   1 |     R0    |             PC_OFFSET             |
-    // +---------------+-----------+-----------------------------------+
-    u16 bin_instr = 0;
-    set_op(&bin_instr, OP_STI);
-    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
-    set_pc_offset_9(&bin_instr, instr.immediate_or_offset);
-    return bin_instr;
-}
-
-static u16 get_op_jump(Instr instr) {
-    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-    // | 1   1   0   0 |    NULL   |     R1    |          NULL         |
-    // +---------------+-----------+-----------------------------------+
-    u16 bin_instr = 0;
-    set_op(&bin_instr, OP_JMP);
-    set_r1(&bin_instr, instr.r1);
-    return bin_instr;
-}
-
-static u16 get_op_load_effective_address(Instr instr) {
-    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-    // | 1   1   1   0 |     R0    |             PC_OFFSET             |
-    // +---------------+-----------+-----------------------------------+
-    u16 bin_instr = 0;
-    set_op(&bin_instr, OP_LEA);
-    set_r0_or_nzp(&bin_instr, instr.r0_or_nzp);
-    set_pc_offset_9(&bin_instr, instr.immediate_or_offset);
-    return bin_instr;
-}
-
-static u16 get_op_trap(Instr instr) {
-    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
-    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-    // | 1   1   1   1 |      NULL     |              TRAP             |
-    // +---------------+---------------+-------------------------------+
-    u16 bin_instr = 0;
-    set_op(&bin_instr, OP_TRAP);
-    set_trap(&bin_instr, instr.trap);
-    return bin_instr;
-}
-
-static u16 get_bin_instr(Instr instr) {
-    switch (instr.op) {
-    case OP_BR: {
-        return get_op_branch(instr);
-    }
-    case OP_ADD: {
-        return get_op_add(instr);
-    }
-    case OP_LD: {
-        return get_op_load(instr);
-    }
-    case OP_ST: {
-        return get_op_store(instr);
-    }
-    case OP_JSR: {
-        return get_op_jump_subroutine(instr);
-    }
-    case OP_AND: {
-        return get_op_and(instr);
-    }
-    case OP_LDR: {
-        return get_op_load_register(instr);
-    }
-    case OP_STR: {
-        return get_op_store_register(instr);
-    }
-    case OP_NOT: {
-        return get_op_not(instr);
-    }
-    case OP_LDI: {
-        return get_op_load_indirect(instr);
-    }
-    case OP_STI: {
-        return get_op_store_indirect(instr);
-    }
-    case OP_JMP: {
-        return get_op_jump(instr);
-    }
-    case OP_LEA: {
-        return get_op_load_effective_address(instr);
-    }
-    case OP_TRAP: {
-        return get_op_trap(instr);
-    }
-    }
-    exit(EXIT_FAILURE);
-}
-
 static void set_u16_to_string(char* buffer, u16 x) {
     u8 i = 15;
     u8 j = 0;
@@ -676,6 +402,1213 @@ static void test_op_trap_halt(char* buffer) {
     printf(".");
 }
 
+static void test_asm_labels(u16* mem) {
+    const char source[] = ".ORIG x3000\n"
+                          "LOOP ADD R1, R1, #-1 ; count down\n"
+                          "     BRp LOOP\n"
+                          "     BRnzp DONE\n"
+                          "     NOT R0, R0\n"
+                          "DONE HALT\n"
+                          ".END\n";
+    Assembler assembler = {0};
+    if (!set_assembly(&assembler, mem, source, sizeof(source) - 1)) {
+        FAIL("test_asm_labels (set_assembly)");
+    }
+    if ((assembler.low != 0x3000) || (assembler.high != 0x3005) ||
+        (mem[0x3000] != 0x127F) || (mem[0x3001] != 0x03FE) ||
+        (mem[0x3002] != 0x0E01) || (mem[0x3003] != 0x903F) ||
+        (mem[0x3004] != 0xF025))
+    {
+        FAIL("test_asm_labels");
+    }
+    do_free_assembler(&assembler);
+    printf(".");
+}
+
+static void test_asm_data(u16* mem) {
+    const char source[] = ".orig x3000\n"
+                          "lea r0, text\n"
+                          "puts\n"
+                          "getc\n"
+                          ".fill text\n"
+                          "text .stringz \"hi\\n\"\n"
+                          ".end\n";
+    Assembler assembler = {0};
+    if (!set_assembly(&assembler, mem, source, sizeof(source) - 1)) {
+        FAIL("test_asm_data (set_assembly)");
+    }
+    if ((assembler.high != 0x3008) || (mem[0x3000] != 0xE003) ||
+        (mem[0x3001] != 0xF022) || (mem[0x3002] != 0xF020) ||
+        (mem[0x3003] != 0x3004) || (mem[0x3004] != 'h') ||
+        (mem[0x3005] != 'i') || (mem[0x3006] != '\n') ||
+        (mem[0x3007] != 0))
+    {
+        FAIL("test_asm_data");
+    }
+    do_free_assembler(&assembler);
+    printf(".");
+}
+
+static void test_asm_undefined_label(u16* mem) {
+    const char source[] = ".ORIG x3000\n"
+                          "ADD R0, R0, #1\n"
+                          "BRz NOWHERE\n"
+                          "HALT\n"
+                          ".END\n";
+    Assembler assembler = {0};
+    if (set_assembly(&assembler, mem, source, sizeof(source) - 1) ||
+        (assembler.line != 3) || strcmp(assembler.error, "undefined label"))
+    {
+        FAIL("test_asm_undefined_label");
+    }
+    do_free_assembler(&assembler);
+    printf(".");
+}
+
+static void set_test_image(Image* image, const char* source) {
+    memset(image, 0, sizeof(Image));
+    Assembler assembler = {0};
+    if (!set_assembly(&assembler, image->mem, source, strlen(source))) {
+        FAIL("set_test_image (set_assembly)");
+    }
+    do_free_assembler(&assembler);
+}
+
+/* NOTE: A VM set to run `source`, reading and writing `buffers`. */
+static Vm* get_test_vm(Image* image, const char* source, Buffers* buffers) {
+    set_test_image(image, source);
+    Vm* vm = get_vm();
+    set_vm(vm, image);
+    vm->io = &IO_BUFFERS;
+    vm->io_data = buffers;
+    return vm;
+}
+
+static Tier* get_test_tier(void) {
+    Tier* tier = calloc(1, sizeof(Tier));
+    if (tier == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    return tier;
+}
+
+/* NOTE: Whether `row` of the grid reads `text`, and is blank after it. */
+static Bool get_screen_row(const Screen* screen, u8 row, const char* text) {
+    const usize len = strlen(text);
+    for (usize i = len; i < SCREEN_COLS; ++i) {
+        if (screen->cells[row][i] != ' ') {
+            return FALSE;
+        }
+    }
+    return !memcmp(screen->cells[row], text, len);
+}
+
+static void test_screen_cursor(Vm* vm, Screen* screen) {
+    set_screen(screen, NULL);
+    put_str(vm,
+            "\x1B[2J"
+            "\x1B[3;5Hab"
+            "\x1B[2Ac"
+            "\x1B[Bd"
+            "\x1B[3Ce"
+            "\x1B[5Df"
+            "\x1B[1;1fg"
+            "\x1B[30;90H");
+    char  text[SCREEN_ROWS * (SCREEN_COLS + 1) + 1] = {0};
+    File* file = fmemopen(text, sizeof(text), "w");
+    if (file == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    do_print_screen(screen, file);
+    fclose(file);
+    if (strcmp(text,
+               "g     c\n"
+               "       f   e\n"
+               "    ab\n"
+               "\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n") ||
+        (screen->row != (SCREEN_ROWS - 1)) ||
+        (screen->col != (SCREEN_COLS - 1)))
+    {
+        FAIL("test_screen_cursor");
+    }
+    printf(".");
+}
+
+static void test_screen_erase(Vm* vm, Screen* screen) {
+    set_screen(screen, NULL);
+    put_str(vm,
+            "0123456789\n0123456789\n0123456789"
+            "\x1B[2;5H\x1B[K"
+            "\x1B[1;5H\x1B[1K"
+            "\x1B[3;5H\x1B[2K");
+    if (!get_screen_row(screen, 0, "     56789") ||
+        !get_screen_row(screen, 1, "0123") || !get_screen_row(screen, 2, ""))
+    {
+        FAIL("test_screen_erase (K)");
+    }
+    set_screen(screen, NULL);
+    put_str(vm, "abc\nabc\nabc\x1B[2;2H\x1B[J");
+    if (!get_screen_row(screen, 0, "abc") || !get_screen_row(screen, 1, "a") ||
+        !get_screen_row(screen, 2, ""))
+    {
+        FAIL("test_screen_erase (J 0)");
+    }
+    set_screen(screen, NULL);
+    put_str(vm, "abc\nabc\nabc\x1B[2;2H\x1B[1J");
+    if (!get_screen_row(screen, 0, "") || !get_screen_row(screen, 1, "  c") ||
+        !get_screen_row(screen, 2, "abc"))
+    {
+        FAIL("test_screen_erase (J 1)");
+    }
+    put_str(vm, "\x1B[2J");
+    for (u8 row = 0; row < SCREEN_ROWS; ++row) {
+        if (!get_screen_row(screen, row, "")) {
+            FAIL("test_screen_erase (J 2)");
+        }
+    }
+    printf(".");
+}
+
+static void test_screen_wrap(Vm* vm, Screen* screen) {
+    set_screen(screen, NULL);
+    for (u32 i = 0; i <= SCREEN_COLS; ++i) {
+        vm->io->put_char(vm, (char)('a' + (i % 26)));
+    }
+    const char last = (char)('a' + ((SCREEN_COLS - 1) % 26));
+    if ((screen->cells[0][SCREEN_COLS - 1] != last) ||
+        !get_screen_row(screen, 1, "c") || (screen->col != 1))
+    {
+        FAIL("test_screen_wrap (wrap)");
+    }
+    set_screen(screen, NULL);
+    put_str(vm, "\tx\nab\tc\nab\bc\n\bd");
+    if (!get_screen_row(screen, 0, "        x") ||
+        !get_screen_row(screen, 1, "ab      c") ||
+        !get_screen_row(screen, 2, "ac") || !get_screen_row(screen, 3, "d"))
+    {
+        FAIL("test_screen_wrap (tab)");
+    }
+    set_screen(screen, NULL);
+    char line[8];
+    for (u32 i = 0; i <= SCREEN_ROWS; ++i) {
+        snprintf(line, sizeof(line), i < SCREEN_ROWS ? "L%02u\n" : "L%02u", i);
+        put_str(vm, line);
+    }
+    for (u8 row = 0; row < SCREEN_ROWS; ++row) {
+        snprintf(line, sizeof(line), "L%02u", (u32)(row + 1));
+        if (!get_screen_row(screen, row, line)) {
+            FAIL("test_screen_wrap (scroll)");
+        }
+    }
+    printf(".");
+}
+
+/* NOTE: Each frame after the first writes only the spans that changed,
+ * joining changes closer than `SPAN_GAP`. */
+static void test_screen_present(Vm* vm, Screen* screen) {
+    char*  bytes = NULL;
+    usize  len = 0;
+    File*  file = open_memstream(&bytes, &len);
+    if (file == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    set_screen(screen, file);
+    put_str(vm, "hello");
+    do_present_screen(screen);
+    if ((len != 15) || memcmp(bytes, "\x1B[2J\x1B[1;1Hhello", len)) {
+        FAIL("test_screen_present (first)");
+    }
+    usize last = len;
+    put_str(vm, "\x1B[1;1HX\x1B[1;4HY\x1B[6;71HZ\x1B[1;6H");
+    do_present_screen(screen);
+    const char frame[] = "\x1B[1;1HXelY\x1B[6;71HZ\x1B[1;6H";
+    if (((len - last) != (sizeof(frame) - 1)) ||
+        memcmp(&bytes[last], frame, len - last) ||
+        !get_screen_row(screen, 0, "XelYo"))
+    {
+        FAIL("test_screen_present (spans)");
+    }
+    last = len;
+    put_str(vm, "\x1B[1;1HX");
+    do_present_screen(screen);
+    do_present_screen(screen);
+    if (((len - last) != 6) || memcmp(&bytes[last], "\x1B[1;2H", 6) ||
+        (screen->frames != 3))
+    {
+        FAIL("test_screen_present (unchanged)");
+    }
+    fclose(file);
+    free(bytes);
+    printf(".");
+}
+
+/* NOTE: The loop is decoded from the word the guest patched, so its page is
+ * still `PAGE_CODE` when reset copies the image's word back over it. */
+static void test_reset_dirty_pages(Image* image) {
+    Buffers buffers = {0};
+    Vm*     vm = get_test_vm(image,
+                           ".ORIG x3000\n"
+                           "      LD R3, NEW\n"
+                           "      ST R3, PATCH\n"
+                           "      LD R1, COUNT\n"
+                           "LOOP  ADD R2, R2, #1\n"
+                           "      STI R2, FAR\n"
+                           "PATCH ADD R1, R1, #-2\n"
+                           "      BRp LOOP\n"
+                           "      HALT\n"
+                           "COUNT .FILL #100\n"
+                           "FAR   .FILL x5000\n"
+                           "NEW   ADD R1, R1, #-1\n"
+                           ".END\n",
+                           &buffers);
+    Tier*   tier = get_test_tier();
+    run_tiered(vm, tier, 100000, 0);
+    const u8 code = 0x3000 >> PAGE_BITS;
+    if ((vm->status != DEAD) || !(vm->pages[code] & PAGE_CODE) ||
+        !(vm->pages[code] & PAGE_DIRTY) ||
+        (vm->mem[0x3005] == image->mem[0x3005]) || (vm->mem[0x5000] != 100))
+    {
+        FAIL("test_reset_dirty_pages (run)");
+    }
+    const u32 generation = vm->generations[code];
+    do_reset_vm(vm);
+    if (memcmp(vm->mem, image->mem, MEM_SIZE * sizeof(u16)) ||
+        (vm->status != ALIVE) || (vm->reg[R_PC] != PC_START) ||
+        (vm->generations[code] == generation))
+    {
+        FAIL("test_reset_dirty_pages (reset)");
+    }
+    for (u8 r = 0; r < R_SIZE; ++r) {
+        if ((r != R_PC) && vm->reg[r]) {
+            FAIL("test_reset_dirty_pages (registers)");
+        }
+    }
+    for (u32 i = 0; i < PAGE_COUNT; ++i) {
+        if ((vm->pages[i] & PAGE_DIRTY) || vm->dirty[i >> 6]) {
+            FAIL("test_reset_dirty_pages (pages)");
+        }
+    }
+    free(buffers.output);
+    free(tier);
+    do_free_vm(vm);
+    printf(".");
+}
+
+/* NOTE: `PATCH` is rewritten once both subroutines are hot. Only its own
+ * block goes, and `BUMP`, on the same page, keeps running decoded. */
+static void test_invalidate_store(Image* image) {
+    Buffers   buffers = {0};
+    Vm*       vm = get_test_vm(image,
+                               ".ORIG x3000\n"
+                               "      LD R1, COUNT\n"
+                               "FIRST JSR BUMP\n"
+                               "      JSR PATCH\n"
+                               "      ADD R1, R1, #-1\n"
+                               "      BRp FIRST\n"
+                               "      LD R3, NEW\n"
+                               "      ST R3, PATCH\n"
+                               "      LD R1, COUNT\n"
+                               "LAST  JSR BUMP\n"
+                               "      JSR PATCH\n"
+                               "      ADD R1, R1, #-1\n"
+                               "      BRp LAST\n"
+                               "      HALT\n"
+                               "BUMP  ADD R2, R2, #1\n"
+                               "      RET\n"
+                               "PATCH ADD R5, R5, #1\n"
+                               "      RET\n"
+                               "COUNT .FILL #100\n"
+                               "NEW   ADD R5, R5, #2\n"
+                               ".END\n",
+                               &buffers);
+    Tier*     tier = get_test_tier();
+    const u16 bump = 0x300D;
+    const u16 patch = 0x300F;
+    run_tiered(vm, tier, 1 + (100 * 8), 0);
+    const Block* bump_block = get_block(tier, bump);
+    if ((vm->status != EXHAUSTED) || (bump_block == NULL) ||
+        (get_block(tier, patch) == NULL) || (vm->reg[R_5] != 100))
+    {
+        FAIL("test_invalidate_store (first)");
+    }
+    vm->status = ALIVE;
+    run_tiered(vm, tier, 100000, 0);
+    if ((vm->status != DEAD) || (vm->reg[R_2] != 200) ||
+        (vm->reg[R_5] != 300) || (tier->invalidations != 1) ||
+        (get_block(tier, bump) != bump_block) ||
+        get_outdated(vm, bump_block) ||
+        (get_block(tier, patch) == NULL) ||
+        (get_block(tier, patch)->code[0].instr != image->mem[0x3012]))
+    {
+        FAIL("test_invalidate_store (last)");
+    }
+    free(buffers.output);
+    free(tier);
+    do_free_vm(vm);
+    printf(".");
+}
+
+static void test_verify_unchanged_page(Image* image) {
+    set_test_image(image,
+                   ".ORIG x3000\n"
+                   "HALT\n"
+                   ".END\n");
+    Vm* vm = get_vm();
+    set_vm(vm, image);
+    u64 hashes[PAGE_COUNT];
+    for (u32 i = 0; i < PAGE_COUNT; ++i) {
+        hashes[i] = get_page_hash(vm->mem, (u8)i);
+    }
+    u64 hash = 0;
+    set_mem_at(vm, 0x4000, vm->mem[0x4000]);
+    do_hash_pages(vm, hashes, &hash);
+    if (hash != 0) {
+        FAIL("test_verify_unchanged_page (touched)");
+    }
+    set_mem_at(vm, 0x4000, 1);
+    do_hash_pages(vm, hashes, &hash);
+    if (hash == 0) {
+        FAIL("test_verify_unchanged_page (stored)");
+    }
+    set_mem_at(vm, 0x4000, 0);
+    do_hash_pages(vm, hashes, &hash);
+    if (hash != 0) {
+        FAIL("test_verify_unchanged_page (restored)");
+    }
+    do_free_vm(vm);
+    printf(".");
+}
+
+/* NOTE: The lifted loop stores back the value it just loaded, which the IR
+ * does not write again. */
+static void test_verify_same_store(Image* image) {
+    Buffers   buffers = {0};
+    Vm*       vm = get_test_vm(image,
+                               ".ORIG x3000\n"
+                               "      AND R2, R2, #0\n"
+                               "LOOP  LD R1, VALUE\n"
+                               "      ST R1, VALUE\n"
+                               "      ADD R2, R2, #1\n"
+                               "      BRnzp LOOP\n"
+                               "VALUE .FILL #7\n"
+                               ".END\n",
+                               &buffers);
+    Tier*     tier = get_test_tier();
+    Verifier* verifier = calloc(1, sizeof(Verifier));
+    if (verifier == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    do_start_verifier(verifier, vm, 2000);
+    const u64 instrs = run_verified(verifier, vm, tier, 2000000, 0);
+    do_stop_verifier(verifier, vm);
+    if ((instrs != 2000000) || (vm->status != EXHAUSTED) ||
+        (tier->builder.stats.dropped == 0) || (verifier->windows == 0) ||
+        (verifier->divergences != 0))
+    {
+        FAIL("test_verify_same_store");
+    }
+    free(verifier);
+    free(tier);
+    do_free_vm(vm);
+    printf(".");
+}
+
+static u16 get_test_random(u32* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return (u16)*state;
+}
+
+/* NOTE: Packs `words` against `base`, then checks that both ways back give
+ * the same words. Returns the packed length. */
+static u32 get_round_trip(const u16* words, const u16* base, u32 cap) {
+    u16       packed[PAGE_SIZE * 2];
+    u16       words_back[PAGE_SIZE];
+    const u32 len = get_packed(words, base, PAGE_SIZE, packed, cap);
+    if (len == 0) {
+        return 0;
+    }
+    do_unpack(packed, base, PAGE_SIZE, words_back);
+    if (memcmp(words, words_back, sizeof(words_back))) {
+        FAIL("get_round_trip (do_unpack)");
+    }
+    for (u32 i = 0; i < PAGE_SIZE; ++i) {
+        if (get_unpacked(packed, base, i) != words[i]) {
+            FAIL("get_round_trip (get_unpacked)");
+        }
+    }
+    return len;
+}
+
+static void test_pack_page(void) {
+    u16 base[PAGE_SIZE];
+    u16 words[PAGE_SIZE];
+    u32 state = 0x3000;
+    for (u32 i = 0; i < PAGE_SIZE; ++i) {
+        base[i] = get_test_random(&state);
+        words[i] = base[i];
+    }
+    for (u32 i = 0; i < PAGE_SIZE; i += 1 + (get_test_random(&state) % 9)) {
+        words[i] = get_test_random(&state);
+    }
+    for (u32 i = 40; i < 60; ++i) {
+        words[i] = base[i] ^ 0x1234;
+    }
+    const u32 len = get_round_trip(words, base, PAGE_SIZE * 2);
+    if ((len == 0) || (PAGE_SIZE <= len)) {
+        FAIL("test_pack_page");
+    }
+    printf(".");
+}
+
+static void test_pack_equal_page(void) {
+    u16 base[PAGE_SIZE];
+    u32 state = 0x3001;
+    for (u32 i = 0; i < PAGE_SIZE; ++i) {
+        base[i] = get_test_random(&state);
+    }
+    if (get_round_trip(base, base, PAGE_SIZE * 2) != 2) {
+        FAIL("test_pack_equal_page");
+    }
+    printf(".");
+}
+
+/* NOTE: No two neighbouring words differ from the base by the same amount,
+ * so the page packs as literals, `PACK_SPAN - 1` words to a header. */
+static void test_pack_different_page(void) {
+    u16 base[PAGE_SIZE] = {0};
+    u16 words[PAGE_SIZE];
+    for (u32 i = 0; i < PAGE_SIZE; ++i) {
+        words[i] = (u16)(i + 1);
+    }
+    const u32 headers = (PAGE_SIZE + PACK_SPAN - 2) / (PACK_SPAN - 1);
+    if (get_round_trip(words, base, PAGE_SIZE * 2) != (PAGE_SIZE + headers))
+    {
+        FAIL("test_pack_different_page");
+    }
+    printf(".");
+}
+
+/* NOTE: Runs that start on the first word of the page and end on its last,
+ * with literals between. */
+static void test_pack_edge_runs(void) {
+    u16 base[PAGE_SIZE] = {0};
+    u16 words[PAGE_SIZE];
+    for (u32 i = 0; i < PAGE_SIZE; ++i) {
+        words[i] = (u16)(i + 1);
+    }
+    for (u32 i = 0; i < PACK_MIN; ++i) {
+        words[i] = 0xBEEF;
+        words[PAGE_SIZE - 1 - i] = 0xF00D;
+    }
+    const u32 headers =
+        (PAGE_SIZE - (PACK_MIN * 2) + PACK_SPAN - 2) / (PACK_SPAN - 1);
+    if (get_round_trip(words, base, PAGE_SIZE * 2) !=
+        (4 + (PAGE_SIZE - (PACK_MIN * 2)) + headers))
+    {
+        FAIL("test_pack_edge_runs");
+    }
+    printf(".");
+}
+
+static void test_pack_overflow(void) {
+    u16 base[PAGE_SIZE] = {0};
+    u16 words[PAGE_SIZE];
+    for (u32 i = 0; i < PAGE_SIZE; ++i) {
+        words[i] = (u16)(i + 1);
+    }
+    if (get_round_trip(words, base, PAGE_SIZE / 2) ||
+        get_round_trip(words, base, PAGE_SIZE))
+    {
+        FAIL("test_pack_overflow (literals)");
+    }
+    if (get_round_trip(base, base, 1) || !get_round_trip(base, base, 2)) {
+        FAIL("test_pack_overflow (run)");
+    }
+    printf(".");
+}
+
+/* NOTE: Leaves pages of each kind: clean, restored, zeroed, lightly written
+ * (packed) and rewritten (kept as they are). Reading and storing through
+ * the usual accessors must see what was there before the pack. */
+static void test_pack_vm(Image* image) {
+    u32 state = 0x3002;
+    for (u32 i = 0; i < MEM_SIZE; ++i) {
+        image->mem[i] = get_test_random(&state);
+    }
+    Vm* vm = get_vm();
+    set_vm(vm, image);
+    for (u32 i = 0x1000; i < 0x4000; i += 1 + (get_test_random(&state) % 32))
+    {
+        set_mem_at(vm, (u16)i, get_test_random(&state));
+    }
+    for (u32 i = 0x4000; i < 0x5000; ++i) {
+        set_mem_at(vm, (u16)i, get_test_random(&state));
+    }
+    for (u32 i = 0x5000; i < 0x5100; ++i) {
+        set_mem_at(vm, (u16)i, (u16)~image->mem[i]);
+        set_mem_at(vm, (u16)i, image->mem[i]);
+    }
+    for (u32 i = 0x6000; i < 0x6100; ++i) {
+        set_mem_at(vm, (u16)i, 0);
+    }
+    u16* copy = malloc(MEM_SIZE * sizeof(u16));
+    if (copy == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, vm->mem, MEM_SIZE * sizeof(u16));
+    usize       released;
+    const usize held = do_pack_vm(vm, &released);
+    if ((held == 0) || (released % HOST_PAGE) ||
+        !(vm->pages[0x10] & PAGE_PACKED) || !(vm->pages[0x50] & PAGE_SHARED) ||
+        !(vm->pages[0x60] & PAGE_SHARED) || !(vm->pages[0x70] & PAGE_SHARED) ||
+        (vm->pages[0x40] & (PAGE_PACKED | PAGE_SHARED)))
+    {
+        FAIL("test_pack_vm (pack)");
+    }
+    if ((do_pack_vm(vm, &released) != held) || released) {
+        FAIL("test_pack_vm (pack again)");
+    }
+    for (u32 i = 0x1000; i < 0x2000; ++i) {
+        if (get_mem_at(vm, (u16)i) != copy[i]) {
+            FAIL("test_pack_vm (get_mem_at)");
+        }
+    }
+    for (u32 i = 0x2000; i < 0x7000; i += 3) {
+        copy[i] = get_test_random(&state);
+        set_mem_at(vm, (u16)i, copy[i]);
+    }
+    for (u32 i = 0; i < KEYBOARD_STATUS; ++i) {
+        if (get_mem_at(vm, (u16)i) != copy[i]) {
+            FAIL("test_pack_vm (compare)");
+        }
+    }
+    free(copy);
+    do_free_vm(vm);
+    printf(".");
+}
+
+typedef struct {
+    Ring* ring;
+    i32   fd;
+    u64   len;
+    Bool  in_order;
+} Reader;
+
+/* NOTE: Reads nothing until the guest has stalled on a full ring. */
+static void* do_read_test_ring(void* data) {
+    Reader* reader = data;
+    while (!__atomic_load_n(&reader->ring->stalls, __ATOMIC_RELAXED)) {
+        const TimeSpec time = {0, (long)MILLISECOND_NS};
+        nanosleep(&time, NULL);
+    }
+    reader->in_order = TRUE;
+    u8 bytes[4096];
+    for (;;) {
+        const ssize_t n = read(reader->fd, bytes, sizeof(bytes));
+        if (n <= 0) {
+            return NULL;
+        }
+        for (ssize_t i = 0; i < n; ++i, ++reader->len) {
+            reader->in_order =
+                reader->in_order && (bytes[i] == (u8)(reader->len % 251));
+        }
+    }
+}
+
+/* NOTE: Writes the ring round three times over, more than it and the pipe
+ * can hold together, so the guest has to wait on the reader. */
+static void test_ring(void) {
+    const u64 len = (RING_CAP * 3) + 123;
+    Ring*     ring = calloc(1, sizeof(Ring));
+    Vm*       vm = get_vm();
+    i32       fds[2];
+    if ((ring == NULL) || pipe(fds)) {
+        exit(EXIT_FAILURE);
+    }
+    Reader reader = {ring, fds[0], 0, FALSE};
+    Thread thread;
+    do_start_ring(ring, vm, fds[1]);
+    if (pthread_create(&thread, NULL, do_read_test_ring, &reader)) {
+        exit(EXIT_FAILURE);
+    }
+    for (u64 i = 0; i < len; ++i) {
+        vm->io->put_char(vm, (char)(i % 251));
+        if (!(i % 1000)) {
+            vm->io->flush(vm);
+        }
+    }
+    vm->io->flush(vm);
+    do_stop_ring(ring, vm);
+    close(fds[1]);
+    pthread_join(thread, NULL);
+    close(fds[0]);
+    if ((reader.len != len) || !reader.in_order || (ring->written != len) ||
+        (ring->stalls == 0) || (vm->io != &IO_STDIO))
+    {
+        FAIL("test_ring");
+    }
+    do_free_vm(vm);
+    free(ring);
+    printf(".");
+}
+
+static void test_interrupt(Image* image) {
+    Buffers buffers = {0};
+    Vm*     vm = get_test_vm(image,
+                           ".ORIG x3000\n"
+                           "LOOP  ADD R1, R1, #1\n"
+                           "      BRnzp LOOP\n"
+                           ".END\n",
+                           &buffers);
+    Tier*   tier = get_test_tier();
+    INTERRUPT = 1;
+    if (run_tiered(vm, tier, 1000000, 0) || (vm->status != INTERRUPTED)) {
+        FAIL("test_interrupt (run_tiered)");
+    }
+    vm->status = ALIVE;
+    if (run_vm(vm, 1000000, 0) || (vm->status != INTERRUPTED)) {
+        FAIL("test_interrupt (run_vm)");
+    }
+    INTERRUPT = 0;
+    vm->status = ALIVE;
+    if ((run_tiered(vm, tier, 1000, 0) != 1000) ||
+        (vm->status != EXHAUSTED))
+    {
+        FAIL("test_interrupt (cleared)");
+    }
+    free(tier);
+    do_free_vm(vm);
+    printf(".");
+}
+
+/* NOTE: Waits out `deadline` a millisecond at a time, as a host with no
+ * input would. */
+static Bool wait_test_char(Vm* vm, u64 deadline) {
+    while (!INTERRUPT && (get_host_clock(vm, CLOCK_MS) < deadline)) {
+        const TimeSpec time = {0, (long)MILLISECOND_NS};
+        nanosleep(&time, NULL);
+    }
+    return FALSE;
+}
+
+static const Io IO_TEST_WAIT = {
+    get_buffers_char,
+    poll_buffers_char,
+    put_buffers_char,
+    flush_buffers,
+    get_host_clock,
+    wait_test_char,
+};
+
+/* NOTE: Each sleep is far longer than the run is given, so the run stops
+ * in the middle of one. Without a host to wait on, sleeps take no time. */
+static void test_sleep_deadline(Image* image) {
+    Buffers buffers = {0};
+    Vm*     vm = get_test_vm(image,
+                           ".ORIG x3000\n"
+                           "LOOP  LDI R0, TIMER\n"
+                           "      LD R1, WAIT\n"
+                           "      ADD R0, R0, R1\n"
+                           "      TRAP x26\n"
+                           "      BRnzp LOOP\n"
+                           "TIMER .FILL xFE24\n"
+                           "WAIT  .FILL #30000\n"
+                           ".END\n",
+                           &buffers);
+    Tier*   tier = get_test_tier();
+    vm->io = &IO_TEST_WAIT;
+    u64 start = get_monotonic_ns();
+    run_vm(vm, U64_MAX, get_deadline(20));
+    if ((vm->status != EXPIRED) || (vm->reg[R_PC] != 0x3004) ||
+        vm->reg[R_0] || ((get_monotonic_ns() - start) > (SECOND_NS / 2)))
+    {
+        FAIL("test_sleep_deadline (run_vm)");
+    }
+    vm->status = ALIVE;
+    start = get_monotonic_ns();
+    run_tiered(vm, tier, U64_MAX, get_deadline(20));
+    if ((vm->status != EXPIRED) || (vm->reg[R_PC] != 0x3004) ||
+        ((get_monotonic_ns() - start) > (SECOND_NS / 2)))
+    {
+        FAIL("test_sleep_deadline (run_tiered)");
+    }
+    vm->io = &IO_BUFFERS;
+    vm->status = ALIVE;
+    start = get_monotonic_ns();
+    if ((run_vm(vm, 100000, 0) != 100000) || (vm->status != EXHAUSTED) ||
+        ((get_monotonic_ns() - start) > (SECOND_NS / 2)))
+    {
+        FAIL("test_sleep_deadline (IO_BUFFERS)");
+    }
+    free(tier);
+    do_free_vm(vm);
+    printf(".");
+}
+
+/* NOTE: Blocked with no input, `TRAP_IN` must not have written its prompt
+ * yet, so it is written once when the trap runs again. */
+static void test_block_trap_in(Image* image) {
+    Buffers buffers = {0};
+    Vm*     vm = get_test_vm(image,
+                           ".ORIG x3000\n"
+                           "      IN\n"
+                           "      HALT\n"
+                           ".END\n",
+                           &buffers);
+    vm->trap = handle_buffers_trap;
+    run_vm(vm, 100, 0);
+    if ((vm->status != BLOCKED) || (vm->reg[R_PC] != 0x3000) ||
+        buffers.output_len)
+    {
+        FAIL("test_block_trap_in (blocked)");
+    }
+    buffers.input = (const u8*)"x";
+    buffers.input_len = 1;
+    vm->status = ALIVE;
+    run_vm(vm, 100, 0);
+    const char* output = "Enter a character: xHALT\n";
+    if ((vm->status != DEAD) || (vm->reg[R_0] != 'x') ||
+        (buffers.output_len != strlen(output)) ||
+        memcmp(buffers.output, output, buffers.output_len))
+    {
+        FAIL("test_block_trap_in (run)");
+    }
+    free(buffers.output);
+    do_free_vm(vm);
+    printf(".");
+}
+
+/* NOTE: A frozen VM stops at a store rather than change under its fork. */
+static void test_frozen_store(Image* image) {
+    Buffers buffers = {0};
+    Vm*     vm = get_test_vm(image,
+                           ".ORIG x3000\n"
+                           "      LD R1, VALUE\n"
+                           "      ST R1, WORD\n"
+                           "      HALT\n"
+                           "VALUE .FILL x1234\n"
+                           "WORD  .FILL #0\n"
+                           ".END\n",
+                           &buffers);
+    Vm* fork = get_fork(vm);
+    run_vm(vm, 100, 0);
+    if ((vm->status != FAULTED) || (vm->reg[R_1] != 0x1234) ||
+        vm->mem[0x3004] || get_mem_at(fork, 0x3004))
+    {
+        FAIL("test_frozen_store (parent)");
+    }
+    fork->status = ALIVE;
+    run_vm(fork, 100, 0);
+    if ((fork->status != DEAD) || (get_mem_at(fork, 0x3004) != 0x1234) ||
+        vm->mem[0x3004])
+    {
+        FAIL("test_frozen_store (fork)");
+    }
+    free(buffers.output);
+    do_release_vm(fork);
+    do_release_vm(vm);
+    printf(".");
+}
+
+/* NOTE: Two cores add to one counter with `TRAP_CAS`, each by its own
+ * `CORE_ID` plus one, so a lost update or a wrong id shows in the total.
+ * Output goes nowhere, since the cores would both be writing it. */
+static void test_cores(Image* image) {
+    Buffers buffers = {0};
+    Vm*     vm = get_test_vm(image,
+                           ".ORIG x3000\n"
+                           "      LDI R3, ID\n"
+                           "      ADD R3, R3, #1\n"
+                           "      LD R4, TIMES\n"
+                           "LOOP  LD R0, ADDR\n"
+                           "      LDR R1, R0, #0\n"
+                           "      ADD R2, R1, R3\n"
+                           "      TRAP x27\n"
+                           "      NOT R5, R0\n"
+                           "      ADD R5, R5, #1\n"
+                           "      ADD R5, R5, R1\n"
+                           "      BRnp LOOP\n"
+                           "      ADD R4, R4, #-1\n"
+                           "      BRp LOOP\n"
+                           "      HALT\n"
+                           "ID    .FILL xFE10\n"
+                           "TIMES .FILL #5000\n"
+                           "ADDR  .FILL COUNT\n"
+                           "COUNT .FILL #0\n"
+                           ".END\n",
+                           &buffers);
+    vm->io = &IO_FUZZ;
+    const u64 instrs = run_cores(vm, 2, 1000000, 0);
+    if ((vm->status != DEAD) || (vm->reg[R_3] != 1) ||
+        (get_mem_at(vm, 0x3011) != 15000) || (instrs < 2 * 5000 * 10) ||
+        (vm->core_count != 1))
+    {
+        FAIL("test_cores");
+    }
+    do_free_vm(vm);
+    printf(".");
+}
+
+/* NOTE: Runs jobs through `do_job` as a server worker would, with the
+ * same VM and buffers for each, so every job must start from the image
+ * and with no output. */
+static void test_job(Image* image) {
+    Buffers buffers = {0};
+    Vm*     vm = get_test_vm(image,
+                           ".ORIG x3000\n"
+                           "      GETC\n"
+                           "      OUT\n"
+                           "      GETC\n"
+                           "      OUT\n"
+                           "      HALT\n"
+                           ".END\n",
+                           &buffers);
+    Tier*   tier = get_test_tier();
+    Server  server = {0};
+    server.images = image;
+    server.image_count = 1;
+    Connection connection = {0};
+    connection.request.input_len = 2;
+    connection.request.budget = 1000;
+    connection.input = (u8*)strdup("hi");
+    Response    response = do_job(&server, vm, tier, &buffers, &connection);
+    const char* output = "hiHALT\n";
+    if ((response.status != JOB_HALTED) ||
+        (response.output_len != strlen(output)) ||
+        (buffers.output_len != strlen(output)) ||
+        memcmp(buffers.output, output, strlen(output)) ||
+        (response.instr_count == 0) || connection.input)
+    {
+        FAIL("test_job (halted)");
+    }
+    connection.request.budget = 3;
+    connection.input = (u8*)strdup("yo");
+    response = do_job(&server, vm, tier, &buffers, &connection);
+    if ((response.status != JOB_EXHAUSTED) || (response.output_len != 1) ||
+        (buffers.output[0] != 'y') || (response.instr_count != 3))
+    {
+        FAIL("test_job (exhausted)");
+    }
+    connection.request.image_id = 1;
+    connection.input = NULL;
+    response = do_job(&server, vm, tier, &buffers, &connection);
+    if ((response.status != JOB_BAD_REQUEST) || response.output_len ||
+        response.instr_count)
+    {
+        FAIL("test_job (bad request)");
+    }
+    free(buffers.output);
+    free(tier);
+    do_free_vm(vm);
+    printf(".");
+}
+
+static void set_test_file(const char* path, const char* text) {
+    File* file = fopen(path, "w");
+    if ((file == NULL) || (fputs(text, file) == EOF)) {
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+}
+
+/* NOTE: Feeds fixed inputs through `IO_FUZZ`: a repeated input finds
+ * nothing new, a run out of input ends blocked, and a kept input is
+ * written past the seeds rather than over one of them. */
+static void test_fuzz_input(Image* image) {
+    Buffers buffers = {0};
+    Vm*     vm = get_test_vm(image,
+                           ".ORIG x3000\n"
+                           "      GETC\n"
+                           "      LD R1, NEG_A\n"
+                           "      ADD R1, R0, R1\n"
+                           "      BRz IS_A\n"
+                           "      HALT\n"
+                           "IS_A  GETC\n"
+                           "      HALT\n"
+                           "NEG_A .FILL #-97\n"
+                           ".END\n",
+                           &buffers);
+    Fuzz*   fuzz = calloc(1, sizeof(Fuzz));
+    if (fuzz == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    memset(fuzz->virgin, 0xFF, sizeof(fuzz->virgin));
+    vm->io = &IO_FUZZ;
+    vm->coverage = fuzz->trace;
+    fuzz->buffer[0] = 'b';
+    do_run_fuzz(vm, fuzz, 1, 1000);
+    if ((vm->status != DEAD) || (vm->reg[R_0] != 'b') ||
+        !get_new_coverage(fuzz))
+    {
+        FAIL("test_fuzz_input (first)");
+    }
+    do_run_fuzz(vm, fuzz, 1, 1000);
+    if ((vm->status != DEAD) || get_new_coverage(fuzz)) {
+        FAIL("test_fuzz_input (repeat)");
+    }
+    fuzz->buffer[0] = 'a';
+    do_run_fuzz(vm, fuzz, 1, 1000);
+    if ((vm->status != BLOCKED) || !get_new_coverage(fuzz) ||
+        (fuzz->execs != 3))
+    {
+        FAIL("test_fuzz_input (blocked)");
+    }
+    char directory[] = "/tmp/pre_vm_test_XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    char seed_path[64];
+    char saved_path[64];
+    snprintf(seed_path, sizeof(seed_path), "%s/id_000001", directory);
+    snprintf(saved_path, sizeof(saved_path), "%s/id_000002", directory);
+    set_test_file(seed_path, "seed");
+    fuzz->path = directory;
+    fuzz->files = 1;
+    do_save_input(fuzz, 1, TRUE);
+    char  bytes[8] = {0};
+    File* file = fopen(seed_path, "rb");
+    if ((file == NULL) || (fread(bytes, 1, sizeof(bytes), file) != 4) ||
+        memcmp(bytes, "seed", 4))
+    {
+        FAIL("test_fuzz_input (seed)");
+    }
+    fclose(file);
+    file = fopen(saved_path, "rb");
+    if ((file == NULL) || (fread(bytes, 1, sizeof(bytes), file) != 1) ||
+        (bytes[0] != 'a') || (fuzz->corpus_len != 1) || (fuzz->files != 3))
+    {
+        FAIL("test_fuzz_input (saved)");
+    }
+    fclose(file);
+    unlink(saved_path);
+    unlink(seed_path);
+    rmdir(directory);
+    free(fuzz->corpus[0].bytes);
+    free(fuzz);
+    vm->coverage = NULL;
+    do_free_vm(vm);
+    printf(".");
+}
+
+/* NOTE: Connects to the socket at `path`, giving the server a moment to
+ * start listening on it. */
+static i32 get_test_client(const char* path) {
+    SockAddrUn address = {0};
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    for (u32 i = 0; i < 200; ++i) {
+        const i32 fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            exit(EXIT_FAILURE);
+        }
+        if (!connect(fd, (SockAddr*)&address, sizeof(address))) {
+            return fd;
+        }
+        close(fd);
+        const TimeSpec time = {0, (long)(10 * MILLISECOND_NS)};
+        nanosleep(&time, NULL);
+    }
+    return -1;
+}
+
+/* NOTE: Reads from `fd` until the server closes it, waiting at most a few
+ * seconds for each read. Returns how many bytes it read, or `cap` if the
+ * connection was not closed. */
+static usize get_test_output(i32 fd, char* output, usize cap) {
+    const TimeVal time = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &time, sizeof(time));
+    usize len = 0;
+    while (len < cap) {
+        const ssize_t n = recv(fd, &output[len], cap - len, 0);
+        if (n == 0) {
+            return len;
+        }
+        if (n < 0) {
+            break;
+        }
+        len += (usize)n;
+    }
+    return cap;
+}
+
+/* NOTE: Serves two sessions of one image from a child process. Each reads
+ * its own input, and is closed once its guest halts and the output has
+ * been sent. */
+static void test_sessions(void) {
+    char directory[] = "/tmp/pre_vm_test_XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    char asm_path[64];
+    char socket_path[64];
+    snprintf(asm_path, sizeof(asm_path), "%s/a.asm", directory);
+    snprintf(socket_path, sizeof(socket_path), "%s/s.sock", directory);
+    set_test_file(asm_path,
+                  ".ORIG x3000\n"
+                  "      GETC\n"
+                  "      OUT\n"
+                  "      GETC\n"
+                  "      OUT\n"
+                  "      HALT\n"
+                  ".END\n");
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid == -1) {
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        do_run_sessions(socket_path, asm_path);
+        _exit(EXIT_FAILURE);
+    }
+    const i32 first = get_test_client(socket_path);
+    const i32 second = get_test_client(socket_path);
+    char      outputs[2][16];
+    usize     lens[2] = {0};
+    if ((first != -1) && (second != -1) && (send(second, "cd", 2, 0) == 2) &&
+        (send(first, "ab", 2, 0) == 2))
+    {
+        lens[0] = get_test_output(first, outputs[0], sizeof(outputs[0]));
+        lens[1] = get_test_output(second, outputs[1], sizeof(outputs[1]));
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(first);
+    close(second);
+    unlink(socket_path);
+    unlink(asm_path);
+    rmdir(directory);
+    if ((lens[0] != 7) || memcmp(outputs[0], "abHALT\n", 7) ||
+        (lens[1] != 7) || memcmp(outputs[1], "cdHALT\n", 7))
+    {
+        FAIL("test_sessions");
+    }
+    printf(".");
+}
+
+/* NOTE: Whether loading the image at `path` exits with `EXIT_FAILURE`, as
+ * it must for one that does not check out. */
+static Bool get_load_fails(const char* path) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+        Image* image = calloc(1, sizeof(Image));
+        if (image) {
+            set_image(image, path);
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    i32 status;
+    return (pid != -1) && (waitpid(pid, &status, 0) == pid) &&
+           WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_FAILURE);
+}
+
+/* NOTE: Writes the native image at `path` to `tampered_path` with the byte
+ * at `offset` set to `x`, and a checksum to match if `checksum` is set. */
+static void set_tampered(const char* path,
+                         const char* tampered_path,
+                         usize       offset,
+                         u8          x,
+                         Bool        checksum) {
+    File* file = fopen(path, "rb");
+    u8    bytes[1 << 15];
+    if (file == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    const usize size = fread(bytes, 1, sizeof(bytes), file);
+    fclose(file);
+    if ((size < sizeof(NativeHeader)) || (size <= offset)) {
+        exit(EXIT_FAILURE);
+    }
+    bytes[offset] = x;
+    if (checksum) {
+        NativeHeader* header = (NativeHeader*)(void*)bytes;
+        header->checksum = get_native_checksum(bytes, size);
+    }
+    file = fopen(tampered_path, "wb");
+    if ((file == NULL) || (fwrite(bytes, 1, size, file) != size)) {
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+}
+
+/* NOTE: Converts a small program and its symbols, loads the result back as
+ * a native image and unmaps it again. A table entry that does not match
+ * its word is refused even with a checksum to match, and so is a header
+ * changed under the checksum. */
+static void test_native_image(void) {
+    char directory[] = "/tmp/pre_vm_test_XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    char asm_path[64];
+    char obj_path[64];
+    char sym_path[64];
+    char native_path[64];
+    snprintf(asm_path, sizeof(asm_path), "%s/a.asm", directory);
+    snprintf(obj_path, sizeof(obj_path), "%s/a.obj", directory);
+    snprintf(sym_path, sizeof(sym_path), "%s/a.sym", directory);
+    snprintf(native_path, sizeof(native_path), "%s/a.nat", directory);
+    char tampered_path[64];
+    snprintf(tampered_path, sizeof(tampered_path), "%s/b.nat", directory);
+    set_test_file(asm_path,
+                  ".ORIG x3000\n"
+                  "LOOP  ADD R1, R1, #1\n"
+                  "      BRnzp LOOP\n"
+                  ".END\n");
+    set_test_file(sym_path, "//\tLOOP             3000\n");
+    do_assemble(asm_path, obj_path);
+    do_convert(obj_path, sym_path, native_path);
+    Image* image = calloc(1, sizeof(Image));
+    if (image == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    set_image(image, native_path);
+    const Native* native = image->native;
+    if ((native == NULL) || (image->mem[0x3000] != 0x1261) ||
+        (image->mem[0x3001] != 0x0FFE) ||
+        strcmp(get_symbol(native, 0x3000), "LOOP") ||
+        get_symbol(native, 0x3001) ||
+        (get_native_decoded(native, 0x3001)->value != 0x3000))
+    {
+        FAIL("test_native_image (set_image)");
+    }
+    const NativeSegment* segment = &native->segments[0];
+    const usize          entry = segment->table + sizeof(Predecoded);
+    const usize          r0 = entry + offsetof(Predecoded, r0);
+    const usize          value = entry + offsetof(Predecoded, value);
+    const usize          reserved = offsetof(NativeHeader, reserved);
+    set_tampered(native_path, tampered_path, r0, 200, TRUE);
+    if (!get_load_fails(tampered_path)) {
+        FAIL("test_native_image (register)");
+    }
+    set_tampered(native_path, tampered_path, value + 1, 0x50, TRUE);
+    if (!get_load_fails(tampered_path)) {
+        FAIL("test_native_image (target)");
+    }
+    set_tampered(native_path, tampered_path, reserved, 1, FALSE);
+    if (!get_load_fails(tampered_path)) {
+        FAIL("test_native_image (header)");
+    }
+    set_tampered(native_path, tampered_path, reserved, 0, FALSE);
+    if (get_load_fails(tampered_path)) {
+        FAIL("test_native_image (untouched)");
+    }
+    do_free_native(image);
+    if (image->native || (image->mem[0x3000] != 0x1261)) {
+        FAIL("test_native_image (do_free_native)");
+    }
+    do_free_native(image);
+    free(image);
+    unlink(tampered_path);
+    unlink(native_path);
+    unlink(sym_path);
+    unlink(obj_path);
+    unlink(asm_path);
+    rmdir(directory);
+    printf(".");
+}
+
 int main(void) {
     char* buffer = calloc(20, sizeof(char));
     if (buffer == NULL) {
@@ -701,6 +1634,52 @@ int main(void) {
     test_op_load_effective_address(buffer);
     test_op_trap_halt(buffer);
     free(buffer);
+    u16* mem = calloc(ASM_MEM_SIZE, sizeof(u16));
+    if (mem == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    test_asm_labels(mem);
+    test_asm_data(mem);
+    test_asm_undefined_label(mem);
+    free(mem);
+    test_pack_page();
+    test_pack_equal_page();
+    test_pack_different_page();
+    test_pack_edge_runs();
+    test_pack_overflow();
+    Vm*     vm = get_vm();
+    Screen* screen = calloc(1, sizeof(Screen));
+    if (screen == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    vm->io = &IO_SCREEN;
+    vm->io_data = screen;
+    test_screen_cursor(vm, screen);
+    test_screen_erase(vm, screen);
+    test_screen_wrap(vm, screen);
+    test_screen_present(vm, screen);
+    free(screen);
+    do_free_vm(vm);
+    Image* image = calloc(1, sizeof(Image));
+    if (image == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    test_reset_dirty_pages(image);
+    test_invalidate_store(image);
+    test_verify_unchanged_page(image);
+    test_verify_same_store(image);
+    test_pack_vm(image);
+    test_interrupt(image);
+    test_sleep_deadline(image);
+    test_block_trap_in(image);
+    test_frozen_store(image);
+    test_cores(image);
+    test_fuzz_input(image);
+    test_job(image);
+    free(image);
+    test_ring();
+    test_native_image();
+    test_sessions();
     printf("\nDone!\n");
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,238 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include "tier.h"
+
+#include <stdatomic.h>
+
+/* NOTE: A `SIGPROF` timer samples the guest's `R_PC`, the engine running it
+ * and the innermost frames of its call stack. The handler only claims a
+ * slot with an atomic add and fills it in, so it never blocks or allocates;
+ * samples that arrive once the buffer is full are counted and dropped.
+ * Everything is aggregated after the run.
+ *
+ * A sample names the instruction running: the decoded handlers keep `R_PC`
+ * on it while profiled, and the interpreter one past it. Lifted blocks no
+ * longer run one instruction at a time, and only set `R_PC` as they leave,
+ * so a sample taken in `run_ir` names the start of its block; the flat
+ * profile says how many of each address's samples were. */
+#define PROFILE_HZ 1000
+#define SAMPLE_CAP (1 << 18)
+#define FRAME_CAP  16
+#define FLAT_CAP   24
+
+typedef struct sigevent   SigEvent;
+typedef struct itimerspec ITimerSpec;
+typedef timer_t           Timer;
+typedef clockid_t         ClockId;
+
+/* NOTE: The kernel's name for the field, which older C libraries lack. */
+#ifndef sigev_notify_thread_id
+    #define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+typedef struct {
+    u16 pc;
+    u8  engine;
+    u8  depth;
+    u16 frames[FRAME_CAP];
+} Sample;
+
+typedef struct {
+    Sample*       samples;
+    atomic_uint   len;
+    atomic_uint   dropped;
+    const Vm*     vm;
+    const Native* native;
+    CallStack     calls;
+    Timer         timer;
+    u32           hz;
+} Profile;
+
+typedef struct {
+    u32 count;
+    u32 blocks;
+    u16 pc;
+} Hit;
+
+static Profile* PROFILE;
+
+static void handle_profile(i32 _) {
+    Profile*  profile = PROFILE;
+    const u32 i = atomic_fetch_add_explicit(&profile->len,
+                                            1,
+                                            memory_order_relaxed);
+    if (SAMPLE_CAP <= i) {
+        atomic_fetch_sub_explicit(&profile->len, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&profile->dropped,
+                                  1,
+                                  memory_order_relaxed);
+        return;
+    }
+    const Vm* vm = profile->vm;
+    Sample*   sample = &profile->samples[i];
+    const u32 depth =
+        vm->calls->depth < CALL_CAP ? vm->calls->depth : CALL_CAP;
+    const u32 n = depth < FRAME_CAP ? depth : FRAME_CAP;
+    sample->pc = vm->engine == TIER_INTERPRET ? (u16)(vm->reg[R_PC] - 1)
+                                              : vm->reg[R_PC];
+    sample->engine = vm->engine;
+    sample->depth = (u8)n;
+    memcpy(sample->frames,
+           &vm->calls->frames[depth - n],
+           n * sizeof(u16));
+}
+
+static void set_timer(Profile* profile, u32 hz) {
+    ITimerSpec spec = {0};
+    if (hz) {
+        spec.it_interval.tv_nsec = (long)(SECOND_NS / hz);
+        spec.it_value = spec.it_interval;
+    }
+    timer_settime(profile->timer, 0, &spec, NULL);
+}
+
+/* NOTE: Only one profile can run at a time, and only on the thread running
+ * `vm`, which must be the caller. The timer counts that thread's CPU time
+ * alone and signals it alone, so time spent compiling, verifying or writing
+ * output on other threads is not charged to whatever the guest is running.
+ * The kernel checks the timer once per tick, so rates past `CONFIG_HZ` get
+ * fewer samples than asked. */
+static void do_start_profile(Profile* profile, Vm* vm, u32 hz) {
+    memset(profile, 0, sizeof(Profile));
+    profile->samples = calloc(SAMPLE_CAP, sizeof(Sample));
+    if (profile->samples == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    profile->vm = vm;
+    profile->native = vm->image->native;
+    profile->hz = hz;
+    vm->calls = &profile->calls;
+    PROFILE = profile;
+    SigAction action = {0};
+    action.sa_handler = handle_profile;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    SigEvent event = {0};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = gettid();
+    ClockId clock;
+    if ((sigaction(SIGPROF, &action, NULL) == -1) ||
+        pthread_getcpuclockid(pthread_self(), &clock) ||
+        (timer_create(clock, &event, &profile->timer) == -1))
+    {
+        exit(EXIT_FAILURE);
+    }
+    set_timer(profile, hz);
+}
+
+static void do_stop_profile(Profile* profile, Vm* vm) {
+    timer_delete(profile->timer);
+    signal(SIGPROF, SIG_IGN);
+    vm->calls = NULL;
+    PROFILE = NULL;
+}
+
+static void do_print_location(const Profile* profile, File* file, u16 pc) {
+    const char* symbol =
+        profile->native ? get_symbol(profile->native, pc) : NULL;
+    if (symbol) {
+        fprintf(file, "%s", symbol);
+    } else {
+        fprintf(file, "x%04X", (u32)pc);
+    }
+}
+
+static i32 get_hit_order(const void* a, const void* b) {
+    const Hit* x = a;
+    const Hit* y = b;
+    if (x->count != y->count) {
+        return (x->count < y->count) - (x->count > y->count);
+    }
+    return (x->pc > y->pc) - (x->pc < y->pc);
+}
+
+static i32 get_stack_order(const void* a, const void* b) {
+    const Sample* x = a;
+    const Sample* y = b;
+    const u8      n = x->depth < y->depth ? x->depth : y->depth;
+    const i32     order = memcmp(x->frames, y->frames, n * sizeof(u16));
+    return order ? order : (x->depth > y->depth) - (x->depth < y->depth);
+}
+
+/* NOTE: Prints the hottest guest addresses to `flat`, and one line per
+ * distinct call chain to `folded` (outermost frame first, in the format
+ * `flamegraph.pl` reads). Chains deeper than `FRAME_CAP` keep their
+ * innermost frames. */
+static void do_print_profile(Profile* profile, File* flat, File* folded) {
+    const u32 len = atomic_load(&profile->len);
+    u32*      counts = calloc(MEM_SIZE, sizeof(u32));
+    u32*      blocks = calloc(MEM_SIZE, sizeof(u32));
+    Hit*      hits = calloc(MEM_SIZE, sizeof(Hit));
+    if ((counts == NULL) || (blocks == NULL) || (hits == NULL)) {
+        exit(EXIT_FAILURE);
+    }
+    u32 engines[TIER_COUNT] = {0};
+    for (u32 i = 0; i < len; ++i) {
+        const Sample* sample = &profile->samples[i];
+        ++counts[sample->pc];
+        blocks[sample->pc] += sample->engine == TIER_IR;
+        ++engines[sample->engine % TIER_COUNT];
+    }
+    u32 n = 0;
+    for (u32 pc = 0; pc < MEM_SIZE; ++pc) {
+        if (counts[pc]) {
+            hits[n].count = counts[pc];
+            hits[n].blocks = blocks[pc];
+            hits[n].pc = (u16)pc;
+            ++n;
+        }
+    }
+    qsort(hits, n, sizeof(Hit), get_hit_order);
+    fprintf(flat,
+            "profile %u samples at %u Hz, %u dropped",
+            len,
+            profile->hz,
+            atomic_load(&profile->dropped));
+    for (u8 i = 0; i < TIER_COUNT; ++i) {
+        fprintf(flat, ", %s %u", TIER_NAMES[i], engines[i]);
+    }
+    fprintf(flat, "\n");
+    for (u32 i = 0; (i < n) && (i < FLAT_CAP); ++i) {
+        const u32 share = (u32)(((u64)hits[i].count * 10000) / len);
+        fprintf(flat,
+                "%3u.%02u%% %8u ",
+                share / 100,
+                share % 100,
+                hits[i].count);
+        do_print_location(profile, flat, hits[i].pc);
+        if (hits[i].blocks) {
+            fprintf(flat, " (%u in the block from here)", hits[i].blocks);
+        }
+        fprintf(flat, "\n");
+    }
+    qsort(profile->samples, len, sizeof(Sample), get_stack_order);
+    for (u32 i = 0; i < len;) {
+        u32 j = i + 1;
+        while ((j < len) &&
+               !get_stack_order(&profile->samples[i], &profile->samples[j]))
+        {
+            ++j;
+        }
+        const Sample* sample = &profile->samples[i];
+        do_print_location(profile, folded, PC_START);
+        for (u8 k = 0; k < sample->depth; ++k) {
+            fprintf(folded, ";");
+            do_print_location(profile, folded, sample->frames[k]);
+        }
+        fprintf(folded, " %u\n", j - i);
+        i = j;
+    }
+    free(hits);
+    free(blocks);
+    free(counts);
+    free(profile->samples);
+}
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include "tier.h"
+
+#include <errno.h>
+#include <sys/uio.h>
+
+typedef struct iovec IoVec;
+
+/* NOTE: Plain terminal runs hand the guest's output to a writer thread
+ * through `Ring`, so the guest only waits on a slow terminal or pipe once
+ * `RING_CAP` bytes are still waiting to be written. The guest is the one
+ * producer and the writer the one consumer: each owns one end of the ring
+ * and publishes it with a release store, so moving bytes takes no lock.
+ *
+ * Either side may go to sleep on `lock`, the writer when the ring is empty
+ * and the guest when it is full. Each raises its flag (`idle` or `full`)
+ * before looking at the other's end one last time, and the other looks at
+ * the flag after moving its end, so one of the two always sees the other.
+ * The writer is woken on a flush, which guests make after every trap that
+ * writes, and drains as much as it can with each `writev`. */
+#define RING_CAP (1 << 16)
+
+typedef struct {
+    u8     bytes[RING_CAP];
+    u64    head;
+    u64    tail;
+    i32    fd;
+    Bool   idle;
+    Bool   full;
+    Bool   quit;
+    Thread thread;
+    Mutex  lock;
+    Cond   ready;
+    Cond   space;
+    u64    writes;
+    u64    written;
+    u64    stalls;
+} Ring;
+
+static void do_write_ring(Ring* ring, u64 tail, u64 head) {
+    while (tail < head) {
+        const u64 at = tail & (RING_CAP - 1);
+        const u64 first =
+            (head - tail) < (RING_CAP - at) ? head - tail : RING_CAP - at;
+        IoVec vectors[2];
+        vectors[0].iov_base = &ring->bytes[at];
+        vectors[0].iov_len = first;
+        vectors[1].iov_base = ring->bytes;
+        vectors[1].iov_len = (head - tail) - first;
+        const ssize_t n =
+            writev(ring->fd, vectors, vectors[1].iov_len ? 2 : 1);
+        if ((n == -1) && (errno == EINTR)) {
+            continue;
+        }
+        /* NOTE: Output nobody can take is dropped, as `putc` would. */
+        tail = n < 0 ? head : tail + (u64)n;
+        ++ring->writes;
+        ring->written += n < 0 ? 0 : (u64)n;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->full, __ATOMIC_RELAXED)) {
+            pthread_mutex_lock(&ring->lock);
+            pthread_cond_signal(&ring->space);
+            pthread_mutex_unlock(&ring->lock);
+        }
+    }
+}
+
+static void* do_ring_work(void* data) {
+    Ring* ring = data;
+    for (;;) {
+        const u64 tail = ring->tail;
+        const u64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail < head) {
+            do_write_ring(ring, tail, head);
+            continue;
+        }
+        pthread_mutex_lock(&ring->lock);
+        __atomic_store_n(&ring->idle, TRUE, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        const Bool quit = ring->quit;
+        if ((__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) &&
+            !quit)
+        {
+            pthread_cond_wait(&ring->ready, &ring->lock);
+        }
+        __atomic_store_n(&ring->idle, FALSE, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&ring->lock);
+        if (quit && (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail))
+        {
+            return NULL;
+        }
+    }
+}
+
+static void do_wake_ring(Ring* ring) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->idle, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_signal(&ring->ready);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+static void do_wait_ring(Ring* ring) {
+    ++ring->stalls;
+    do_wake_ring(ring);
+    pthread_mutex_lock(&ring->lock);
+    __atomic_store_n(&ring->full, TRUE, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while ((ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) ==
+           RING_CAP)
+    {
+        pthread_cond_wait(&ring->space, &ring->lock);
+    }
+    __atomic_store_n(&ring->full, FALSE, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static void put_ring_char(Vm* vm, char x) {
+    Ring*     ring = vm->io_data;
+    const u64 head = ring->head;
+    if ((head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) == RING_CAP)
+    {
+        do_wait_ring(ring);
+    }
+    ring->bytes[head & (RING_CAP - 1)] = (u8)x;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void flush_ring(Vm* vm) {
+    do_wake_ring(vm->io_data);
+}
+
+static const Io IO_RING = {
+    get_stdio_char,
+    poll_stdio_char,
+    put_ring_char,
+    flush_ring,
+    get_host_clock,
+    wait_stdio_char,
+};
+
+static void do_start_ring(Ring* ring, Vm* vm, i32 fd) {
+    ring->fd = fd;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->ready, NULL);
+    pthread_cond_init(&ring->space, NULL);
+    if (pthread_create(&ring->thread, NULL, do_ring_work, ring)) {
+        exit(EXIT_FAILURE);
+    }
+    vm->io = &IO_RING;
+    vm->io_data = ring;
+}
+
+/* NOTE: Returns once everything the guest wrote has been written. */
+static void do_stop_ring(Ring* ring, Vm* vm) {
+    pthread_mutex_lock(&ring->lock);
+    ring->quit = TRUE;
+    pthread_cond_signal(&ring->ready);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(ring->thread, NULL);
+    pthread_cond_destroy(&ring->space);
+    pthread_cond_destroy(&ring->ready);
+    pthread_mutex_destroy(&ring->lock);
+    vm->io = &IO_STDIO;
+    vm->io_data = NULL;
+}
+
+static void do_print_ring_stats(const Ring* ring, File* file) {
+    fprintf(file,
+            "output writes %" PRIu64 ", bytes %" PRIu64 ", stalls %" PRIu64
+            "\n",
+            ring->writes,
+            ring->written,
+            ring->stalls);
+}
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef __SCREEN_H__
+#define __SCREEN_H__
+
+#include "vm.h"
+
+#include <inttypes.h>
+
+/* NOTE: Guest output is interpreted into a character grid instead of going
+ * straight to the terminal. Whenever the guest waits for input the grid is
+ * compared against what the terminal last showed, and only the cells that
+ * changed are written out. Without an output file the grid is kept
+ * headless, so the screen can be inspected with `do_print_screen`. Colors
+ * and other attributes are not tracked. */
+#define SCREEN_ROWS 24
+#define SCREEN_COLS 80
+#define PARAM_CAP   8
+
+/* NOTE: Unchanged runs shorter than this are rewritten rather than skipped,
+ * since moving the cursor costs more. */
+#define SPAN_GAP 6
+
+#define NO_CURSOR 0xFF
+
+typedef enum {
+    ANSI_TEXT = 0,
+    ANSI_ESCAPE,
+    ANSI_CSI,
+} AnsiState;
+
+typedef struct {
+    char      cells[SCREEN_ROWS][SCREEN_COLS];
+    char      shown[SCREEN_ROWS][SCREEN_COLS];
+    u16       params[PARAM_CAP];
+    u8        param_len;
+    AnsiState state;
+    u8        row;
+    u8        col;
+    u8        shown_row;
+    u8        shown_col;
+    Bool      changed;
+    Bool      fresh;
+    File*     output;
+    u64       bytes_in;
+    u64       bytes_out;
+    u64       frames;
+} Screen;
+
+static void set_screen(Screen* screen, File* output) {
+    memset(screen, 0, sizeof(Screen));
+    memset(screen->cells, ' ', sizeof(screen->cells));
+    memset(screen->shown, ' ', sizeof(screen->shown));
+    screen->shown_row = NO_CURSOR;
+    screen->fresh = TRUE;
+    screen->output = output;
+}
+
+static void do_line_feed(Screen* screen) {
+    if (screen->row < (SCREEN_ROWS - 1)) {
+        ++screen->row;
+        return;
+    }
+    memmove(screen->cells[0],
+            screen->cells[1],
+            (SCREEN_ROWS - 1) * SCREEN_COLS);
+    memset(screen->cells[SCREEN_ROWS - 1], ' ', SCREEN_COLS);
+}
+
+static void do_clear_cells(Screen* screen, u16 from, u16 to) {
+    for (u16 i = from; i < to; ++i) {
+        screen->cells[i / SCREEN_COLS][i % SCREEN_COLS] = ' ';
+    }
+}
+
+static u16 get_param(const Screen* screen, u8 i, u16 otherwise) {
+    return (i < screen->param_len) && screen->params[i] ? screen->params[i]
+                                                        : otherwise;
+}
+
+static u8 get_clamped(i32 x, u8 limit) {
+    return x < 0 ? 0 : limit <= x ? (u8)(limit - 1) : (u8)x;
+}
+
+static void do_csi(Screen* screen, char x) {
+    const u16 cursor =
+        (u16)((screen->row * SCREEN_COLS) +
+              (screen->col < SCREEN_COLS ? screen->col : SCREEN_COLS - 1));
+    const u16 line = (u16)(screen->row * SCREEN_COLS);
+    const i32 n = get_param(screen, 0, 1);
+    switch (x) {
+    case 'H':
+    case 'f': {
+        screen->row = get_clamped(n - 1, SCREEN_ROWS);
+        screen->col = get_clamped(get_param(screen, 1, 1) - 1, SCREEN_COLS);
+        break;
+    }
+    case 'A': {
+        screen->row = get_clamped(screen->row - n, SCREEN_ROWS);
+        break;
+    }
+    case 'B': {
+        screen->row = get_clamped(screen->row + n, SCREEN_ROWS);
+        break;
+    }
+    case 'C': {
+        screen->col = get_clamped(screen->col + n, SCREEN_COLS);
+        break;
+    }
+    case 'D': {
+        screen->col = get_clamped(screen->col - n, SCREEN_COLS);
+        break;
+    }
+    case 'J': {
+        /* NOTE: `3` only clears the scrollback, which the grid has none of.
+         */
+        switch (get_param(screen, 0, 0)) {
+        case 0: {
+            do_clear_cells(screen, cursor, SCREEN_ROWS * SCREEN_COLS);
+            break;
+        }
+        case 1: {
+            do_clear_cells(screen, 0, (u16)(cursor + 1));
+            break;
+        }
+        case 2: {
+            do_clear_cells(screen, 0, SCREEN_ROWS * SCREEN_COLS);
+            break;
+        }
+        default: {
+        }
+        }
+        break;
+    }
+    case 'K': {
+        switch (get_param(screen, 0, 0)) {
+        case 0: {
+            do_clear_cells(screen, cursor, (u16)(line + SCREEN_COLS));
+            break;
+        }
+        case 1: {
+            do_clear_cells(screen, line, (u16)(cursor + 1));
+            break;
+        }
+        default: {
+            do_clear_cells(screen, line, (u16)(line + SCREEN_COLS));
+        }
+        }
+        break;
+    }
+    default: {
+    }
+    }
+}
+
+static void do_put_text(Screen* screen, char x) {
+    switch (x) {
+    case '\x1B': {
+        screen->state = ANSI_ESCAPE;
+        break;
+    }
+    case '\n': {
+        screen->col = 0;
+        do_line_feed(screen);
+        break;
+    }
+    case '\r': {
+        screen->col = 0;
+        break;
+    }
+    case '\b': {
+        if (screen->col) {
+            --screen->col;
+        }
+        break;
+    }
+    case '\t': {
+        screen->col = get_clamped((screen->col + 8) & ~0x7, SCREEN_COLS);
+        break;
+    }
+    default: {
+        if ((u8)x < ' ') {
+            break;
+        }
+        /* NOTE: Like a terminal, wrap only once there is something to put
+         * past the last column. */
+        if (SCREEN_COLS <= screen->col) {
+            screen->col = 0;
+            do_line_feed(screen);
+        }
+        screen->cells[screen->row][screen->col++] = x;
+    }
+    }
+}
+
+static void put_screen_char(Vm* vm, char x) {
+    Screen* screen = vm->io_data;
+    ++screen->bytes_in;
+    screen->changed = TRUE;
+    switch (screen->state) {
+    case ANSI_TEXT: {
+        do_put_text(screen, x);
+        break;
+    }
+    case ANSI_ESCAPE: {
+        screen->param_len = 0;
+        screen->state = x == '[' ? ANSI_CSI : ANSI_TEXT;
+        break;
+    }
+    case ANSI_CSI: {
+        if (('0' <= x) && (x <= '9')) {
+            if (screen->param_len == 0) {
+                screen->params[screen->param_len++] = 0;
+            }
+            u16* param = &screen->params[screen->param_len - 1];
+            if (*param < 1000) {
+                *param = (u16)((*param * 10) + (x - '0'));
+            }
+        } else if (x == ';') {
+            if (screen->param_len == 0) {
+                screen->params[screen->param_len++] = 0;
+            }
+            if (screen->param_len < PARAM_CAP) {
+                screen->params[screen->param_len++] = 0;
+            }
+        } else if (('@' <= x) && (x <= '~')) {
+            do_csi(screen, x);
+            screen->state = ANSI_TEXT;
+        }
+        break;
+    }
+    }
+}
+
+static void do_emit(Screen* screen, const char* bytes, usize len) {
+    if (screen->output) {
+        fwrite(bytes, 1, len, screen->output);
+    }
+    screen->bytes_out += len;
+}
+
+static void do_emit_cursor(Screen* screen, u8 row, u8 col) {
+    if ((screen->shown_row == row) && (screen->shown_col == col)) {
+        return;
+    }
+    char      bytes[16];
+    const i32 len = snprintf(bytes,
+                             sizeof(bytes),
+                             "\x1B[%u;%uH",
+                             (u32)row + 1,
+                             (u32)col + 1);
+    do_emit(screen, bytes, (usize)len);
+    screen->shown_row = row;
+    screen->shown_col = col;
+}
+
+/* NOTE: Ends a frame, bringing the terminal up to date with the grid. */
+static void do_present_screen(Screen* screen) {
+    if (!screen->changed) {
+        return;
+    }
+    screen->changed = FALSE;
+    ++screen->frames;
+    if (screen->fresh) {
+        do_emit(screen, "\x1B[2J", 4);
+        screen->fresh = FALSE;
+    }
+    for (u8 row = 0; row < SCREEN_ROWS; ++row) {
+        const char* cells = screen->cells[row];
+        char*       shown = screen->shown[row];
+        for (u8 col = 0; col < SCREEN_COLS; ++col) {
+            if (cells[col] == shown[col]) {
+                continue;
+            }
+            u8 last = col;
+            for (u8 i = (u8)(col + 1);
+                 (i < SCREEN_COLS) && ((i - last) <= SPAN_GAP);
+                 ++i)
+            {
+                if (cells[i] != shown[i]) {
+                    last = i;
+                }
+            }
+            const u8 len = (u8)(last - col + 1);
+            do_emit_cursor(screen, row, col);
+            do_emit(screen, &cells[col], len);
+            memcpy(&shown[col], &cells[col], len);
+            /* NOTE: Where the cursor ends up after the last column depends
+             * on the terminal. */
+            screen->shown_col = (u8)(last + 1);
+            if (SCREEN_COLS <= screen->shown_col) {
+                screen->shown_row = NO_CURSOR;
+            }
+            col = last;
+        }
+    }
+    do_emit_cursor(
+        screen,
+        screen->row,
+        screen->col < SCREEN_COLS ? screen->col : SCREEN_COLS - 1);
+    if (screen->output) {
+        fflush(screen->output);
+    }
+}
+
+static i32 get_screen_char(Vm* vm) {
+    do_present_screen(vm->io_data);
+    return get_stdio_char(vm);
+}
+
+static Bool poll_screen_char(Vm* vm) {
+    do_present_screen(vm->io_data);
+    return poll_stdio_char(vm);
+}
+
+/* NOTE: Guests flush after every trap, so a flush does not end a frame;
+ * only waiting for input or an explicit `do_present_screen` does. */
+static void flush_screen(Vm* vm) {
+}
+
+static Bool wait_screen_char(Vm* vm, u64 deadline) {
+    do_present_screen(vm->io_data);
+    return wait_stdio_char(vm, deadline);
+}
+
+static const Io IO_SCREEN = {
+    get_screen_char,
+    poll_screen_char,
+    put_screen_char,
+    flush_screen,
+    get_host_clock,
+    wait_screen_char,
+};
+
+/* NOTE: Writes the grid as plain text, without trailing blanks. */
+static void do_print_screen(const Screen* screen, File* file) {
+    for (u8 row = 0; row < SCREEN_ROWS; ++row) {
+        i32 len = SCREEN_COLS;
+        while (len && (screen->cells[row][len - 1] == ' ')) {
+            --len;
+        }
+        fprintf(file, "%.*s\n", len, screen->cells[row]);
+    }
+}
+
+static void do_print_screen_stats(const Screen* screen, File* file) {
+    fprintf(file,
+            "screen frames %" PRIu64 ", bytes in %" PRIu64
+            ", bytes out %" PRIu64 "\n",
+            screen->frames,
+            screen->bytes_in,
+            screen->bytes_out);
+}
+
+#endif
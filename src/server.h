@@ -0,0 +1,376 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include "arena.h"
+#include "tier.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef struct epoll_event EpollEvent;
+typedef struct sockaddr    SockAddr;
+typedef struct sockaddr_un SockAddrUn;
+typedef struct pollfd      PollFd;
+typedef pthread_attr_t     ThreadAttr;
+typedef cpu_set_t          CpuSet;
+
+/* NOTE: Requests and responses are host-endian; the socket is local. */
+typedef struct {
+    u32 image_id;
+    u32 input_len;
+    u64 budget;
+    u64 timeout_ms;
+} Request;
+
+/* NOTE: New statuses go at the end, so existing clients keep reading the
+ * old ones as they were. */
+typedef enum {
+    JOB_HALTED = 0,  // ran `HALT`
+    JOB_EXHAUSTED,   // ran out of `budget`
+    JOB_EXPIRED,     // ran past `timeout_ms`
+    JOB_BAD_REQUEST, // named an image the server does not have
+    JOB_STOPPED,     // ran a reserved opcode (`OP_RES`)
+    JOB_FAULTED,     // stored to a page it may not change
+    JOB_BLOCKED,     // waited on input the request did not carry
+} JobStatus;
+
+typedef struct {
+    u32 status;
+    u32 output_len;
+    u64 instr_count;
+} Response;
+
+#define INPUT_CAP (1 << 24)
+
+typedef struct Connection Connection;
+
+struct Connection {
+    Request     request;
+    u8*         input;
+    usize       received;
+    Connection* next;
+    i32         fd;
+};
+
+typedef struct {
+    const Image* images;
+    u32          image_count;
+    i32          epoll_fd;
+    Mutex        lock;
+    Cond         ready;
+    Connection*  head;
+    Connection*  tail;
+} Server;
+
+static i32 get_listen_fd(const char* path, i32 flags) {
+    const i32  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
+    SockAddrUn address = {0};
+    address.sun_family = AF_UNIX;
+    if ((fd == -1) || (sizeof(address.sun_path) <= strlen(path))) {
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+    if ((bind(fd, (SockAddr*)&address, sizeof(address)) == -1) ||
+        (listen(fd, SOMAXCONN) == -1))
+    {
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+static void do_close_connection(Connection* connection) {
+    close(connection->fd);
+    free(connection->input);
+    free(connection);
+}
+
+static void do_wait_connection(Server* server, Connection* connection) {
+    EpollEvent event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = connection;
+    if (epoll_ctl(server->epoll_fd,
+                  EPOLL_CTL_MOD,
+                  connection->fd,
+                  &event) == -1)
+    {
+        do_close_connection(connection);
+    }
+}
+
+static void do_push_job(Server* server, Connection* connection) {
+    pthread_mutex_lock(&server->lock);
+    connection->next = NULL;
+    if (server->tail) {
+        server->tail->next = connection;
+    } else {
+        server->head = connection;
+    }
+    server->tail = connection;
+    pthread_cond_signal(&server->ready);
+    pthread_mutex_unlock(&server->lock);
+}
+
+static Connection* pop_job(Server* server) {
+    pthread_mutex_lock(&server->lock);
+    while (server->head == NULL) {
+        pthread_cond_wait(&server->ready, &server->lock);
+    }
+    Connection* connection = server->head;
+    server->head = connection->next;
+    if (server->head == NULL) {
+        server->tail = NULL;
+    }
+    pthread_mutex_unlock(&server->lock);
+    return connection;
+}
+
+static Bool do_send_all(i32 fd, const u8* bytes, usize len) {
+    while (len) {
+        const ssize_t n = send(fd, bytes, len, MSG_NOSIGNAL);
+        if (0 < n) {
+            bytes += n;
+            len -= (usize)n;
+        } else if ((n == -1) && ((errno == EAGAIN) || (errno == EINTR))) {
+            PollFd poll_fd;
+            poll_fd.fd = fd;
+            poll_fd.events = POLLOUT;
+            poll(&poll_fd, 1, -1);
+        } else {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* NOTE: Reads as much of the pending request as the socket has. Returns
+ * `FALSE` once the connection should be dropped. */
+static Bool do_read_connection(Server* server, Connection* connection) {
+    for (;;) {
+        u8*   destination;
+        usize remaining;
+        if (connection->received < sizeof(Request)) {
+            destination = (u8*)&connection->request + connection->received;
+            remaining = sizeof(Request) - connection->received;
+        } else {
+            const usize offset = connection->received - sizeof(Request);
+            if (offset == 0) {
+                if (INPUT_CAP < connection->request.input_len) {
+                    return FALSE;
+                }
+                if (connection->input == NULL) {
+                    connection->input =
+                        malloc(connection->request.input_len + 1);
+                    if (connection->input == NULL) {
+                        return FALSE;
+                    }
+                }
+            }
+            if (offset == connection->request.input_len) {
+                do_push_job(server, connection);
+                return TRUE;
+            }
+            destination = connection->input + offset;
+            remaining = connection->request.input_len - offset;
+        }
+        const ssize_t n = recv(connection->fd, destination, remaining, 0);
+        if (0 < n) {
+            connection->received += (usize)n;
+        } else if ((n == -1) && (errno == EINTR)) {
+            continue;
+        } else if ((n == -1) && (errno == EAGAIN)) {
+            do_wait_connection(server, connection);
+            return TRUE;
+        } else {
+            return FALSE;
+        }
+    }
+}
+
+static JobStatus get_job_status(Status status) {
+    switch (status) {
+    case DEAD: {
+        return JOB_HALTED;
+    }
+    case EXHAUSTED: {
+        return JOB_EXHAUSTED;
+    }
+    case EXPIRED: {
+        return JOB_EXPIRED;
+    }
+    case FAULTED: {
+        return JOB_FAULTED;
+    }
+    case BLOCKED: {
+        return JOB_BLOCKED;
+    }
+    case STOPPED:
+    case ALIVE:
+    case INTERRUPTED:
+    default: {
+        return JOB_STOPPED;
+    }
+    }
+}
+
+static Response do_job(const Server* server,
+                       Vm*           vm,
+                       Tier*         tier,
+                       Buffers*      buffers,
+                       Connection*   connection) {
+    Response response = {0};
+    buffers->output_len = 0;
+    if (server->image_count <= connection->request.image_id) {
+        response.status = JOB_BAD_REQUEST;
+    } else {
+        const Image* image = &server->images[connection->request.image_id];
+        if (vm->image == image) {
+            do_reset_vm(vm);
+        } else {
+            set_vm(vm, image);
+        }
+        buffers->input = connection->input;
+        buffers->input_len = connection->request.input_len;
+        buffers->input_index = 0;
+        const u64 timeout_ms = connection->request.timeout_ms;
+        response.instr_count = run_tiered(vm,
+                                          tier,
+                                          connection->request.budget,
+                                          get_deadline(timeout_ms));
+        response.status = get_job_status(vm->status);
+        response.output_len = (u32)buffers->output_len;
+    }
+    free(connection->input);
+    connection->input = NULL;
+    connection->received = 0;
+    return response;
+}
+
+static void* do_work(void* data) {
+    Server* server = data;
+    Vm*     vm = get_vm();
+    Buffers buffers = {0};
+    /* NOTE: Each worker keeps its blocks across jobs, so a worker serving
+     * the same image again starts where the last job left off. */
+    Tier* tier = calloc(1, sizeof(Tier));
+    if (tier == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    vm->io = &IO_BUFFERS;
+    vm->io_data = &buffers;
+    for (;;) {
+        Connection* connection = pop_job(server);
+        const Response response =
+            do_job(server, vm, tier, &buffers, connection);
+        if (do_send_all(connection->fd,
+                        (const u8*)&response,
+                        sizeof(Response)) &&
+            do_send_all(connection->fd, buffers.output, buffers.output_len))
+        {
+            do_wait_connection(server, connection);
+        } else {
+            do_close_connection(connection);
+        }
+    }
+    return NULL;
+}
+
+/* NOTE: A worker that cannot be pinned to `cpus` runs unpinned instead. */
+static void do_start_worker(Server* server, const CpuSet* cpus) {
+    ThreadAttr attributes;
+    pthread_attr_init(&attributes);
+    Thread thread;
+    if ((cpus == NULL) ||
+        pthread_attr_setaffinity_np(&attributes, sizeof(CpuSet), cpus) ||
+        pthread_create(&thread, &attributes, do_work, server))
+    {
+        if (pthread_create(&thread, NULL, do_work, server)) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_attr_destroy(&attributes);
+    pthread_detach(thread);
+}
+
+static void do_accept(Server* server, i32 listen_fd) {
+    for (;;) {
+        const i32 fd =
+            accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            return;
+        }
+        Connection* connection = calloc(1, sizeof(Connection));
+        if (connection == NULL) {
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        EpollEvent event;
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.ptr = connection;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            do_close_connection(connection);
+        }
+    }
+}
+
+static void do_serve(const char* path, const char** image_paths, u32 n) {
+    Server server = {0};
+    Image* images = calloc(n, sizeof(Image));
+    if (images == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    for (u32 i = 0; i < n; ++i) {
+        set_image(&images[i], image_paths[i]);
+    }
+    server.images = images;
+    server.image_count = n;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+    const i32 listen_fd = get_listen_fd(path, SOCK_NONBLOCK);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    EpollEvent event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if ((server.epoll_fd == -1) ||
+        (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1))
+    {
+        exit(EXIT_FAILURE);
+    }
+    /* NOTE: Workers are pinned one per CPU the server may run on, so the VM
+     * each one takes from the arena stays on its NUMA node. */
+    CpuSet allowed;
+    if (sched_getaffinity(0, sizeof(CpuSet), &allowed) == -1) {
+        const long workers = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long i = 0; i < (workers < 1 ? 1 : workers); ++i) {
+            do_start_worker(&server, NULL);
+        }
+    } else {
+        for (usize i = 0; i < CPU_SETSIZE; ++i) {
+            if (CPU_ISSET(i, &allowed)) {
+                CpuSet cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(i, &cpus);
+                do_start_worker(&server, &cpus);
+            }
+        }
+    }
+    EpollEvent events[64];
+    for (;;) {
+        const i32 n_events = epoll_wait(server.epoll_fd, events, 64, -1);
+        for (i32 i = 0; i < n_events; ++i) {
+            Connection* connection = events[i].data.ptr;
+            if (connection == NULL) {
+                do_accept(&server, listen_fd);
+            } else if (!do_read_connection(&server, connection)) {
+                do_close_connection(connection);
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,460 @@
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#include "server.h"
+
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+typedef struct itimerspec TimerSpec;
+
+/* NOTE: `--sessions` runs an interactive guest for every connection to a
+ * socket, many of them over a few host threads. Each session reads the
+ * connection as its keyboard and writes its output back to it, so the
+ * client's own terminal does what `disable_input_buffering` does for
+ * `main` (e.g. `socat -,raw,echo=0 UNIX-CONNECT:<path>`).
+ *
+ * Workers take sessions off `ready` and run each for up to `SESSION_SLICE`
+ * instructions before putting it back. A guest that asks for input that
+ * has not arrived is blocked instead: `TRAP_GETC` and `TRAP_IN` are put
+ * back to run again, and so is `TRAP_SLEEP` until its deadline, while a
+ * guest polling `KEYBOARD_STATUS` is stopped after `SESSION_SPINS` empty
+ * polls in a row. A blocked session goes back to the main thread, which
+ * waits on its connection, and on a timer for its deadline, with `epoll`,
+ * and puts the session back on `ready` once either fires. A session left
+ * waiting on input for `SESSION_IDLE_MS` has its memory packed.
+ *
+ * Output is sent without waiting, and whatever the connection does not
+ * take is kept. A session with `SESSION_OUTPUT_CAP` bytes still to send is
+ * parked as well, and the main thread sends the rest as the connection
+ * takes it; the guest does not run again until less than that is left, so
+ * a client that stops reading holds its own session and no worker.
+ *
+ * Only the main thread arms, wakes, packs and frees sessions, so a session
+ * is either waiting there or in a worker's hands, never both. Sessions run
+ * in the interpreter: a tier apiece would cost megabytes, and a shared one
+ * would start over on every switch. */
+#define SESSION_SLICE      (1 << 16)
+#define SESSION_SPINS      (1 << 10)
+#define SESSION_IDLE_MS    5000
+#define SESSION_INPUT_CAP  (1 << 12)
+#define SESSION_OUTPUT_CAP (1 << 16)
+#define SESSION_EVENTS     64
+
+typedef struct Session Session;
+
+/* NOTE: `buffers` comes first so the `IO_BUFFERS` functions can take a
+ * session as their `io_data`. */
+struct Session {
+    Buffers  buffers;
+    u8       input[SESSION_INPUT_CAP];
+    Vm*      vm;
+    Session* next;
+    u64      deadline;
+    u32      spins;
+    i32      fd;
+    i32      timer_fd;
+    Bool     waiting;
+    Bool     blocked;
+    Bool     hung_up;
+    Bool     done;
+};
+
+typedef struct {
+    const Image* image;
+    i32          epoll_fd;
+    i32          wake_fd;
+    Mutex        lock;
+    Cond         ready;
+    Session*     head;
+    Session*     tail;
+    Session*     parked;
+} Scheduler;
+
+static Bool poll_session_char(Vm* vm) {
+    Session* session = vm->io_data;
+    if (poll_buffers_char(vm)) {
+        session->spins = 0;
+        return TRUE;
+    }
+    if (SESSION_SPINS <= ++session->spins) {
+        vm->status = BLOCKED;
+    }
+    return FALSE;
+}
+
+static Bool wait_session_char(Vm* vm, u64 deadline) {
+    Session* session = vm->io_data;
+    if (poll_buffers_char(vm)) {
+        return TRUE;
+    }
+    session->deadline = deadline;
+    vm->status = BLOCKED;
+    --vm->reg[R_PC];
+    return FALSE;
+}
+
+static const Io IO_SESSION = {
+    get_buffers_char,
+    poll_session_char,
+    put_buffers_char,
+    flush_buffers,
+    get_host_clock,
+    wait_session_char,
+};
+
+static void do_push_session(Scheduler* scheduler, Session* session) {
+    pthread_mutex_lock(&scheduler->lock);
+    session->next = NULL;
+    if (scheduler->tail) {
+        scheduler->tail->next = session;
+    } else {
+        scheduler->head = session;
+    }
+    scheduler->tail = session;
+    pthread_cond_signal(&scheduler->ready);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+static Session* pop_session(Scheduler* scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    while (scheduler->head == NULL) {
+        pthread_cond_wait(&scheduler->ready, &scheduler->lock);
+    }
+    Session* session = scheduler->head;
+    scheduler->head = session->next;
+    if (scheduler->head == NULL) {
+        scheduler->tail = NULL;
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return session;
+}
+
+/* NOTE: Hands a session that cannot run on back to the main thread. */
+static void do_park_session(Scheduler* scheduler, Session* session) {
+    pthread_mutex_lock(&scheduler->lock);
+    session->next = scheduler->parked;
+    scheduler->parked = session;
+    pthread_mutex_unlock(&scheduler->lock);
+    const u64 one = 1;
+    if (write(scheduler->wake_fd, &one, sizeof(one)) == -1) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* NOTE: Sends as much output as the connection takes without waiting, and
+ * keeps the rest. Returns `FALSE` once the client has gone, and drops what
+ * was left. */
+static Bool do_send_session(Session* session) {
+    Buffers* buffers = &session->buffers;
+    usize    sent = 0;
+    while (sent < buffers->output_len) {
+        const ssize_t n = send(session->fd,
+                               &buffers->output[sent],
+                               buffers->output_len - sent,
+                               MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (0 < n) {
+            sent += (usize)n;
+        } else if ((n == -1) && (errno == EINTR)) {
+            continue;
+        } else if ((n == -1) && (errno == EAGAIN)) {
+            break;
+        } else {
+            buffers->output_len = 0;
+            return FALSE;
+        }
+    }
+    memmove(buffers->output,
+            &buffers->output[sent],
+            buffers->output_len - sent);
+    buffers->output_len -= sent;
+    return TRUE;
+}
+
+static void* do_session_work(void* data) {
+    Scheduler* scheduler = data;
+    for (;;) {
+        Session* session = pop_session(scheduler);
+        Vm*      vm = session->vm;
+        vm->status = ALIVE;
+        session->spins = 0;
+        session->deadline = 0;
+        run_vm(vm, SESSION_SLICE, 0);
+        if (!do_send_session(session)) {
+            vm->status = DEAD;
+        }
+        if ((vm->status == EXHAUSTED) &&
+            (session->buffers.output_len < SESSION_OUTPUT_CAP))
+        {
+            do_push_session(scheduler, session);
+        } else {
+            session->blocked = vm->status == BLOCKED;
+            session->done =
+                (vm->status != BLOCKED) && (vm->status != EXHAUSTED);
+            do_park_session(scheduler, session);
+        }
+    }
+    return NULL;
+}
+
+static void do_set_timer(Session* session, u64 at_ms) {
+    TimerSpec timer = {0};
+    timer.it_value.tv_sec = (time_t)(at_ms / 1000);
+    timer.it_value.tv_nsec = (long)((at_ms % 1000) * MILLISECOND_NS);
+    timerfd_settime(session->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+/* NOTE: A blocked session waits for input and its timer, and one with
+ * output left waits for the connection to take it. A session in a worker's
+ * hands waits on nothing. */
+static void do_watch_session(const Scheduler* scheduler, Session* session) {
+    const u32  input = session->waiting && session->blocked ? EPOLLIN : 0;
+    const u32  output =
+        session->waiting && session->buffers.output_len ? EPOLLOUT : 0;
+    EpollEvent event;
+    event.events = input | output | EPOLLONESHOT;
+    event.data.ptr = session;
+    epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_MOD, session->fd, &event);
+    /* NOTE: Sessions are at least 2-byte aligned, which leaves the low bit
+     * of the pointer to tell the timer from the connection. */
+    event.events = input | EPOLLONESHOT;
+    event.data.u64 = (u64)(usize)session | 1;
+    epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_MOD, session->timer_fd, &event);
+}
+
+static void do_wait_session(const Scheduler* scheduler, Session* session) {
+    if (session->blocked) {
+        do_set_timer(session,
+                     session->deadline
+                         ? session->deadline
+                         : get_host_clock(session->vm, CLOCK_MS) +
+                               SESSION_IDLE_MS);
+    }
+    session->waiting = TRUE;
+    do_watch_session(scheduler, session);
+}
+
+static void do_wake_session(Scheduler* scheduler, Session* session) {
+    session->waiting = FALSE;
+    do_set_timer(session, 0);
+    do_watch_session(scheduler, session);
+    do_push_session(scheduler, session);
+}
+
+/* NOTE: Runs a waiting session again once it is neither blocked nor held
+ * back by its output, and otherwise goes on waiting for what it needs. */
+static void do_settle_session(Scheduler* scheduler, Session* session) {
+    if (!session->blocked && !session->done &&
+        (session->buffers.output_len < SESSION_OUTPUT_CAP))
+    {
+        do_wake_session(scheduler, session);
+    } else {
+        do_watch_session(scheduler, session);
+    }
+}
+
+/* NOTE: Takes whatever the connection has. Returns `FALSE` once the client
+ * has gone, though the guest may still have its last input to read. */
+static Bool do_read_session(Session* session) {
+    Buffers* buffers = &session->buffers;
+    memmove(session->input,
+            &session->input[buffers->input_index],
+            buffers->input_len - buffers->input_index);
+    buffers->input_len -= buffers->input_index;
+    buffers->input_index = 0;
+    while (buffers->input_len < SESSION_INPUT_CAP) {
+        const ssize_t n = recv(session->fd,
+                               &session->input[buffers->input_len],
+                               SESSION_INPUT_CAP - buffers->input_len,
+                               0);
+        if (0 < n) {
+            buffers->input_len += (usize)n;
+        } else if ((n == -1) && (errno == EINTR)) {
+            continue;
+        } else {
+            return (n == -1) && (errno == EAGAIN);
+        }
+    }
+    return TRUE;
+}
+
+/* NOTE: A client that has gone is kept until the guest has read what the
+ * client sent before going, so `printf ... | socat` still sees the output,
+ * and until that output is sent. */
+static Bool get_session_done(const Session* session) {
+    return (session->done ||
+            (session->hung_up && (session->buffers.input_len <=
+                                  session->buffers.input_index))) &&
+           !session->buffers.output_len;
+}
+
+static void do_close_session(Session* session) {
+    close(session->timer_fd);
+    close(session->fd);
+    do_free_vm(session->vm);
+    free(session->buffers.output);
+    free(session);
+}
+
+/* NOTE: A session is on `parked` before the count goes up, so once the
+ * count is cleared every session it counted has been taken. */
+static Session* get_parked(Scheduler* scheduler) {
+    u64 count;
+    if (read(scheduler->wake_fd, &count, sizeof(count)) != sizeof(count)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&scheduler->lock);
+    Session* parked = scheduler->parked;
+    scheduler->parked = NULL;
+    pthread_mutex_unlock(&scheduler->lock);
+    return parked;
+}
+
+static void do_accept_sessions(Scheduler* scheduler, i32 listen_fd) {
+    for (;;) {
+        const i32 fd =
+            accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            return;
+        }
+        Session* session = calloc(1, sizeof(Session));
+        if (session == NULL) {
+            close(fd);
+            continue;
+        }
+        session->fd = fd;
+        session->timer_fd =
+            timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        session->buffers.input = session->input;
+        session->vm = get_vm();
+        set_vm(session->vm, scheduler->image);
+        session->vm->io = &IO_SESSION;
+        session->vm->io_data = session;
+        session->vm->trap = handle_buffers_trap;
+        EpollEvent event;
+        event.events = EPOLLONESHOT;
+        event.data.ptr = session;
+        if ((session->timer_fd == -1) ||
+            (epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_ADD, fd, &event) ==
+             -1) ||
+            (epoll_ctl(scheduler->epoll_fd,
+                       EPOLL_CTL_ADD,
+                       session->timer_fd,
+                       &event) == -1))
+        {
+            do_close_session(session);
+            continue;
+        }
+        do_push_session(scheduler, session);
+    }
+}
+
+/* NOTE: Sessions are closed after the rest of the batch of events, which
+ * may still name them. */
+static void do_run_sessions(const char* path, const char* image_path) {
+    Scheduler scheduler = {0};
+    Image*    image = calloc(1, sizeof(Image));
+    if (image == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    set_image(image, image_path);
+    scheduler.image = image;
+    pthread_mutex_init(&scheduler.lock, NULL);
+    pthread_cond_init(&scheduler.ready, NULL);
+    const i32 listen_fd = get_listen_fd(path, SOCK_NONBLOCK);
+    scheduler.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    scheduler.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    EpollEvent event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if ((scheduler.epoll_fd == -1) || (scheduler.wake_fd == -1) ||
+        (epoll_ctl(scheduler.epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) ==
+         -1))
+    {
+        exit(EXIT_FAILURE);
+    }
+    event.data.ptr = &scheduler;
+    if (epoll_ctl(scheduler.epoll_fd,
+                  EPOLL_CTL_ADD,
+                  scheduler.wake_fd,
+                  &event) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+    const long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long i = 0; i < (workers < 1 ? 1 : workers); ++i) {
+        Thread thread;
+        if (pthread_create(&thread, NULL, do_session_work, &scheduler)) {
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+    EpollEvent events[SESSION_EVENTS];
+    for (;;) {
+        const i32 n_events =
+            epoll_wait(scheduler.epoll_fd, events, SESSION_EVENTS, -1);
+        Session* closed = NULL;
+        for (i32 i = 0; i < n_events; ++i) {
+            const u64 data = events[i].data.u64;
+            Session*  session = (Session*)(usize)(data & ~(u64)1);
+            if (events[i].data.ptr == NULL) {
+                do_accept_sessions(&scheduler, listen_fd);
+            } else if (events[i].data.ptr == &scheduler) {
+                Session* parked = get_parked(&scheduler);
+                while (parked) {
+                    Session* next = parked->next;
+                    if (get_session_done(parked)) {
+                        parked->next = closed;
+                        closed = parked;
+                    } else {
+                        do_wait_session(&scheduler, parked);
+                    }
+                    parked = next;
+                }
+            } else if (!session->waiting) {
+                continue;
+            } else if (!(data & 1)) {
+                const u32 ready = events[i].events;
+                if (session->buffers.output_len &&
+                    (ready & (EPOLLOUT | EPOLLERR | EPOLLHUP)) &&
+                    !do_send_session(session))
+                {
+                    session->done = TRUE;
+                }
+                if (session->blocked &&
+                    (ready & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                {
+                    session->hung_up = !do_read_session(session);
+                    session->blocked = FALSE;
+                }
+                if (get_session_done(session)) {
+                    session->waiting = FALSE;
+                    session->next = closed;
+                    closed = session;
+                } else {
+                    do_settle_session(&scheduler, session);
+                }
+            } else {
+                /* NOTE: A timer read early wakes the guest early, which
+                 * only costs it another look at the clock. */
+                u64           count;
+                const ssize_t n =
+                    read(session->timer_fd, &count, sizeof(count));
+                if (session->deadline || (n != sizeof(count))) {
+                    session->blocked = FALSE;
+                    do_settle_session(&scheduler, session);
+                } else {
+                    usize released;
+                    do_pack_vm(session->vm, &released);
+                }
+            }
+        }
+        while (closed) {
+            Session* next = closed->next;
+            do_close_session(closed);
+            closed = next;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,1108 @@
+#ifndef __TIER_H__
+#define __TIER_H__
+
+#include "ir.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <x86intrin.h>
+
+typedef pthread_t       Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t  Cond;
+
+/* NOTE: Every image starts in the `do_bin_instr` interpreter (tier 0), which
+ * counts how often it enters each block, i.e. each branch target or the
+ * instruction after a trap. Blocks that reach `HOT_THRESHOLD` are decoded
+ * once into pre-decoded instructions (tier 1), with addresses, immediates
+ * and targets worked out ahead of time. Switching happens between blocks, so
+ * a running guest moves up a tier the next time it reaches a hot block, and a
+ * short job never pays for decoding code it only runs a few times. Blocks
+ * that then run `IR_THRESHOLD` times in tier 1 have their bodies lifted
+ * into optimized IR (tier 2, see `ir.h`), leaving only their last
+ * instruction to the tier 1 handler.
+ *
+ * With `do_start_compiler`, decoding and lifting move to a thread of their
+ * own: hot blocks are queued for it and the guest carries on in the
+ * interpreter until they are ready. Finished blocks are published into
+ * `blocks` with a single atomic store, and are checked against memory and
+ * linked in by the running thread the first time it reaches them (see
+ * `do_install_block`), so a block decoded from words that have changed
+ * since is simply thrown away. Attaching a VM also starts decoding ahead of
+ * the guest, from `R_PC` through every branch target it can reach. */
+#define HOT_BITS      12
+#define HOT_SIZE      (1 << HOT_BITS)
+#define HOT_THRESHOLD 48
+#define IR_THRESHOLD  256
+
+#define BLOCK_CAP  64
+#define BLOCK_POOL (1 << 12)
+#define CODE_CAP   (1 << 15)
+
+#define IR_CODE_CAP (1 << 16)
+#define IR_EXIT_CAP (1 << 14)
+
+#define JOB_CAP       256
+#define SPECULATE_CAP 256
+
+/* NOTE: The generation of a block that has been published but not yet
+ * installed. */
+#define BLOCK_PENDING 0xFFFFFFFFu
+
+/* NOTE: `OP_BR`, `OP_JSR`, `OP_RTI`, `OP_JMP`, `OP_RES` and `OP_TRAP` end a
+ * block. */
+#define CONTROL_OPS                                                      \
+    ((1 << OP_BR) | (1 << OP_JSR) | (1 << 8) | (1 << OP_JMP) |           \
+     (1 << OP_RES) | (1 << OP_TRAP))
+
+/* NOTE: `TIER_IR` counts the part of a lifted block that runs in `run_ir`,
+ * and `TIER_DECODED` what is left of it along with blocks that are not
+ * lifted. `TIER_TRANSLATE` only accumulates the time spent decoding and
+ * lifting blocks. */
+typedef enum {
+    TIER_INTERPRET = 0,
+    TIER_DECODED,
+    TIER_IR,
+    TIER_TRANSLATE,
+    TIER_COUNT,
+} TierKind;
+
+static const char* const TIER_NAMES[TIER_COUNT] = {
+    "interpret",
+    "decoded",
+    "ir",
+    "translate",
+};
+
+typedef struct Decoded Decoded;
+
+/* NOTE: Handlers return the next instruction of the block, or `NULL` once
+ * `R_PC` has been set and control leaves the block. */
+typedef const Decoded* (*Handler)(Vm*, const Decoded*);
+
+struct Decoded {
+    Handler fn;
+    u16     pc;
+    u16     instr;
+    u16     value;
+    u8      r0;
+    u8      r1;
+    u8      r2;
+};
+
+typedef struct Block Block;
+
+/* NOTE: A block never crosses a page, so it can be checked against a single
+ * write generation. */
+struct Block {
+    const Decoded* code;
+    const IrBlock* ir;
+    Block*         next;
+    u32            generation;
+    u32            runs;
+    u16            start;
+    u16            len;
+    u8             page;
+};
+
+typedef enum {
+    JOB_PROMOTE = 0,
+    JOB_SPECULATE,
+    JOB_LIFT,
+} JobKind;
+
+typedef struct {
+    Block*  block;
+    u16     start;
+    JobKind kind;
+} Job;
+
+/* NOTE: With a compiler thread, it alone fills the pools, and the running
+ * thread only empties them once it has paused the compiler. Everything
+ * from `vm` to `compile_cycles` is guarded by `lock`. */
+typedef struct {
+    Block*    blocks[MEM_SIZE];
+    Block*    page_blocks[PAGE_COUNT];
+    u64       code_words[MEM_SIZE / 64];
+    u8        hotness[HOT_SIZE];
+    Block     block_pool[BLOCK_POOL];
+    Decoded   code[CODE_CAP];
+    IrBlock   ir_pool[BLOCK_POOL];
+    IrInstr   ir_code[IR_CODE_CAP];
+    IrExit    ir_exits[IR_EXIT_CAP];
+    IrBuilder builder;
+    Block*    lift;
+    u32       block_len;
+    u32       code_len;
+    u32       ir_len;
+    u32       ir_code_len;
+    u32       ir_exit_len;
+    u64       instrs[TIER_COUNT];
+    u64       cycles[TIER_COUNT];
+    u64       promotions;
+    u64       invalidations;
+    u64       flushes;
+    u64       installs;
+    u64       rejects;
+    Thread    thread;
+    Mutex     lock;
+    Cond      ready;
+    Cond      idle;
+    Vm*       vm;
+    Job       jobs[JOB_CAP];
+    u32       job_head;
+    u32       job_len;
+    u16       spec[SPECULATE_CAP];
+    u32       spec_len;
+    u32       speculated;
+    Bool      busy;
+    Bool      quit;
+    u64       jobs_run;
+    u64       jobs_dropped;
+    u64       compile_cycles;
+    Bool      full;
+    Bool      background;
+} Tier;
+
+static Bool get_control(u16 instr) {
+    return (CONTROL_OPS >> get_op(instr)) & 0x1;
+}
+
+static const Decoded* get_next(Vm* vm, const Decoded* decoded) {
+    if ((vm->status == ALIVE) && !vm->stale) {
+        return decoded + 1;
+    }
+    vm->reg[R_PC] = (u16)(decoded->pc + 1);
+    return NULL;
+}
+
+static const Decoded* do_decoded_add(Vm* vm, const Decoded* decoded) {
+    vm->reg[decoded->r0] =
+        (u16)(vm->reg[decoded->r1] + vm->reg[decoded->r2]);
+    set_flags(vm, decoded->r0);
+    return decoded + 1;
+}
+
+static const Decoded* do_decoded_add_immediate(Vm*            vm,
+                                               const Decoded* decoded) {
+    vm->reg[decoded->r0] = (u16)(vm->reg[decoded->r1] + decoded->value);
+    set_flags(vm, decoded->r0);
+    return decoded + 1;
+}
+
+static const Decoded* do_decoded_and(Vm* vm, const Decoded* decoded) {
+    vm->reg[decoded->r0] =
+        (u16)(vm->reg[decoded->r1] & vm->reg[decoded->r2]);
+    set_flags(vm, decoded->r0);
+    return decoded + 1;
+}
+
+static const Decoded* do_decoded_and_immediate(Vm*            vm,
+                                               const Decoded* decoded) {
+    vm->reg[decoded->r0] = (u16)(vm->reg[decoded->r1] & decoded->value);
+    set_flags(vm, decoded->r0);
+    return decoded + 1;
+}
+
+static const Decoded* do_decoded_not(Vm* vm, const Decoded* decoded) {
+    vm->reg[decoded->r0] = (u16)(~vm->reg[decoded->r1]);
+    set_flags(vm, decoded->r0);
+    return decoded + 1;
+}
+
+static const Decoded* do_decoded_lea(Vm* vm, const Decoded* decoded) {
+    vm->reg[decoded->r0] = decoded->value;
+    set_flags(vm, decoded->r0);
+    return decoded + 1;
+}
+
+static const Decoded* do_decoded_load(Vm* vm, const Decoded* decoded) {
+    vm->reg[decoded->r0] = get_mem_at(vm, decoded->value);
+    set_flags(vm, decoded->r0);
+    return get_next(vm, decoded);
+}
+
+static const Decoded* do_decoded_load_register(Vm*            vm,
+                                               const Decoded* decoded) {
+    vm->reg[decoded->r0] =
+        get_mem_at(vm, (u16)(vm->reg[decoded->r1] + decoded->value));
+    set_flags(vm, decoded->r0);
+    return get_next(vm, decoded);
+}
+
+static const Decoded* do_decoded_load_indirect(Vm*            vm,
+                                               const Decoded* decoded) {
+    vm->reg[decoded->r0] = get_mem_at(vm, get_mem_at(vm, decoded->value));
+    set_flags(vm, decoded->r0);
+    return get_next(vm, decoded);
+}
+
+static const Decoded* do_decoded_store(Vm* vm, const Decoded* decoded) {
+    set_mem_at(vm, decoded->value, vm->reg[decoded->r0]);
+    return get_next(vm, decoded);
+}
+
+static const Decoded* do_decoded_store_register(Vm*            vm,
+                                                const Decoded* decoded) {
+    set_mem_at(vm,
+               (u16)(vm->reg[decoded->r1] + decoded->value),
+               vm->reg[decoded->r0]);
+    return get_next(vm, decoded);
+}
+
+static const Decoded* do_decoded_store_indirect(Vm*            vm,
+                                                const Decoded* decoded) {
+    set_mem_at(vm, get_mem_at(vm, decoded->value), vm->reg[decoded->r0]);
+    return get_next(vm, decoded);
+}
+
+static const Decoded* do_decoded_branch(Vm* vm, const Decoded* decoded) {
+    vm->reg[R_PC] = (vm->reg[R_COND] & decoded->r0) ? decoded->value
+                                                    : (u16)(decoded->pc + 1);
+    if (vm->coverage) {
+        do_cover(vm);
+    }
+    return NULL;
+}
+
+static const Decoded* do_decoded_jump(Vm* vm, const Decoded* decoded) {
+    vm->reg[R_PC] = vm->reg[decoded->r1];
+    if (vm->coverage) {
+        do_cover(vm);
+    }
+    if (vm->calls && (decoded->r1 == R_7)) {
+        do_return(vm);
+    }
+    return NULL;
+}
+
+static const Decoded* do_decoded_jump_subroutine(Vm*            vm,
+                                                 const Decoded* decoded) {
+    vm->reg[R_7] = (u16)(decoded->pc + 1);
+    vm->reg[R_PC] = decoded->value;
+    if (vm->coverage) {
+        do_cover(vm);
+    }
+    if (vm->calls) {
+        do_call(vm);
+    }
+    return NULL;
+}
+
+static const Decoded* do_decoded_jump_subroutine_register(
+    Vm*            vm,
+    const Decoded* decoded) {
+    vm->reg[R_7] = (u16)(decoded->pc + 1);
+    vm->reg[R_PC] = vm->reg[decoded->r1];
+    if (vm->coverage) {
+        do_cover(vm);
+    }
+    if (vm->calls) {
+        do_call(vm);
+    }
+    return NULL;
+}
+
+/* NOTE: Traps, breakpoints and anything else unusual go back through the
+ * interpreter. */
+static const Decoded* do_decoded_other(Vm* vm, const Decoded* decoded) {
+    vm->reg[R_PC] = (u16)(decoded->pc + 1);
+    do_bin_instr(vm, decoded->instr);
+    return NULL;
+}
+
+static const Decoded* do_decoded_exit(Vm* vm, const Decoded* decoded) {
+    vm->reg[R_PC] = decoded->pc;
+    return NULL;
+}
+
+static void set_decoded(Decoded*          decoded,
+                        u16               pc,
+                        const Predecoded* predecoded) {
+    const u16 instr = predecoded->instr;
+    decoded->pc = pc;
+    decoded->instr = instr;
+    decoded->value = predecoded->value;
+    decoded->r0 = predecoded->r0;
+    decoded->r1 = predecoded->r1;
+    decoded->r2 = predecoded->r2;
+    switch (get_op(instr)) {
+    case OP_BR: {
+        decoded->fn = do_decoded_branch;
+        break;
+    }
+    case OP_ADD: {
+        decoded->fn = get_immediate_mode(instr) ? do_decoded_add_immediate
+                                                : do_decoded_add;
+        break;
+    }
+    case OP_LD: {
+        decoded->fn = do_decoded_load;
+        break;
+    }
+    case OP_ST: {
+        decoded->fn = do_decoded_store;
+        break;
+    }
+    case OP_JSR: {
+        decoded->fn = get_relative_mode(instr)
+                          ? do_decoded_jump_subroutine
+                          : do_decoded_jump_subroutine_register;
+        break;
+    }
+    case OP_AND: {
+        decoded->fn = get_immediate_mode(instr) ? do_decoded_and_immediate
+                                                : do_decoded_and;
+        break;
+    }
+    case OP_LDR: {
+        decoded->fn = do_decoded_load_register;
+        break;
+    }
+    case OP_STR: {
+        decoded->fn = do_decoded_store_register;
+        break;
+    }
+    case OP_NOT: {
+        decoded->fn = do_decoded_not;
+        break;
+    }
+    case OP_LDI: {
+        decoded->fn = do_decoded_load_indirect;
+        break;
+    }
+    case OP_STI: {
+        decoded->fn = do_decoded_store_indirect;
+        break;
+    }
+    case OP_JMP: {
+        decoded->fn = do_decoded_jump;
+        break;
+    }
+    case OP_LEA: {
+        decoded->fn = do_decoded_lea;
+        break;
+    }
+    case OP_RES:
+    case OP_TRAP:
+    default: {
+        decoded->fn = do_decoded_other;
+    }
+    }
+}
+
+static Block* get_block(Tier* tier, u16 pc) {
+    return __atomic_load_n(&tier->blocks[pc], __ATOMIC_ACQUIRE);
+}
+
+/* NOTE: Waits for the job in hand to finish and keeps the compiler away
+ * from `vm` until `do_resume_compiler`; `drop` also forgets every job still
+ * queued. */
+static void do_pause_compiler(Tier* tier, Bool drop) {
+    pthread_mutex_lock(&tier->lock);
+    tier->vm = NULL;
+    while (tier->busy) {
+        pthread_cond_wait(&tier->idle, &tier->lock);
+    }
+    if (drop) {
+        tier->job_len = 0;
+        tier->spec_len = 0;
+        __atomic_store_n(&tier->full, FALSE, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&tier->lock);
+}
+
+static void do_resume_compiler(Tier* tier, Vm* vm) {
+    pthread_mutex_lock(&tier->lock);
+    tier->vm = vm;
+    pthread_cond_signal(&tier->ready);
+    pthread_mutex_unlock(&tier->lock);
+}
+
+static Bool get_queued(const Tier*  tier,
+                       JobKind      kind,
+                       u16          start,
+                       const Block* block) {
+    for (u32 i = 0; i < tier->job_len; ++i) {
+        const Job* job = &tier->jobs[(tier->job_head + i) % JOB_CAP];
+        if ((job->kind == kind) && (job->start == start) &&
+            (job->block == block))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* NOTE: Queues a job unless it is already queued, or the queue is full, in
+ * which case a hot block will simply ask again. */
+static void do_request_compile(Tier*   tier,
+                               JobKind kind,
+                               u16     start,
+                               Block*  block) {
+    pthread_mutex_lock(&tier->lock);
+    if (get_queued(tier, kind, start, block)) {
+        pthread_mutex_unlock(&tier->lock);
+        return;
+    }
+    if (tier->job_len < JOB_CAP) {
+        Job* job = &tier->jobs[(tier->job_head + tier->job_len++) % JOB_CAP];
+        job->kind = kind;
+        job->start = start;
+        job->block = block;
+        pthread_cond_signal(&tier->ready);
+    } else {
+        ++tier->jobs_dropped;
+    }
+    pthread_mutex_unlock(&tier->lock);
+}
+
+/* NOTE: Drops every decoded block, when the pools run out or `vm` has been
+ * loaded with another image since the tier last ran it. */
+static void do_flush_tier(Vm* vm, Tier* tier) {
+    if (tier->background) {
+        do_pause_compiler(tier, TRUE);
+    }
+    for (u32 i = 0; i < tier->block_len; ++i) {
+        tier->blocks[tier->block_pool[i].start] = NULL;
+    }
+    memset(tier->page_blocks, 0, sizeof(tier->page_blocks));
+    for (u32 i = 0; i < PAGE_COUNT; ++i) {
+        vm->pages[i] &= (u8)~PAGE_CODE;
+    }
+    memset(tier->code_words, 0, sizeof(tier->code_words));
+    tier->block_len = 0;
+    tier->code_len = 0;
+    tier->ir_len = 0;
+    tier->ir_code_len = 0;
+    tier->ir_exit_len = 0;
+    tier->lift = NULL;
+    vm->stale = FALSE;
+    vm->code_words = tier->code_words;
+    ++tier->flushes;
+    if (tier->background) {
+        do_resume_compiler(tier, vm);
+    }
+}
+
+static Bool get_pools_full(const Tier* tier) {
+    return (BLOCK_POOL <= tier->block_len) ||
+           (CODE_CAP < (tier->code_len + BLOCK_CAP + 1));
+}
+
+/* NOTE: Decodes the block at `start` into the pools, which must have room
+ * for it, without linking it into anything. Its page must not be packed
+ * (see `get_word_relaxed`). */
+static Block* get_decoded_block(const Vm* vm, Tier* tier, u16 start) {
+    const Native* native = vm->image->native;
+    Decoded*      code = &tier->code[tier->code_len];
+    u16           len = 0;
+    for (u16 pc = start;;) {
+        const u16         instr = get_word_relaxed(vm, pc);
+        const Predecoded* table =
+            native ? get_native_decoded(native, pc) : NULL;
+        if (table && (table->instr == instr)) {
+            set_decoded(&code[len++], pc, table);
+        } else {
+            const Predecoded predecoded = get_predecoded(pc, instr);
+            set_decoded(&code[len++], pc, &predecoded);
+        }
+        ++pc;
+        /* NOTE: Blocks stop at page boundaries, short of the memory-mapped
+         * registers, and where a native image says another block begins. */
+        if (get_control(instr) || (len == BLOCK_CAP) ||
+            (KEYBOARD_STATUS <= pc) || !(pc & (PAGE_SIZE - 1)) ||
+            (native && get_block_bit(native->blocks, pc)))
+        {
+            if (!get_control(instr)) {
+                code[len].fn = do_decoded_exit;
+                code[len].pc = pc;
+            }
+            break;
+        }
+    }
+    Block* block = &tier->block_pool[tier->block_len++];
+    block->code = code;
+    block->ir = NULL;
+    block->runs = 0;
+    block->start = start;
+    block->len = len;
+    block->page = (u8)(start >> PAGE_BITS);
+    block->generation = BLOCK_PENDING;
+    block->next = NULL;
+    tier->code_len += (u32)len + 1;
+    ++tier->promotions;
+    return block;
+}
+
+/* NOTE: From here on, stores over the block's words leave it stale. */
+static void do_link_block(Vm* vm, Tier* tier, Block* block) {
+    const u8 page = block->page;
+    block->generation = vm->generations[page];
+    block->next = tier->page_blocks[page];
+    tier->page_blocks[page] = block;
+    for (u16 i = 0; i < block->len; ++i) {
+        const u16 pc = (u16)(block->start + i);
+        tier->code_words[pc >> 6] |= 1llu << (pc & 0x3F);
+    }
+    set_page_flags(vm, page, (u8)(vm->pages[page] | PAGE_CODE));
+}
+
+/* NOTE: Blocks are only decoded from unpacked pages, so a page is unpacked
+ * once it holds hot code. */
+static void do_unpack_code(Vm* vm, u16 start) {
+    const u8 page = (u8)(start >> PAGE_BITS);
+    if (vm->pages[page] & PAGE_PACKED) {
+        do_unpack_page(vm, page);
+    }
+}
+
+static void do_promote(Vm* vm, Tier* tier, u16 start) {
+    if (get_pools_full(tier)) {
+        do_flush_tier(vm, tier);
+    }
+    do_unpack_code(vm, start);
+    Block* block = get_decoded_block(vm, tier, start);
+    do_link_block(vm, tier, block);
+    tier->blocks[start] = block;
+}
+
+/* NOTE: Links in a block the compiler thread published, as long as memory
+ * still holds the words it was decoded from. Returns whether it did. */
+static Bool do_install_block(Vm* vm, Tier* tier, Block* block) {
+    for (u16 i = 0; i < block->len; ++i) {
+        const Decoded* decoded = &block->code[i];
+        if (get_word_at(vm, decoded->pc) != decoded->instr) {
+            __atomic_store_n(&tier->blocks[block->start],
+                             NULL,
+                             __ATOMIC_RELAXED);
+            ++tier->rejects;
+            return FALSE;
+        }
+    }
+    do_link_block(vm, tier, block);
+    ++tier->installs;
+    return TRUE;
+}
+
+/* NOTE: Lifts everything but a closing branch, jump or trap, unless the IR
+ * pools are full; they empty along with the rest of the tier. */
+static void do_lift_block(Tier* tier, Block* block) {
+    const Decoded* last = &block->code[block->len - 1];
+    const u16      len =
+        get_control(last->instr) ? block->len - 1 : block->len;
+    const u8 nzp =
+        (get_op(last->instr) == OP_BR) && (last->value == block->start)
+            ? last->r0
+            : 0;
+    if ((len == 0) || (IR_GUEST_CAP < len) || (BLOCK_POOL <= tier->ir_len) ||
+        (IR_CODE_CAP < (tier->ir_code_len + IR_CAP)) ||
+        (IR_EXIT_CAP < (tier->ir_exit_len + IR_GUEST_CAP)))
+    {
+        return;
+    }
+    IrBuilder* builder = &tier->builder;
+    set_ir_builder(builder);
+    for (u16 i = 0; i < len; ++i) {
+        const Decoded* decoded = &block->code[i];
+        Predecoded     predecoded;
+        predecoded.instr = decoded->instr;
+        predecoded.value = decoded->value;
+        predecoded.op = get_op(decoded->instr);
+        predecoded.r0 = decoded->r0;
+        predecoded.r1 = decoded->r1;
+        predecoded.r2 = decoded->r2;
+        do_lift(builder, decoded->pc, &predecoded);
+    }
+    IrBlock* ir = &tier->ir_pool[tier->ir_len++];
+    do_schedule_ir(builder,
+                   ir,
+                   &tier->ir_code[tier->ir_code_len],
+                   &tier->ir_exits[tier->ir_exit_len],
+                   nzp);
+    tier->ir_code_len += ir->len;
+    tier->ir_exit_len += ir->exit_len;
+    __atomic_store_n(&block->ir, ir, __ATOMIC_RELEASE);
+}
+
+/* NOTE: Rebuilds the code bits of `page` from the blocks still on it, so
+ * stores to words nothing decodes any more go back to costing nothing. */
+static void set_page_code(Vm* vm, Tier* tier, u8 page) {
+    u64* words = &tier->code_words[(page << PAGE_BITS) >> 6];
+    memset(words, 0, (PAGE_SIZE / 64) * sizeof(u64));
+    for (const Block* block = tier->page_blocks[page]; block;
+         block = block->next)
+    {
+        for (u16 i = 0; i < block->len; ++i) {
+            const u16 pc = (u16)(block->start + i);
+            tier->code_words[pc >> 6] |= 1llu << (pc & 0x3F);
+        }
+    }
+    set_page_flags(vm,
+                   page,
+                   tier->page_blocks[page]
+                       ? (u8)(vm->pages[page] | PAGE_CODE)
+                       : (u8)(vm->pages[page] & ~PAGE_CODE));
+}
+
+/* NOTE: Unlinks the blocks on `page` for which `get_dropped` holds. The
+ * pool slots are only reclaimed by the next flush. */
+static void do_drop_blocks(Vm*   vm,
+                           Tier* tier,
+                           u8    page,
+                           Bool (*get_dropped)(const Vm*, const Block*)) {
+    Bool dropped = FALSE;
+    for (Block** link = &tier->page_blocks[page]; *link;) {
+        Block* block = *link;
+        if (get_dropped(vm, block)) {
+            *link = block->next;
+            if (get_block(tier, block->start) == block) {
+                __atomic_store_n(&tier->blocks[block->start],
+                                 NULL,
+                                 __ATOMIC_RELAXED);
+            }
+            ++tier->invalidations;
+            dropped = TRUE;
+        } else {
+            link = &block->next;
+        }
+    }
+    if (dropped) {
+        set_page_code(vm, tier, page);
+    }
+}
+
+static Bool get_covers_store(const Vm* vm, const Block* block) {
+    return (block->start <= vm->stale_address) &&
+           (vm->stale_address < (block->start + block->len));
+}
+
+static Bool get_outdated(const Vm* vm, const Block* block) {
+    return block->generation != vm->generations[block->page];
+}
+
+/* NOTE: Handles a guest store over decoded code. Only the blocks covering
+ * the stored word are dropped; the rest of the page is known to be intact,
+ * so those blocks are moved on to the page's new generation. Blocks that
+ * were already behind (the page was copied back by `do_reset_vm`, say) are
+ * left to `do_run_blocks` to drop. */
+static void do_invalidate(Vm* vm, Tier* tier) {
+    const u8  page = (u8)(vm->stale_address >> PAGE_BITS);
+    const u32 generation = vm->generations[page];
+    do_drop_blocks(vm, tier, page, get_covers_store);
+    for (Block* block = tier->page_blocks[page]; block; block = block->next)
+    {
+        if ((block->generation + 1) == generation) {
+            block->generation = generation;
+        }
+    }
+    vm->stale = FALSE;
+}
+
+/* NOTE: Runs blocks back to back for as long as the next one is already
+ * decoded and fits in `budget`. */
+static u64 do_run_blocks(Vm* vm, Tier* tier, u64 budget) {
+    u64 n = 0;
+    for (;;) {
+        Block* block = get_block(tier, vm->reg[R_PC]);
+        if ((block == NULL) || ((budget - n) < block->len)) {
+            return n;
+        }
+        if (get_outdated(vm, block)) {
+            if (block->generation == BLOCK_PENDING) {
+                if (!do_install_block(vm, tier, block)) {
+                    return n;
+                }
+            } else {
+                do_drop_blocks(vm, tier, block->page, get_outdated);
+                return n;
+            }
+        }
+        const Decoded* decoded = block->code;
+        const IrBlock* ir = __atomic_load_n(&block->ir, __ATOMIC_ACQUIRE);
+        if (ir) {
+            const u64 mark = __rdtsc();
+            vm->engine = TIER_IR;
+            const u64 count = run_ir(vm, ir, budget - n);
+            vm->engine = TIER_DECODED;
+            tier->cycles[TIER_IR] += __rdtsc() - mark;
+            tier->instrs[TIER_IR] += count;
+            tier->builder.stats.instrs += count;
+            if ((vm->status != ALIVE) || vm->stale) {
+                return n + count;
+            }
+            /* NOTE: Loops come back with the body of their last iteration
+             * run, which the block's own branch finishes. */
+            n += count - ir->end.count;
+            decoded += ir->end.count;
+        } else if (++block->runs == IR_THRESHOLD) {
+            tier->lift = block;
+        }
+        if (vm->calls) {
+            /* NOTE: With a profiler attached, `R_PC` follows the block, so
+             * samples land on the instruction running rather than the
+             * block's start. */
+            for (;;) {
+                vm->reg[R_PC] = decoded->pc;
+                const Decoded* next = decoded->fn(vm, decoded);
+                if (next == NULL) {
+                    break;
+                }
+                decoded = next;
+            }
+        } else {
+            for (const Decoded* next; (next = decoded->fn(vm, decoded));) {
+                decoded = next;
+            }
+        }
+        const u64 m = (u64)(decoded - block->code) + 1;
+        n += m < block->len ? m : block->len;
+        if ((vm->status != ALIVE) || vm->stale) {
+            return n;
+        }
+    }
+}
+
+/* NOTE: Counts an entry into the current `R_PC`, then interprets up to the
+ * end of its basic block. Returns `0` without running anything when the
+ * entry has just been promoted. */
+static u64 do_interpret_block(Vm* vm, Tier* tier, u64 budget) {
+    const u16 pc = vm->reg[R_PC];
+    u8*       hotness = &tier->hotness[pc & (HOT_SIZE - 1)];
+    if ((++*hotness == HOT_THRESHOLD) && (pc < KEYBOARD_STATUS) &&
+        (get_block(tier, pc) == NULL))
+    {
+        *hotness = 0;
+        if (tier->background) {
+            do_unpack_code(vm, pc);
+            do_request_compile(tier, JOB_PROMOTE, pc, NULL);
+        } else {
+            const u64 start = __rdtsc();
+            do_promote(vm, tier, pc);
+            tier->cycles[TIER_TRANSLATE] += __rdtsc() - start;
+            if (tier->blocks[pc]->len <= budget) {
+                return 0;
+            }
+        }
+    }
+    u64 n = 0;
+    while (n < budget) {
+        const u16 instr = get_mem_at(vm, vm->reg[R_PC]++);
+        do_bin_instr(vm, instr);
+        ++n;
+        if (get_control(instr) || (vm->status != ALIVE) || vm->stale) {
+            break;
+        }
+    }
+    return n;
+}
+
+/* NOTE: Where control can go from the end of `block` without running it,
+ * following the same rules as `set_blocks`. */
+static u32 get_successors(const Block* block, u16* next) {
+    const Decoded* last = &block->code[block->len - 1];
+    const u16      pc = (u16)(last->pc + 1);
+    u32            len = 0;
+    switch (get_op(last->instr)) {
+    case OP_BR: {
+        if (last->r0 != 0) {
+            next[len++] = last->value;
+        }
+        if (last->r0 != 0x7) {
+            next[len++] = pc;
+        }
+        break;
+    }
+    case OP_JSR: {
+        if (get_relative_mode(last->instr)) {
+            next[len++] = last->value;
+        }
+        next[len++] = pc;
+        break;
+    }
+    case OP_TRAP: {
+        if (get_trap(last->instr) != TRAP_HALT) {
+            next[len++] = pc;
+        }
+        break;
+    }
+    case OP_JMP:
+    case OP_RES: {
+        break;
+    }
+    case OP_ADD:
+    case OP_LD:
+    case OP_ST:
+    case OP_AND:
+    case OP_LDR:
+    case OP_STR:
+    case OP_NOT:
+    case OP_LDI:
+    case OP_STI:
+    case OP_LEA:
+    default: {
+        if (!get_control(last->instr)) {
+            next[len++] = block->code[block->len].pc;
+        }
+    }
+    }
+    return len;
+}
+
+/* NOTE: Runs on the compiler thread. Returns how many successors of a
+ * speculative block it left in `next`. */
+static u32 do_compile_job(Vm* vm, Tier* tier, const Job* job, u16* next) {
+    if (job->kind == JOB_LIFT) {
+        if (__atomic_load_n(&job->block->ir, __ATOMIC_RELAXED) == NULL) {
+            do_lift_block(tier, job->block);
+        }
+        return 0;
+    }
+    /* NOTE: Speculation can reach pages the guest has not unpacked. */
+    const u8 page = (u8)(job->start >> PAGE_BITS);
+    if ((KEYBOARD_STATUS <= job->start) || get_block(tier, job->start) ||
+        (__atomic_load_n(&vm->pages[page], __ATOMIC_ACQUIRE) & PAGE_PACKED))
+    {
+        return 0;
+    }
+    if (get_pools_full(tier)) {
+        __atomic_store_n(&tier->full, TRUE, __ATOMIC_RELAXED);
+        return 0;
+    }
+    Block* block = get_decoded_block(vm, tier, job->start);
+    Block* empty = NULL;
+    if (!__atomic_compare_exchange_n(&tier->blocks[job->start],
+                                     &empty,
+                                     block,
+                                     FALSE,
+                                     __ATOMIC_RELEASE,
+                                     __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    return job->kind == JOB_SPECULATE ? get_successors(block, next) : 0;
+}
+
+/* NOTE: Jobs asked for by the running thread go first; speculation only
+ * fills in the time between them. */
+static void* do_compile_work(void* data) {
+    Tier* tier = data;
+    pthread_mutex_lock(&tier->lock);
+    for (;;) {
+        while (!tier->quit &&
+               ((tier->vm == NULL) ||
+                ((tier->job_len == 0) && (tier->spec_len == 0))))
+        {
+            pthread_cond_wait(&tier->ready, &tier->lock);
+        }
+        if (tier->quit) {
+            break;
+        }
+        Job job;
+        if (tier->job_len) {
+            job = tier->jobs[tier->job_head];
+            tier->job_head = (tier->job_head + 1) % JOB_CAP;
+            --tier->job_len;
+        } else {
+            job.kind = JOB_SPECULATE;
+            job.start = tier->spec[--tier->spec_len];
+            job.block = NULL;
+        }
+        Vm* vm = tier->vm;
+        tier->busy = TRUE;
+        pthread_mutex_unlock(&tier->lock);
+        u16       next[2];
+        const u64 start = __rdtsc();
+        const u32 len = do_compile_job(vm, tier, &job, next);
+        const u64 cycles = __rdtsc() - start;
+        pthread_mutex_lock(&tier->lock);
+        for (u32 i = 0; i < len; ++i) {
+            if ((tier->speculated < SPECULATE_CAP) &&
+                (tier->spec_len < SPECULATE_CAP))
+            {
+                tier->spec[tier->spec_len++] = next[i];
+                ++tier->speculated;
+            }
+        }
+        ++tier->jobs_run;
+        tier->compile_cycles += cycles;
+        tier->busy = FALSE;
+        pthread_cond_broadcast(&tier->idle);
+    }
+    pthread_mutex_unlock(&tier->lock);
+    return NULL;
+}
+
+/* NOTE: Gives `tier` a compiler thread of its own, which it keeps until
+ * `do_stop_compiler`. */
+static void do_start_compiler(Tier* tier) {
+    pthread_mutex_init(&tier->lock, NULL);
+    pthread_cond_init(&tier->ready, NULL);
+    pthread_cond_init(&tier->idle, NULL);
+    tier->background = TRUE;
+    if (pthread_create(&tier->thread, NULL, do_compile_work, tier)) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void do_stop_compiler(Tier* tier) {
+    pthread_mutex_lock(&tier->lock);
+    tier->quit = TRUE;
+    pthread_cond_signal(&tier->ready);
+    pthread_mutex_unlock(&tier->lock);
+    pthread_join(tier->thread, NULL);
+    pthread_cond_destroy(&tier->idle);
+    pthread_cond_destroy(&tier->ready);
+    pthread_mutex_destroy(&tier->lock);
+    tier->background = FALSE;
+}
+
+/* NOTE: Has `tier` run `vm` from here on, dropping whatever it decoded for
+ * anything else. With a compiler thread, decoding ahead of the guest starts
+ * at once, without waiting for `run_tiered`. */
+static void set_tier_vm(Vm* vm, Tier* tier) {
+    do_flush_tier(vm, tier);
+    if (tier->background) {
+        pthread_mutex_lock(&tier->lock);
+        tier->spec[tier->spec_len++] = vm->reg[R_PC];
+        tier->speculated = 1;
+        pthread_cond_signal(&tier->ready);
+        pthread_mutex_unlock(&tier->lock);
+    }
+}
+
+/* NOTE: Same contract as `run_vm`. A block only runs in tier 1 if it fits in
+ * what is left of the budget, so instruction counts stay exact. */
+static u64 run_tiered(Vm* vm, Tier* tier, u64 budget, u64 deadline) {
+    const u64 start = __rdtsc();
+    const u64 elsewhere = tier->cycles[TIER_DECODED] +
+                          tier->cycles[TIER_IR] +
+                          tier->cycles[TIER_TRANSLATE];
+    u64 n = 0;
+    vm->deadline = deadline;
+    if (vm->code_words != tier->code_words) {
+        set_tier_vm(vm, tier);
+    } else if (tier->background) {
+        do_resume_compiler(tier, vm);
+    }
+    while (vm->status == ALIVE) {
+        if (budget <= n) {
+            vm->status = EXHAUSTED;
+            break;
+        }
+        if (deadline && (deadline <= get_monotonic_ns())) {
+            vm->status = EXPIRED;
+            break;
+        }
+        if (INTERRUPT) {
+            vm->status = INTERRUPTED;
+            break;
+        }
+        if (__atomic_load_n(&tier->full, __ATOMIC_RELAXED)) {
+            do_flush_tier(vm, tier);
+        }
+        const u64 end =
+            n + (budget - n < BATCH_SIZE ? budget - n : BATCH_SIZE);
+        while ((n < end) && (vm->status == ALIVE)) {
+            if (get_block(tier, vm->reg[R_PC])) {
+                /* NOTE: What `do_run_blocks` spent in `run_ir` is already
+                 * booked to `TIER_IR`. */
+                const u64 mark = __rdtsc();
+                const u64 ir_cycles = tier->cycles[TIER_IR];
+                const u64 ir_instrs = tier->instrs[TIER_IR];
+                vm->engine = TIER_DECODED;
+                const u64 m = do_run_blocks(vm, tier, end - n);
+                vm->engine = TIER_INTERPRET;
+                tier->cycles[TIER_DECODED] +=
+                    (__rdtsc() - mark) - (tier->cycles[TIER_IR] - ir_cycles);
+                tier->instrs[TIER_DECODED] +=
+                    m - (tier->instrs[TIER_IR] - ir_instrs);
+                n += m;
+                if (tier->lift && tier->background) {
+                    do_request_compile(tier,
+                                       JOB_LIFT,
+                                       tier->lift->start,
+                                       tier->lift);
+                    tier->lift = NULL;
+                } else if (tier->lift) {
+                    const u64 lift = __rdtsc();
+                    do_lift_block(tier, tier->lift);
+                    tier->lift = NULL;
+                    tier->cycles[TIER_TRANSLATE] += __rdtsc() - lift;
+                }
+                if ((end <= n) || (vm->status != ALIVE)) {
+                    break;
+                }
+            }
+            if (!vm->stale) {
+                const u64 m = do_interpret_block(vm, tier, end - n);
+                tier->instrs[TIER_INTERPRET] += m;
+                n += m;
+            }
+            if (vm->stale) {
+                do_invalidate(vm, tier);
+            }
+        }
+    }
+    /* NOTE: Whatever was not spent in blocks or decoding them was spent in
+     * the interpreter. */
+    tier->cycles[TIER_INTERPRET] +=
+        (__rdtsc() - start) -
+        ((tier->cycles[TIER_DECODED] + tier->cycles[TIER_IR] +
+          tier->cycles[TIER_TRANSLATE]) -
+         elsewhere);
+    /* NOTE: `vm` may be freed once this returns. */
+    if (tier->background) {
+        do_pause_compiler(tier, FALSE);
+    }
+    return n;
+}
+
+static void do_print_tier_stats(const Tier* tier, File* file) {
+    u64 cycles = 0;
+    for (u8 i = 0; i < TIER_COUNT; ++i) {
+        cycles += tier->cycles[i];
+    }
+    fprintf(file,
+            "tier threshold %u, promotions %" PRIu64
+            ", invalidations %" PRIu64 ", flushes %" PRIu64 "\n",
+            (u32)HOT_THRESHOLD,
+            tier->promotions,
+            tier->invalidations,
+            tier->flushes);
+    const IrStats* stats = &tier->builder.stats;
+    fprintf(file,
+            "tier ir blocks %" PRIu64 ", instrs %" PRIu64 " (lifted %" PRIu64
+            "), ops %" PRIu64 " -> %" PRIu64 ", loads forwarded %" PRIu64
+            ", stores dropped %" PRIu64 ", flags elided %" PRIu64 "\n",
+            stats->blocks,
+            stats->instrs,
+            stats->guest,
+            stats->emitted,
+            stats->scheduled,
+            stats->forwarded,
+            stats->dropped,
+            stats->flags);
+    if (tier->background) {
+        fprintf(file,
+                "tier compiler jobs %" PRIu64 " (dropped %" PRIu64
+                "), installs %" PRIu64 ", rejects %" PRIu64 ", %" PRIu64
+                " cycles\n",
+                tier->jobs_run,
+                tier->jobs_dropped,
+                tier->installs,
+                tier->rejects,
+                tier->compile_cycles);
+    }
+    for (u8 i = 0; i < TIER_COUNT; ++i) {
+        fprintf(file,
+                "tier %-9s %12" PRIu64 " instrs %14" PRIu64
+                " cycles %3" PRIu64 "%%\n",
+                TIER_NAMES[i],
+                tier->instrs[i],
+                tier->cycles[i],
+                cycles ? (tier->cycles[i] * 100) / cycles : 0);
+    }
+}
+
+#endif
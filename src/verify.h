@@ -0,0 +1,574 @@
+#ifndef __VERIFY_H__
+#define __VERIFY_H__
+
+#include "arena.h"
+#include "fuzz.h"
+#include "tier.h"
+
+#include <string.h>
+
+/* NOTE: `--verify` checks the tiered engine against the `do_bin_instr`
+ * interpreter while the guest runs. Every `period` instructions or so (at
+ * random, so no loop in the guest lines up with it) the running VM is copied
+ * into a `Window`, and its next `VERIFY_WINDOW` instructions are run
+ * `VERIFY_STEP` at a time. After each step the registers are recorded along
+ * with a hash of how memory differs from the copy, which is kept up to date
+ * by rehashing just the pages the step touched. A page that was stored to
+ * but holds what it did in the copy adds nothing to the hash, so the two
+ * engines need not agree on which stores touched a page. A shadow
+ * thread runs the same instructions from the copy with the reference
+ * interpreter and compares the two after every step. Input the guest reads
+ * during the window is recorded and replayed to the shadow, and so are the
+ * clocks it reads and how its sleeps ended.
+ *
+ * The running thread never waits on the shadow: while `VERIFY_QUEUE`
+ * windows are still waiting to be checked, it skips sampling. When a step
+ * disagrees, the shadow runs it again one instruction at a time and reports
+ * the first instruction whose result is wrong by the end of the step. */
+#define VERIFY_STEP   64
+#define VERIFY_WINDOW (1 << 12)
+#define VERIFY_STEPS  (VERIFY_WINDOW / VERIFY_STEP)
+#define VERIFY_QUEUE  4
+
+static const char* const REGISTER_NAMES[R_SIZE] = {
+    "R0",
+    "R1",
+    "R2",
+    "R3",
+    "R4",
+    "R5",
+    "R6",
+    "R7",
+    "PC",
+    "COND",
+};
+
+typedef struct {
+    u16    reg[R_SIZE];
+    u64    hash;
+    u64    len;
+    Status status;
+} Step;
+
+typedef enum {
+    EVENT_GET = 0,
+    EVENT_POLL,
+    EVENT_WAIT,
+    EVENT_CYCLES,
+    EVENT_MS,
+} EventKind;
+
+typedef struct {
+    u64       value;
+    EventKind kind;
+} Event;
+
+typedef struct Window Window;
+
+struct Window {
+    Window* next;
+    u16*    mem;
+    u64     hashes[PAGE_COUNT];
+    u16     reg[R_SIZE];
+    u64     start;
+    Step    steps[VERIFY_STEPS];
+    u32     step_len;
+    Event*  events;
+    u32     event_len;
+    u32     event_cap;
+    u32     event_index;
+    Bool    replayed;
+};
+
+typedef struct {
+    const Io* io;
+    void*     io_data;
+    Window*   window;
+    u64       hashes[PAGE_COUNT];
+    u64       period;
+    u64       rng;
+    Vm*       shadow;
+    u64       shadow_hashes[PAGE_COUNT];
+    Thread    thread;
+    Mutex     lock;
+    Cond      ready;
+    Window*   head;
+    Window*   tail;
+    u32       queued;
+    Bool      done;
+    u64       windows;
+    u64       skipped;
+    u64       instrs;
+    u64       divergences;
+} Verifier;
+
+static void do_log_event(Window* window, u64 value, EventKind kind) {
+    if (window->event_len == window->event_cap) {
+        window->event_cap = window->event_cap ? window->event_cap * 2 : 16;
+        window->events =
+            realloc(window->events, window->event_cap * sizeof(Event));
+        if (window->events == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    window->events[window->event_len].value = value;
+    window->events[window->event_len++].kind = kind;
+}
+
+/* NOTE: `IO_VERIFY` passes everything through to the guest's own `Io`,
+ * noting the input it reads while a window is being recorded. */
+static i32 get_verify_char(Vm* vm) {
+    Verifier* verifier = vm->io_data;
+    vm->io_data = verifier->io_data;
+    const i32 x = verifier->io->get_char(vm);
+    vm->io_data = verifier;
+    if (verifier->window) {
+        do_log_event(verifier->window, (u64)x, EVENT_GET);
+    }
+    return x;
+}
+
+static Bool poll_verify_char(Vm* vm) {
+    Verifier* verifier = vm->io_data;
+    vm->io_data = verifier->io_data;
+    const Bool x = verifier->io->poll_char(vm);
+    vm->io_data = verifier;
+    if (verifier->window) {
+        do_log_event(verifier->window, x, EVENT_POLL);
+    }
+    return x;
+}
+
+static void put_verify_char(Vm* vm, char x) {
+    Verifier* verifier = vm->io_data;
+    vm->io_data = verifier->io_data;
+    verifier->io->put_char(vm, x);
+    vm->io_data = verifier;
+}
+
+static void flush_verify(Vm* vm) {
+    Verifier* verifier = vm->io_data;
+    vm->io_data = verifier->io_data;
+    verifier->io->flush(vm);
+    vm->io_data = verifier;
+}
+
+static u64 get_verify_clock(Vm* vm, Clock clock) {
+    Verifier* verifier = vm->io_data;
+    vm->io_data = verifier->io_data;
+    const u64 x = verifier->io->get_clock(vm, clock);
+    vm->io_data = verifier;
+    if (verifier->window) {
+        do_log_event(verifier->window,
+                     x,
+                     clock == CLOCK_CYCLES ? EVENT_CYCLES : EVENT_MS);
+    }
+    return x;
+}
+
+static Bool wait_verify_char(Vm* vm, u64 deadline) {
+    Verifier* verifier = vm->io_data;
+    vm->io_data = verifier->io_data;
+    const Bool x = verifier->io->wait_char(vm, deadline);
+    vm->io_data = verifier;
+    if (verifier->window) {
+        do_log_event(verifier->window, x, EVENT_WAIT);
+    }
+    return x;
+}
+
+static const Io IO_VERIFY = {
+    get_verify_char,
+    poll_verify_char,
+    put_verify_char,
+    flush_verify,
+    get_verify_clock,
+    wait_verify_char,
+};
+
+/* NOTE: Asking for input the running VM did not ask for, or in another
+ * way, is a divergence of its own. */
+static const Event* get_replay_event(Vm* vm, EventKind kind) {
+    Window* window = vm->io_data;
+    if ((window->event_len <= window->event_index) ||
+        (window->events[window->event_index].kind != kind))
+    {
+        window->replayed = FALSE;
+        return NULL;
+    }
+    return &window->events[window->event_index++];
+}
+
+static i32 get_replay_char(Vm* vm) {
+    const Event* event = get_replay_event(vm, EVENT_GET);
+    return event ? (i32)event->value : EOF;
+}
+
+static Bool poll_replay_char(Vm* vm) {
+    const Event* event = get_replay_event(vm, EVENT_POLL);
+    return event ? event->value != 0 : FALSE;
+}
+
+static u64 get_replay_clock(Vm* vm, Clock clock) {
+    const Event* event = get_replay_event(
+        vm,
+        clock == CLOCK_CYCLES ? EVENT_CYCLES : EVENT_MS);
+    return event ? event->value : 0;
+}
+
+static Bool wait_replay_char(Vm* vm, u64 deadline) {
+    const Event* event = get_replay_event(vm, EVENT_WAIT);
+    return event ? event->value != 0 : FALSE;
+}
+
+static const Io IO_REPLAY = {
+    get_replay_char,
+    poll_replay_char,
+    put_null_char,
+    flush_buffers,
+    get_replay_clock,
+    wait_replay_char,
+};
+
+static u64 get_page_hash(const u16* mem, u8 page) {
+    const u16* words = &mem[page << PAGE_BITS];
+    u64        hash = 14695981039346656037llu ^ page;
+    for (u32 i = 0; i < PAGE_SIZE; i += 4) {
+        u64 x;
+        memcpy(&x, &words[i], sizeof(u64));
+        hash = (hash ^ x) * 1099511628211llu;
+    }
+    return hash;
+}
+
+/* NOTE: Folds the pages stored to since the last call into `hash`, and
+ * clears their `PAGE_DIRTY` so the next store to them is noticed again.
+ * `dirty` still has them for `do_reset_vm`. `hashes` starts out as the
+ * copy's own, so `hash` is `0` for as long as memory matches the copy. */
+static void do_hash_pages(Vm* vm, u64* hashes, u64* hash) {
+    for (u32 i = 0; i < PAGE_COUNT; ++i) {
+        if (vm->pages[i] & PAGE_DIRTY) {
+            const u64 page_hash = get_page_hash(vm->mem, (u8)i);
+            *hash ^= hashes[i] ^ page_hash;
+            hashes[i] = page_hash;
+            vm->pages[i] &= (u8)~PAGE_DIRTY;
+        }
+    }
+}
+
+static void do_clear_dirty(Vm* vm) {
+    for (u32 i = 0; i < PAGE_COUNT; ++i) {
+        vm->pages[i] &= (u8)~PAGE_DIRTY;
+    }
+}
+
+static void set_shadow(Verifier* verifier, Window* window) {
+    Vm* shadow = verifier->shadow;
+    memcpy(shadow->mem, window->mem, MEM_SIZE * sizeof(u16));
+    memcpy(shadow->reg, window->reg, sizeof(shadow->reg));
+    memset(shadow->pages, 0, sizeof(shadow->pages));
+    set_device_pages(shadow);
+    memcpy(verifier->shadow_hashes,
+           window->hashes,
+           sizeof(verifier->shadow_hashes));
+    shadow->io_data = window;
+    window->event_index = 0;
+    window->replayed = TRUE;
+}
+
+/* NOTE: Runs one of the running VM's steps on the shadow. `EXPIRED` only
+ * means the running VM hit its deadline, so it counts as still running. */
+static Bool get_step_matches(Verifier* verifier,
+                             const Step* step,
+                             Window*     window,
+                             u64*        hash) {
+    Vm* shadow = verifier->shadow;
+    shadow->status = ALIVE;
+    run_vm(shadow, step->len, 0);
+    if (shadow->status == EXHAUSTED) {
+        shadow->status = ALIVE;
+    }
+    do_hash_pages(shadow, verifier->shadow_hashes, hash);
+    const Status status = step->status == EXPIRED ? ALIVE : step->status;
+    return window->replayed && (*hash == step->hash) &&
+           (shadow->status == status) &&
+           !memcmp(shadow->reg, step->reg, sizeof(step->reg));
+}
+
+/* NOTE: Replays the window up to step `index`, then runs that step an
+ * instruction at a time. Each register or page that is wrong at the end of
+ * the step was last written by one of its instructions; the earliest of
+ * those is the one reported. Failing that, the divergence is in control
+ * flow or input, and the step's last instruction is reported. */
+static void do_report(Verifier* verifier, Window* window, u32 index) {
+    Vm* shadow = verifier->shadow;
+    u64 hash = 0;
+    set_shadow(verifier, window);
+    u64 count = window->start;
+    for (u32 i = 0; i < index; ++i) {
+        get_step_matches(verifier, &window->steps[i], window, &hash);
+        count += window->steps[i].len;
+    }
+    const Step* step = &window->steps[index];
+    u16         pcs[VERIFY_STEP];
+    u16         instrs[VERIFY_STEP];
+    u16         regs[VERIFY_STEP];
+    Bool        stores[VERIFY_STEP];
+    u64         len = 0;
+    shadow->status = ALIVE;
+    do_hash_pages(shadow, verifier->shadow_hashes, &hash);
+    for (; (len < step->len) && (shadow->status == ALIVE); ++len) {
+        u16 before[R_SIZE];
+        memcpy(before, shadow->reg, sizeof(before));
+        pcs[len] = shadow->reg[R_PC];
+        instrs[len] = get_word_at(shadow, pcs[len]);
+        run_vm(shadow, 1, 0);
+        if (shadow->status == EXHAUSTED) {
+            shadow->status = ALIVE;
+        }
+        regs[len] = 0;
+        for (u8 r = 0; r < R_PC; ++r) {
+            if (shadow->reg[r] != before[r]) {
+                regs[len] |= (u16)(1 << r);
+            }
+        }
+        const u64 last = hash;
+        do_hash_pages(shadow, verifier->shadow_hashes, &hash);
+        stores[len] = hash != last;
+    }
+    u16 wrong = 0;
+    for (u8 r = 0; r < R_SIZE; ++r) {
+        if (shadow->reg[r] != step->reg[r]) {
+            wrong |= (u16)(1 << r);
+        }
+    }
+    Bool memory = hash != step->hash;
+    u64  first = len ? len - 1 : 0;
+    for (u64 i = len; i;) {
+        --i;
+        if ((regs[i] & wrong) || (memory && stores[i])) {
+            first = i;
+        }
+        wrong &= (u16)~regs[i];
+        memory = memory && !stores[i];
+    }
+    fprintf(stderr,
+            "verify diverged at instr %" PRIu64 " (x%04X: x%04X):",
+            count + first,
+            (u32)(len ? pcs[first] : shadow->reg[R_PC]),
+            (u32)(len ? instrs[first] : 0));
+    for (u8 r = 0; r < R_SIZE; ++r) {
+        if (shadow->reg[r] != step->reg[r]) {
+            fprintf(stderr,
+                    " %s x%04X (reference x%04X)",
+                    REGISTER_NAMES[r],
+                    (u32)step->reg[r],
+                    (u32)shadow->reg[r]);
+        }
+    }
+    fprintf(stderr,
+            "%s%s%s\n",
+            hash != step->hash ? " memory" : "",
+            shadow->status != step->status ? " status" : "",
+            window->replayed ? "" : " input");
+}
+
+/* NOTE: Stops at the first step that disagrees. Once `SIGINT` has stopped
+ * the run the shadow stops short as well, and proves nothing. */
+static void do_check_window(Verifier* verifier, Window* window) {
+    u64 hash = 0;
+    u64 instrs = 0;
+    set_shadow(verifier, window);
+    for (u32 i = 0; i < window->step_len; ++i) {
+        if (!get_step_matches(verifier, &window->steps[i], window, &hash)) {
+            if (verifier->shadow->status != INTERRUPTED) {
+                do_report(verifier, window, i);
+                ++verifier->divergences;
+            }
+            break;
+        }
+        instrs += window->steps[i].len;
+    }
+    verifier->instrs += instrs;
+}
+
+static void* do_shadow_work(void* data) {
+    Verifier* verifier = data;
+    pthread_mutex_lock(&verifier->lock);
+    for (;;) {
+        while ((verifier->head == NULL) && !verifier->done) {
+            pthread_cond_wait(&verifier->ready, &verifier->lock);
+        }
+        Window* window = verifier->head;
+        if (window == NULL) {
+            break;
+        }
+        pthread_mutex_unlock(&verifier->lock);
+        do_check_window(verifier, window);
+        pthread_mutex_lock(&verifier->lock);
+        verifier->head = window->next;
+        if (verifier->head == NULL) {
+            verifier->tail = NULL;
+        }
+        --verifier->queued;
+        free(window->events);
+        free(window->mem);
+        free(window);
+    }
+    pthread_mutex_unlock(&verifier->lock);
+    return NULL;
+}
+
+/* NOTE: Records a window of up to `budget` instructions, starting at
+ * instruction `start`, and hands it to the shadow. */
+static u64 do_record_window(Verifier* verifier,
+                            Vm*       vm,
+                            Tier*     tier,
+                            u64       start,
+                            u64       budget,
+                            u64       deadline) {
+    Window* window = calloc(1, sizeof(Window));
+    if (window == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    window->mem = malloc(MEM_SIZE * sizeof(u16));
+    if (window->mem == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    memcpy(window->mem, vm->mem, MEM_SIZE * sizeof(u16));
+    memcpy(window->reg, vm->reg, sizeof(window->reg));
+    window->start = start;
+    for (u32 i = 0; i < PAGE_COUNT; ++i) {
+        window->hashes[i] = get_page_hash(window->mem, (u8)i);
+    }
+    do_clear_dirty(vm);
+    memcpy(verifier->hashes, window->hashes, sizeof(verifier->hashes));
+    verifier->window = window;
+    u64 hash = 0;
+    u64 n = 0;
+    while ((n < budget) && (window->step_len < VERIFY_STEPS)) {
+        const u64 m = run_tiered(vm,
+                                 tier,
+                                 budget - n < VERIFY_STEP ? budget - n
+                                                          : VERIFY_STEP,
+                                 deadline);
+        n += m;
+        if (vm->status == EXHAUSTED) {
+            vm->status = ALIVE;
+        }
+        do_hash_pages(vm, verifier->hashes, &hash);
+        Step* step = &window->steps[window->step_len++];
+        memcpy(step->reg, vm->reg, sizeof(step->reg));
+        step->hash = hash;
+        step->len = m;
+        step->status = vm->status;
+        if (vm->status != ALIVE) {
+            break;
+        }
+    }
+    verifier->window = NULL;
+    pthread_mutex_lock(&verifier->lock);
+    if (verifier->tail) {
+        verifier->tail->next = window;
+    } else {
+        verifier->head = window;
+    }
+    verifier->tail = window;
+    ++verifier->queued;
+    ++verifier->windows;
+    pthread_cond_signal(&verifier->ready);
+    pthread_mutex_unlock(&verifier->lock);
+    return n;
+}
+
+static u64 get_verify_gap(Verifier* verifier) {
+    /* NOTE: See `https://en.wikipedia.org/wiki/Xorshift`. */
+    verifier->rng ^= verifier->rng << 13;
+    verifier->rng ^= verifier->rng >> 7;
+    verifier->rng ^= verifier->rng << 17;
+    return (verifier->period / 2) + (verifier->rng % verifier->period) + 1;
+}
+
+/* NOTE: Same contract as `run_tiered`, which does all of the running. */
+static u64 run_verified(Verifier* verifier,
+                        Vm*       vm,
+                        Tier*     tier,
+                        u64       budget,
+                        u64       deadline) {
+    u64 n = 0;
+    for (;;) {
+        const u64 gap = get_verify_gap(verifier);
+        n += run_tiered(vm,
+                        tier,
+                        budget - n < gap ? budget - n : gap,
+                        deadline);
+        if ((vm->status != EXHAUSTED) || (budget <= n)) {
+            break;
+        }
+        vm->status = ALIVE;
+        pthread_mutex_lock(&verifier->lock);
+        const Bool behind = VERIFY_QUEUE <= verifier->queued;
+        pthread_mutex_unlock(&verifier->lock);
+        if (behind) {
+            ++verifier->skipped;
+            continue;
+        }
+        n += do_record_window(verifier, vm, tier, n, budget - n, deadline);
+        if (vm->status != ALIVE) {
+            break;
+        }
+        if (budget <= n) {
+            vm->status = EXHAUSTED;
+            break;
+        }
+    }
+    return n;
+}
+
+/* NOTE: Puts `IO_VERIFY` in front of `vm`'s own I/O. The shadow starts out
+ * as a copy of `vm`'s setup, and takes everything else from each window. */
+static void do_start_verifier(Verifier* verifier, Vm* vm, u64 period) {
+    verifier->io = vm->io;
+    verifier->io_data = vm->io_data;
+    verifier->period = period;
+    verifier->rng = get_monotonic_ns() | 1;
+    verifier->shadow = get_vm();
+    verifier->shadow->image = vm->image;
+    verifier->shadow->io = &IO_REPLAY;
+    verifier->shadow->trap = vm->trap;
+    verifier->shadow->core = vm->core;
+    verifier->shadow->core_count = vm->core_count;
+    vm->io = &IO_VERIFY;
+    vm->io_data = verifier;
+    pthread_mutex_init(&verifier->lock, NULL);
+    pthread_cond_init(&verifier->ready, NULL);
+    if (pthread_create(&verifier->thread, NULL, do_shadow_work, verifier)) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* NOTE: Waits for the shadow to check every window taken. */
+static void do_stop_verifier(Verifier* verifier, Vm* vm) {
+    pthread_mutex_lock(&verifier->lock);
+    verifier->done = TRUE;
+    pthread_cond_signal(&verifier->ready);
+    pthread_mutex_unlock(&verifier->lock);
+    pthread_join(verifier->thread, NULL);
+    pthread_cond_destroy(&verifier->ready);
+    pthread_mutex_destroy(&verifier->lock);
+    do_free_vm(verifier->shadow);
+    vm->io = verifier->io;
+    vm->io_data = verifier->io_data;
+}
+
+static void do_print_verify_stats(const Verifier* verifier, File* file) {
+    fprintf(file,
+            "verify windows %" PRIu64 ", skipped %" PRIu64
+            ", instrs checked %" PRIu64 ", divergences %" PRIu64 "\n",
+            verifier->windows,
+            verifier->skipped,
+            verifier->instrs,
+            verifier->divergences);
+}
+
+#endif
@@ -1,61 +1,514 @@
 #ifndef __VM_H__
 #define __VM_H__
 
-#include "pre_vm.h"
+#include "pack.h"
 
+#include <errno.h>
 #include <signal.h>
+#include <string.h>
 #include <termios.h>
+#include <time.h>
+#include <x86intrin.h>
 
-typedef FILE           File;
-typedef struct termios TermIos;
-typedef tcflag_t       TcFlag;
+typedef FILE             File;
+typedef struct sigaction SigAction;
+typedef struct termios   TermIos;
+typedef tcflag_t         TcFlag;
+typedef struct timespec  TimeSpec;
+
+typedef struct Vm     Vm;
+typedef struct Native Native;
+
+typedef enum {
+    CLOCK_CYCLES = 0,
+    CLOCK_MS,
+} Clock;
+
+/* NOTE: Guest I/O goes through an `Io` table rather than straight to
+ * `stdin`/`stdout`, so the same interpreter can serve a terminal or a
+ * request held in memory. The timer device reads its clocks through it as
+ * well, and `TRAP_SLEEP` calls `wait_char`, which returns once input is
+ * waiting (`TRUE`), or once `CLOCK_MS` reaches `deadline` or `INTERRUPT` is
+ * set (`FALSE`). */
+typedef struct {
+    i32 (*get_char)(Vm*);
+    Bool (*poll_char)(Vm*);
+    void (*put_char)(Vm*, char);
+    void (*flush)(Vm*);
+    u64 (*get_clock)(Vm*, Clock);
+    Bool (*wait_char)(Vm*, u64 deadline);
+} Io;
+
+#define MEM_SIZE (U16_MAX + 1)
+
+#define BATCH_SIZE 4096
+
+#define SECOND_NS      ((u64)1000000000)
+#define MILLISECOND_NS ((u64)1000000)
+
+/* NOTE: The longest a wait on `stdin` goes without checking `INTERRUPT`.
+ * `SIGINT` can land on a thread other than the one waiting. */
+#define WAIT_SLICE_MS 100
+
+/* NOTE: Memory is tracked in pages so a VM can be reset to its image by
+ * copying back only what the guest touched. */
+#define PAGE_BITS  8
+#define PAGE_SIZE  (1 << PAGE_BITS)
+#define PAGE_COUNT (MEM_SIZE >> PAGE_BITS)
+
+/* NOTE: Calls are tracked, as far as `JSR`/`JSRR` in and `JMP R7` back out
+ * goes, only while a profiler is attached. `depth` keeps counting past
+ * `CALL_CAP` so calls and returns stay paired. */
+#define CALL_CAP 64
+
+typedef struct {
+    u16 frames[CALL_CAP];
+    u32 depth;
+} CallStack;
+
+typedef enum {
+    PAGE_DIRTY = 1 << 0,
+    PAGE_WATCH = 1 << 1,
+    PAGE_CODE = 1 << 2,
+    PAGE_SHARED = 1 << 3,
+    PAGE_FROZEN = 1 << 4,
+    PAGE_DEVICE = 1 << 5,
+    PAGE_PACKED = 1 << 6,
+} PageFlag;
+
+typedef struct {
+    u16           mem[MEM_SIZE];
+    const Native* native;
+} Image;
+
+/* NOTE: `mem` points at `memory` unless the VM is one of several cores
+ * sharing the memory of the first. `trap`, if set, gets the first go at
+ * every `TRAP` and returns whether it dealt with it.
+ *
+ * A fork (see `fork.h`) reads each `PAGE_SHARED` page from `sources`, an
+ * ancestor's memory, until it first needs the page for itself. `parent` and
+ * `refs` keep those ancestors alive.
+ *
+ * A `PAGE_PACKED` page lives in `packs` instead of `mem`, packed against the
+ * image (see `do_pack_vm` in `arena.h`).
+ *
+ * `deadline` is that of the run in progress, which `TRAP_SLEEP` does not
+ * wait past. */
+struct Vm {
+    u16          memory[MEM_SIZE];
+    u16*         mem;
+    u16          reg[R_SIZE];
+    u8           pages[PAGE_COUNT];
+    u64          dirty[PAGE_COUNT / 64];
+    const u64*   watches;
+    u16          watch_address;
+    u8*          coverage;
+    u16          prev_location;
+    CallStack*   calls;
+    u8           engine;
+    const u64*   code_words;
+    u32          generations[PAGE_COUNT];
+    u16          stale_address;
+    Bool         stale;
+    u16          core;
+    u16          core_count;
+    const u16*   sources[PAGE_COUNT];
+    u16*         packs[PAGE_COUNT];
+    Vm*          parent;
+    u32          refs;
+    Status       status;
+    u64          deadline;
+    const Image* image;
+    const Io*    io;
+    void*        io_data;
+    Bool (*trap)(Vm*, Trap);
+};
+
+typedef struct {
+    const u8* input;
+    usize     input_len;
+    usize     input_index;
+    u8*       output;
+    usize     output_len;
+    usize     output_cap;
+} Buffers;
 
 static TermIos TERMINAL;
 
-static void set_flags(Register r) {
-    if (REG[r] == 0) {
-        REG[R_COND] = FL_ZERO;
-    } else if (REG[r] >> 15) {
-        /* NOTE: A `1` in the left-most bit indicates negative. */
-        REG[R_COND] = FL_NEG;
-    } else {
-        REG[R_COND] = FL_POS;
-    }
+/* NOTE: Set on `SIGINT` once `set_run_interrupt` is in place. Runs check it
+ * once per batch, and waits in `TRAP_SLEEP` as they go, and stop with
+ * `INTERRUPTED`, which lets the caller hand over everything the guest wrote
+ * before it exits. */
+static volatile sig_atomic_t INTERRUPT = 0;
+
+static u64 get_monotonic_ns(void) {
+    TimeSpec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return ((u64)time.tv_sec * SECOND_NS) + (u64)time.tv_nsec;
+}
+
+/* NOTE: The host's own time stamp counter, and milliseconds of its
+ * monotonic clock. Neither starts anywhere in particular. */
+static u64 get_host_clock(Vm* vm, Clock clock) {
+    return clock == CLOCK_CYCLES ? __rdtsc()
+                                 : get_monotonic_ns() / MILLISECOND_NS;
 }
 
-static Bool poll_keyboard(void) {
+static i32 get_stdio_char(Vm* vm) {
+    return getchar();
+}
+
+static Bool poll_stdio_char(Vm* vm) {
     FdSet file_descriptors;
     FD_ZERO(&file_descriptors);
     FD_SET(STDIN_FILENO, &file_descriptors);
     TimeVal timeout;
     timeout.tv_sec = 0;
     timeout.tv_usec = 0;
-    return select(1, &file_descriptors, NULL, NULL, &timeout) != 0;
+    return 0 < select(1, &file_descriptors, NULL, NULL, &timeout);
+}
+
+static void put_stdio_char(Vm* vm, char x) {
+    putc(x, stdout);
+}
+
+static void flush_stdio(Vm* vm) {
+    fflush(stdout);
+}
+
+/* NOTE: Another signal, such as the profiler's `SIGPROF`, only has the wait
+ * go round again. */
+static Bool wait_stdio_char(Vm* vm, u64 deadline) {
+    for (;;) {
+        const u64 now = get_host_clock(vm, CLOCK_MS);
+        const u64 wait = now < deadline ? deadline - now : 0;
+        const u64 slice = wait < WAIT_SLICE_MS ? wait : WAIT_SLICE_MS;
+        FdSet     file_descriptors;
+        FD_ZERO(&file_descriptors);
+        FD_SET(STDIN_FILENO, &file_descriptors);
+        TimeVal timeout;
+        timeout.tv_sec = (time_t)(slice / 1000);
+        timeout.tv_usec = (suseconds_t)((slice % 1000) * 1000);
+        const i32 n = select(1, &file_descriptors, NULL, NULL, &timeout);
+        if (0 < n) {
+            return TRUE;
+        }
+        if (INTERRUPT || ((n == 0) && (wait <= slice)) ||
+            ((n == -1) && (errno != EINTR)))
+        {
+            return FALSE;
+        }
+    }
+}
+
+static const Io IO_STDIO = {
+    get_stdio_char,
+    poll_stdio_char,
+    put_stdio_char,
+    flush_stdio,
+    get_host_clock,
+    wait_stdio_char,
+};
+
+static i32 get_buffers_char(Vm* vm) {
+    Buffers* buffers = vm->io_data;
+    if (buffers->input_len <= buffers->input_index) {
+        return EOF;
+    }
+    return buffers->input[buffers->input_index++];
+}
+
+static Bool poll_buffers_char(Vm* vm) {
+    const Buffers* buffers = vm->io_data;
+    return buffers->input_index < buffers->input_len;
+}
+
+static void put_buffers_char(Vm* vm, char x) {
+    Buffers* buffers = vm->io_data;
+    if (buffers->output_cap <= buffers->output_len) {
+        buffers->output_cap =
+            buffers->output_cap ? buffers->output_cap << 1 : 1 << 12;
+        buffers->output = realloc(buffers->output, buffers->output_cap);
+        if (buffers->output == NULL) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    buffers->output[buffers->output_len++] = (u8)x;
+}
+
+static void flush_buffers(Vm* vm) {
+}
+
+/* NOTE: All the input there will be is there from the start, so there is
+ * nothing to wait for. */
+static Bool wait_buffers_char(Vm* vm, u64 deadline) {
+    return poll_buffers_char(vm);
+}
+
+static const Io IO_BUFFERS = {
+    get_buffers_char,
+    poll_buffers_char,
+    put_buffers_char,
+    flush_buffers,
+    get_host_clock,
+    wait_buffers_char,
+};
+
+/* NOTE: For a guest reading `Buffers` that is blocked rather than given
+ * `EOF` once they run dry. It blocks before `TRAP_GETC` or `TRAP_IN` runs,
+ * so `TRAP_IN` does not write its prompt again when the trap runs again. */
+static Bool handle_buffers_trap(Vm* vm, Trap trap) {
+    if (((trap == TRAP_GETC) || (trap == TRAP_IN)) &&
+        !poll_buffers_char(vm))
+    {
+        vm->status = BLOCKED;
+        --vm->reg[R_PC];
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* NOTE: Where a sleep of `wait` milliseconds from `now` ends, cut short at
+ * the run's own deadline. */
+static u64 get_sleep_end(const Vm* vm, u64 now, u64 wait) {
+    if (vm->deadline) {
+        const u64 at = get_monotonic_ns();
+        const u64 left =
+            at < vm->deadline
+                ? (vm->deadline - at + MILLISECOND_NS - 1) / MILLISECOND_NS
+                : 0;
+        wait = left < wait ? left : wait;
+    }
+    return now + wait;
+}
+
+static void put_str(Vm* vm, const char* string) {
+    for (; *string; ++string) {
+        vm->io->put_char(vm, *string);
+    }
+}
+
+static void set_flags(Vm* vm, Register r) {
+    if (vm->reg[r] == 0) {
+        vm->reg[R_COND] = FL_ZERO;
+    } else if (vm->reg[r] >> 15) {
+        /* NOTE: A `1` in the left-most bit indicates negative. */
+        vm->reg[R_COND] = FL_NEG;
+    } else {
+        vm->reg[R_COND] = FL_POS;
+    }
 }
 
-static u16 get_mem_at(u16 address) {
-    if (address == KEYBOARD_STATUS) {
-        if (poll_keyboard()) {
-            MEM[KEYBOARD_STATUS] = (1 << 15);
-            MEM[KEYBOARD_DATA] = (u16)getchar();
+/* NOTE: A compiler thread (see `tier.h`) reads `pages` and `mem` while the
+ * guest runs, and cores (see `cores.h`) share `mem`, so the guest changes
+ * them with atomic stores and reads `mem` with atomic loads. Relaxed ones
+ * are plain moves on x86; a block decoded from words that have since
+ * changed is caught by `do_install_block`. */
+static void set_page_flags(Vm* vm, u8 page, u8 flags) {
+    __atomic_store_n(&vm->pages[page], flags, __ATOMIC_RELAXED);
+}
+
+/* NOTE: Gives a fork its own copy of a page it has been sharing. The flag
+ * is released after the copy, so a thread that sees it gone also sees the
+ * words. */
+static void do_own_page(Vm* vm, u8 page) {
+    memcpy(&vm->mem[page << PAGE_BITS],
+           vm->sources[page],
+           PAGE_SIZE * sizeof(u16));
+    __atomic_store_n(&vm->pages[page],
+                     (u8)(vm->pages[page] & ~PAGE_SHARED),
+                     __ATOMIC_RELEASE);
+}
+
+/* NOTE: Puts a packed page back in `mem`. */
+static void do_unpack_page(Vm* vm, u8 page) {
+    do_unpack(vm->packs[page],
+              &vm->image->mem[page << PAGE_BITS],
+              PAGE_SIZE,
+              &vm->mem[page << PAGE_BITS]);
+    free(vm->packs[page]);
+    vm->packs[page] = NULL;
+    __atomic_store_n(&vm->pages[page],
+                     (u8)(vm->pages[page] & ~PAGE_PACKED),
+                     __ATOMIC_RELEASE);
+}
+
+static void do_unpack_vm(Vm* vm) {
+    for (u32 i = 0; i < PAGE_COUNT; ++i) {
+        if (vm->pages[i] & PAGE_PACKED) {
+            do_unpack_page(vm, (u8)i);
+        }
+    }
+}
+
+/* NOTE: Reads memory without going through the devices, for anything that
+ * would otherwise index `mem` directly. Packed pages are read in place, so
+ * this never changes `vm`. */
+static u16 get_word_at(const Vm* vm, u16 address) {
+    const u8 page = (u8)(address >> PAGE_BITS);
+    if (vm->pages[page] & (PAGE_SHARED | PAGE_PACKED)) {
+        if (vm->pages[page] & PAGE_PACKED) {
+            return get_unpacked(vm->packs[page],
+                                &vm->image->mem[page << PAGE_BITS],
+                                address & (PAGE_SIZE - 1));
+        }
+        return vm->sources[page][address & (PAGE_SIZE - 1)];
+    }
+    return __atomic_load_n(&vm->mem[address], __ATOMIC_RELAXED);
+}
+
+/* NOTE: `get_word_at` for another thread than the guest's. It must not be
+ * given a packed page, which the guest may unpack and free under it. */
+static u16 get_word_relaxed(const Vm* vm, u16 address) {
+    const u8 page = (u8)(address >> PAGE_BITS);
+    if (__atomic_load_n(&vm->pages[page], __ATOMIC_ACQUIRE) & PAGE_SHARED) {
+        return vm->sources[page][address & (PAGE_SIZE - 1)];
+    }
+    return __atomic_load_n(&vm->mem[address], __ATOMIC_RELAXED);
+}
+
+static void do_touch_page(Vm* vm, u16 address) {
+    const u8 page = (u8)(address >> PAGE_BITS);
+    /* NOTE: Forks read a frozen VM's memory in place, so it must never
+     * change under them. The store is not made, and the guest stops. */
+    if (vm->pages[page] & PAGE_FROZEN) {
+        vm->status = FAULTED;
+        return;
+    }
+    if (vm->pages[page] & PAGE_SHARED) {
+        do_own_page(vm, page);
+    }
+    if (vm->pages[page] & PAGE_PACKED) {
+        do_unpack_page(vm, page);
+    }
+    if ((vm->pages[page] & PAGE_WATCH) &&
+        ((vm->watches[address >> 6] >> (address & 0x3F)) & 1))
+    {
+        vm->watch_address = address;
+        vm->status = STOPPED;
+    }
+    /* NOTE: Storing over a word that has been decoded into a block leaves
+     * that block stale. The page's generation moves on, and `stale` stops
+     * whatever is running so the blocks covering `address` can be dropped
+     * before anything runs them again. */
+    if ((vm->pages[page] & PAGE_CODE) &&
+        ((vm->code_words[address >> 6] >> (address & 0x3F)) & 1))
+    {
+        ++vm->generations[page];
+        vm->stale_address = address;
+        vm->stale = TRUE;
+    }
+    set_page_flags(vm, page, (u8)(vm->pages[page] | PAGE_DIRTY));
+    vm->dirty[page >> 6] |= 1llu << (page & 0x3F);
+}
+
+static void set_mem_at(Vm* vm, u16 address, u16 value) {
+    /* NOTE: Once a page is dirty further stores to it take no extra work,
+     * unless the page is also being watched or shared. */
+    if (vm->pages[address >> PAGE_BITS] != PAGE_DIRTY) {
+        do_touch_page(vm, address);
+        if (vm->status == FAULTED) {
+            return;
+        }
+    }
+    __atomic_store_n(&vm->mem[address], value, __ATOMIC_RELAXED);
+}
+
+static u16 get_device_at(Vm* vm, u16 address) {
+    switch (address) {
+    case KEYBOARD_STATUS: {
+        if (vm->io->poll_char(vm)) {
+            set_mem_at(vm, KEYBOARD_STATUS, 1 << 15);
+            set_mem_at(vm, KEYBOARD_DATA, (u16)vm->io->get_char(vm));
         } else {
-            MEM[KEYBOARD_STATUS] = 0;
+            set_mem_at(vm, KEYBOARD_STATUS, 0);
+        }
+        return __atomic_load_n(&vm->mem[address], __ATOMIC_RELAXED);
+    }
+    case CORE_ID: {
+        return vm->core;
+    }
+    case CORE_COUNT: {
+        return vm->core_count;
+    }
+    /* NOTE: Reading the low word of a timer latches its high word, so the
+     * two make up one 32-bit reading. */
+    case TIMER_CYCLES:
+    case TIMER_MS: {
+        const u64 time = vm->io->get_clock(
+            vm,
+            address == TIMER_CYCLES ? CLOCK_CYCLES : CLOCK_MS);
+        set_mem_at(vm, (u16)(address + 2), (u16)(time >> 16));
+        return (u16)time;
+    }
+    default: {
+        return get_word_at(vm, address);
+    }
+    }
+}
+
+/* NOTE: Device registers sit on pages of their own, flagged with
+ * `PAGE_DEVICE`, so every fetch and load gets past them, shared pages and
+ * packed pages with a single test. */
+static u16 get_mem_at(Vm* vm, u16 address) {
+    if (vm->pages[address >> PAGE_BITS] &
+        (PAGE_SHARED | PAGE_DEVICE | PAGE_PACKED))
+    {
+        if (vm->pages[address >> PAGE_BITS] & PAGE_PACKED) {
+            do_unpack_page(vm, (u8)(address >> PAGE_BITS));
+        }
+        if (KEYBOARD_STATUS <= address) {
+            return get_device_at(vm, address);
         }
+        return get_word_at(vm, address);
+    }
+    return __atomic_load_n(&vm->mem[address], __ATOMIC_RELAXED);
+}
+
+static void set_device_pages(Vm* vm) {
+    for (u32 i = KEYBOARD_STATUS >> PAGE_BITS; i < PAGE_COUNT; ++i) {
+        vm->pages[i] |= PAGE_DEVICE;
+    }
+}
+
+/* NOTE: Records the edge into the current `R_PC` the way AFL does, as a hit
+ * count at the hash of the edge's two ends. */
+static void do_cover(Vm* vm) {
+    const u16 location = (u16)(vm->reg[R_PC] * 0x9E37u);
+    const u16 edge = location ^ vm->prev_location;
+    const u8  count = (u8)(vm->coverage[edge] + 1);
+    vm->coverage[edge] = count ? count : 1;
+    vm->prev_location = location >> 1;
+}
+
+static void do_call(Vm* vm) {
+    CallStack* calls = vm->calls;
+    if (calls->depth < CALL_CAP) {
+        calls->frames[calls->depth] = vm->reg[R_PC];
     }
-    return MEM[address];
+    ++calls->depth;
 }
 
-static void do_op_branch(u16 instr) {
+static void do_return(Vm* vm) {
+    if (vm->calls->depth) {
+        --vm->calls->depth;
+    }
+}
+
+static void do_op_branch(Vm* vm, u16 instr) {
     // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
     // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
     // | 0   0   0   0 | N | Z | P |             PC_OFFSET             |
     // +---------------+---+---+---+-----------------------------------+
-    if (REG[R_COND] & get_r0_or_nzp(instr)) {
-        REG[R_PC] = (u16)(REG[R_PC] + get_pc_offset_9(instr));
+    if (vm->reg[R_COND] & get_r0_or_nzp(instr)) {
+        vm->reg[R_PC] = (u16)(vm->reg[R_PC] + get_pc_offset_9(instr));
+    }
+    if (vm->coverage) {
+        do_cover(vm);
     }
 }
 
-static void do_op_add(u16 instr) {
+static void do_op_add(Vm* vm, u16 instr) {
     const u8 r0 = get_r0_or_nzp(instr);
     const u8 r1 = get_r1(instr);
     if (get_immediate_mode(instr)) {
@@ -63,53 +516,62 @@ static void do_op_add(u16 instr) {
         // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
         // | 0   0   0   1 |     R0    |     R1    | 1 |     IMMEDIATE     |
         // +---------------+-----------+-----------+---+-------------------+
-        REG[r0] = (u16)(REG[r1] + get_immediate(instr));
+        vm->reg[r0] = (u16)(vm->reg[r1] + get_immediate(instr));
     } else {
         // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
         // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
         // | 0   0   0   1 |     R0    |     R1    | 0 |  NULL |     R2    |
         // +---------------+-----------+-----------+---+-------+-----------+
-        REG[r0] = (u16)(REG[r1] + REG[get_r2(instr)]);
+        vm->reg[r0] = (u16)(vm->reg[r1] + vm->reg[get_r2(instr)]);
     }
-    set_flags(r0);
+    set_flags(vm, r0);
 }
 
-static void do_op_load(u16 instr) {
+static void do_op_load(Vm* vm, u16 instr) {
     // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
     // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
     // | 0   0   1   0 |     R0    |             PC_OFFSET             |
     // +---------------+-----------+-----------------------------------+
     const u8 r0 = get_r0_or_nzp(instr);
-    REG[r0] = get_mem_at((u16)(REG[R_PC] + get_pc_offset_9(instr)));
-    set_flags(r0);
+    vm->reg[r0] =
+        get_mem_at(vm, (u16)(vm->reg[R_PC] + get_pc_offset_9(instr)));
+    set_flags(vm, r0);
 }
 
-static void do_op_store(u16 instr) {
+static void do_op_store(Vm* vm, u16 instr) {
     // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
     // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
     // | 0   0   1   1 |     R0    |             PC_OFFSET             |
     // +---------------+-----------+-----------------------------------+
-    MEM[REG[R_PC] + get_pc_offset_9(instr)] = REG[get_r0_or_nzp(instr)];
+    set_mem_at(vm,
+               (u16)(vm->reg[R_PC] + get_pc_offset_9(instr)),
+               vm->reg[get_r0_or_nzp(instr)]);
 }
 
-static void do_op_jump_subroutine(u16 instr) {
-    REG[R_7] = REG[R_PC];
+static void do_op_jump_subroutine(Vm* vm, u16 instr) {
+    vm->reg[R_7] = vm->reg[R_PC];
     if (get_relative_mode(instr)) {
         // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
         // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
         // | 0   1   0   0 | 1 |                 PC_OFFSET                 |
         // +---------------+---+-------------------------------------------+
-        REG[R_PC] = (u16)(REG[R_PC] + get_pc_offset_11(instr));
+        vm->reg[R_PC] = (u16)(vm->reg[R_PC] + get_pc_offset_11(instr));
     } else {
         // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
         // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
         // | 0   1   0   0 | 0 |  NULL |     R1    |          NULL         |
         // +---------------+---+-------+-----------+-----------------------+
-        REG[R_PC] = REG[get_r1(instr)];
+        vm->reg[R_PC] = vm->reg[get_r1(instr)];
+    }
+    if (vm->coverage) {
+        do_cover(vm);
+    }
+    if (vm->calls) {
+        do_call(vm);
     }
 }
 
-static void do_op_and(u16 instr) {
+static void do_op_and(Vm* vm, u16 instr) {
     const u8 r0 = get_r0_or_nzp(instr);
     const u8 r1 = get_r1(instr);
     if (get_immediate_mode(instr)) {
@@ -117,190 +579,281 @@ static void do_op_and(u16 instr) {
         // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
         // | 0   1   0   1 |     R0    |     R1    | 1 |     IMMEDIATE     |
         // +---------------+-----------+-----------+---+-------------------+
-        REG[r0] = (u16)(REG[r1] & get_immediate(instr));
+        vm->reg[r0] = (u16)(vm->reg[r1] & get_immediate(instr));
     } else {
         // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
         // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
         // | 0   1   0   1 |     R0    |     R1    | 0 |  NULL |     R2    |
         // +---------------+-----------+-----------+---+-------+-----------+
-        REG[r0] = (u16)(REG[r1] & REG[get_r2(instr)]);
+        vm->reg[r0] = (u16)(vm->reg[r1] & vm->reg[get_r2(instr)]);
     }
-    set_flags(r0);
+    set_flags(vm, r0);
 }
 
-static void do_op_load_register(u16 instr) {
+static void do_op_load_register(Vm* vm, u16 instr) {
     // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
     // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
     // | 0   1   1   0 |     R0    |     R1    |         OFFSET        |
     // +---------------+-----------+-----------+-----------------------+
     const u8 r0 = get_r0_or_nzp(instr);
-    REG[r0] = get_mem_at((u16)(REG[get_r1(instr)] + get_reg_offset_6(instr)));
-    set_flags(r0);
+    vm->reg[r0] = get_mem_at(
+        vm,
+        (u16)(vm->reg[get_r1(instr)] + get_reg_offset_6(instr)));
+    set_flags(vm, r0);
 }
 
-static void do_op_store_register(u16 instr) {
+static void do_op_store_register(Vm* vm, u16 instr) {
     // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
     // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
     // | 0   1   1   1 |     R0    |     R1    |         OFFSET        |
     // +---------------+-----------+-----------+-----------------------+
-    MEM[REG[get_r1(instr)] + get_reg_offset_6(instr)] =
-        REG[get_r0_or_nzp(instr)];
+    set_mem_at(vm,
+               (u16)(vm->reg[get_r1(instr)] + get_reg_offset_6(instr)),
+               vm->reg[get_r0_or_nzp(instr)]);
 }
 
-static void do_op_not(u16 instr) {
+static void do_op_not(Vm* vm, u16 instr) {
     // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
     // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
     // | 1   0   0   1 |     R0    |     R1    |          NULL         |
     // +---------------+-----------+-----------+-----------------------+
     const u8 r0 = get_r0_or_nzp(instr);
-    REG[r0] = (u16)(~REG[get_r1(instr)]);
-    set_flags(r0);
+    vm->reg[r0] = (u16)(~vm->reg[get_r1(instr)]);
+    set_flags(vm, r0);
 }
 
-static void do_op_load_indirect(u16 instr) {
+static void do_op_load_indirect(Vm* vm, u16 instr) {
     // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
     // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
     // | 1   0   1   0 |     R0    |             PC_OFFSET             |
     // +---------------+-----------+-----------------------------------+
     const u8 r0 = get_r0_or_nzp(instr);
-    REG[r0] =
-        get_mem_at(get_mem_at((u16)(REG[R_PC] + get_pc_offset_9(instr))));
-    set_flags(r0);
+    vm->reg[r0] = get_mem_at(
+        vm,
+        get_mem_at(vm, (u16)(vm->reg[R_PC] + get_pc_offset_9(instr))));
+    set_flags(vm, r0);
 }
 
-static void do_op_store_indirect(u16 instr) {
+static void do_op_store_indirect(Vm* vm, u16 instr) {
     // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
     // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
     // | 1   0   1   1 |     R0    |             PC_OFFSET             |
     // +---------------+-----------+-----------------------------------+
-    MEM[get_mem_at((u16)(REG[R_PC] + get_pc_offset_9(instr)))] =
-        REG[get_r0_or_nzp(instr)];
+    set_mem_at(
+        vm,
+        get_mem_at(vm, (u16)(vm->reg[R_PC] + get_pc_offset_9(instr))),
+        vm->reg[get_r0_or_nzp(instr)]);
 }
 
-static void do_op_jump(u16 instr) {
+static void do_op_jump(Vm* vm, u16 instr) {
     // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
     // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
     // | 1   1   0   0 |    NULL   |     R1    |          NULL         |
     // +---------------+-----------+-----------------------------------+
-    REG[R_PC] = REG[get_r1(instr)];
+    vm->reg[R_PC] = vm->reg[get_r1(instr)];
+    if (vm->coverage) {
+        do_cover(vm);
+    }
+    if (vm->calls && (get_r1(instr) == R_7)) {
+        do_return(vm);
+    }
 }
 
-static void do_op_load_effective_address(u16 instr) {
+static void do_op_load_effective_address(Vm* vm, u16 instr) {
     // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
     // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
     // | 1   1   1   0 |     R0    |             PC_OFFSET             |
     // +---------------+-----------+-----------------------------------+
     const u8 r0 = get_r0_or_nzp(instr);
-    REG[r0] = (u16)(REG[R_PC] + get_pc_offset_9(instr));
-    set_flags(r0);
+    vm->reg[r0] = (u16)(vm->reg[R_PC] + get_pc_offset_9(instr));
+    set_flags(vm, r0);
 }
 
-static void do_op_trap(u16 instr) {
+static void do_op_trap(Vm* vm, u16 instr) {
     // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
     // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
     // | 1   1   1   1 |      NULL     |              TRAP             |
     // +---------------+---------------+-------------------------------+
+    if (vm->trap && vm->trap(vm, get_trap(instr))) {
+        return;
+    }
     switch (get_trap(instr)) {
     case TRAP_GETC: {
-        REG[R_0] = (u16)getchar();
+        vm->reg[R_0] = (u16)vm->io->get_char(vm);
         break;
     }
     case TRAP_OUT: {
-        putc((char)REG[R_0], stdout);
-        fflush(stdout);
+        vm->io->put_char(vm, (char)vm->reg[R_0]);
+        vm->io->flush(vm);
         break;
     }
     case TRAP_PUTS: {
-        for (u16* x = MEM + REG[R_0]; *x; ++x) {
-            putc((char)*x, stdout);
+        for (u16 address = vm->reg[R_0]; get_word_at(vm, address);
+             ++address)
+        {
+            vm->io->put_char(vm, (char)get_word_at(vm, address));
         }
-        fflush(stdout);
+        vm->io->flush(vm);
         break;
     }
     case TRAP_IN: {
-        printf("Enter a character: ");
-        const char x = (char)getchar();
-        putc(x, stdout);
-        REG[R_0] = (u16)x;
+        put_str(vm, "Enter a character: ");
+        const char x = (char)vm->io->get_char(vm);
+        vm->io->put_char(vm, x);
+        vm->reg[R_0] = (u16)x;
         break;
     }
     case TRAP_PUTSP: {
-        for (u16* x = MEM + REG[R_0]; *x; ++x) {
-            const char a = (char)((*x) & 0xFF);
-            putc(a, stdout);
-            const char b = (char)((*x) >> 8);
+        for (u16 address = vm->reg[R_0]; get_word_at(vm, address);
+             ++address)
+        {
+            const u16  word = get_word_at(vm, address);
+            const char a = (char)(word & 0xFF);
+            vm->io->put_char(vm, a);
+            const char b = (char)(word >> 8);
             if (b) {
-                putc(b, stdout);
+                vm->io->put_char(vm, b);
             }
         }
-        fflush(stdout);
+        vm->io->flush(vm);
         break;
     }
     case TRAP_HALT: {
-        puts("HALT");
-        fflush(stdout);
-        STATUS = DEAD;
+        put_str(vm, "HALT\n");
+        vm->io->flush(vm);
+        vm->status = DEAD;
+        break;
+    }
+    case TRAP_SLEEP: {
+        /* NOTE: Waits until the low word of `TIMER_MS` reaches `R_0`, or
+         * until there is input, and leaves `R_0` as `KEYBOARD_STATUS`
+         * would read. A deadline up to half the clock's range behind is
+         * already past, so a guest pacing frames can keep adding to the
+         * same deadline. A host that blocks the guest rather than wait
+         * puts `R_PC` back on the trap, which then needs `R_0` as it was.
+         *
+         * A sleep stops early at the run's deadline or on `SIGINT`, and the
+         * run stops with it rather than at the end of its batch. */
+        const u64  now = vm->io->get_clock(vm, CLOCK_MS);
+        const i16  wait = (i16)(vm->reg[R_0] - (u16)now);
+        const Bool ready =
+            (0 < wait) && !INTERRUPT
+                ? vm->io->wait_char(vm, get_sleep_end(vm, now, (u64)wait))
+                : vm->io->poll_char(vm);
+        if (vm->status != BLOCKED) {
+            vm->reg[R_0] = ready ? 1 << 15 : 0;
+        }
+        if (vm->status != ALIVE) {
+            break;
+        }
+        if (INTERRUPT) {
+            vm->status = INTERRUPTED;
+        } else if (vm->deadline && (vm->deadline <= get_monotonic_ns())) {
+            vm->status = EXPIRED;
+        }
+        break;
+    }
+    case TRAP_CAS: {
+        /* NOTE: Swaps `R_2` into the word at `R_0` if it holds `R_1`, and
+         * leaves the word's old value in `R_0`; it was swapped if that
+         * equals `R_1`. The swap is sequentially consistent and also acts
+         * as a full fence for the loads and stores around it. */
+        const u16 address = vm->reg[R_0];
+        u16       expected = vm->reg[R_1];
+        if (vm->pages[address >> PAGE_BITS] &
+            (PAGE_SHARED | PAGE_FROZEN | PAGE_PACKED))
+        {
+            do_touch_page(vm, address);
+            if (vm->status == FAULTED) {
+                break;
+            }
+        }
+        if (__atomic_compare_exchange_n(&vm->mem[address],
+                                        &expected,
+                                        vm->reg[R_2],
+                                        FALSE,
+                                        __ATOMIC_SEQ_CST,
+                                        __ATOMIC_SEQ_CST) &&
+            (vm->pages[address >> PAGE_BITS] != PAGE_DIRTY))
+        {
+            do_touch_page(vm, address);
+        }
+        vm->reg[R_0] = expected;
         break;
     }
     }
 }
 
-static void do_bin_instr(u16 instr) {
+static void do_op_breakpoint(Vm* vm, u16 instr) {
+    // | 15| 14| 13| 12| 11| 10| 9 | 8 | 7 | 6 | 5 | 4 | 3 | 2 | 1 | 0 |
+    // +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    // | 1   1   0   1 |                     NULL                      |
+    // +---------------+-----------------------------------------------+
+    /* NOTE: Rewind so the debugger sees the address of the breakpoint. */
+    --vm->reg[R_PC];
+    vm->status = STOPPED;
+}
+
+static void do_bin_instr(Vm* vm, u16 instr) {
     switch (get_op(instr)) {
     case OP_BR: {
-        do_op_branch(instr);
+        do_op_branch(vm, instr);
         break;
     }
     case OP_ADD: {
-        do_op_add(instr);
+        do_op_add(vm, instr);
         break;
     }
     case OP_LD: {
-        do_op_load(instr);
+        do_op_load(vm, instr);
         break;
     }
     case OP_ST: {
-        do_op_store(instr);
+        do_op_store(vm, instr);
         break;
     }
     case OP_JSR: {
-        do_op_jump_subroutine(instr);
+        do_op_jump_subroutine(vm, instr);
         break;
     }
     case OP_AND: {
-        do_op_and(instr);
+        do_op_and(vm, instr);
         break;
     }
     case OP_LDR: {
-        do_op_load_register(instr);
+        do_op_load_register(vm, instr);
         break;
     }
     case OP_STR: {
-        do_op_store_register(instr);
+        do_op_store_register(vm, instr);
         break;
     }
     case OP_NOT: {
-        do_op_not(instr);
+        do_op_not(vm, instr);
         break;
     }
     case OP_LDI: {
-        do_op_load_indirect(instr);
+        do_op_load_indirect(vm, instr);
         break;
     }
     case OP_STI: {
-        do_op_store_indirect(instr);
+        do_op_store_indirect(vm, instr);
         break;
     }
     case OP_JMP: {
-        do_op_jump(instr);
+        do_op_jump(vm, instr);
         break;
     }
     case OP_LEA: {
-        do_op_load_effective_address(instr);
+        do_op_load_effective_address(vm, instr);
         break;
     }
     case OP_TRAP: {
-        do_op_trap(instr);
+        do_op_trap(vm, instr);
+        break;
+    }
+    case OP_RES: {
+        do_op_breakpoint(vm, instr);
         break;
     }
     }
@@ -323,22 +876,133 @@ static void handle_interrupt(i32 _) {
     exit(EXIT_FAILURE);
 }
 
-static void set_bytecode(File* file) {
-    u16 origin;
-    if (fread(&origin, sizeof(u16), 1, file) == 0) {
+static void handle_run_interrupt(i32 _) {
+    INTERRUPT = 1;
+}
+
+/* NOTE: Without `SA_RESTART`, so a guest blocked reading `stdin` gets `EOF`
+ * and reaches the end of its batch. The handler it replaces is left in
+ * `previous`, unless that is `NULL`. */
+static void set_run_interrupt(SigAction* previous) {
+    SigAction action = {0};
+    action.sa_handler = handle_run_interrupt;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGINT, &action, previous) == -1) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* NOTE: Returns the number of words loaded at `origin`. */
+static usize set_bytecode(Image* image, File* file, u16* origin) {
+    if (fread(origin, sizeof(u16), 1, file) == 0) {
         exit(EXIT_FAILURE);
     }
     /* NOTE: See `https://gcc.gnu.org/onlinedocs/gcc/Other-Builtins.html`. */
-    origin = __builtin_bswap16(origin);
-    u16*  index = MEM + origin;
-    usize bytes = fread(index, sizeof(u16), (usize)(U16_MAX - origin), file);
-    if (bytes == 0) {
+    *origin = __builtin_bswap16(*origin);
+    u16*        index = image->mem + *origin;
+    const usize len =
+        fread(index, sizeof(u16), (usize)(U16_MAX - *origin), file);
+    if (len == 0) {
         exit(EXIT_FAILURE);
     }
-    while (0 < bytes--) {
-        *index = __builtin_bswap16(*index);
-        ++index;
+    for (usize i = 0; i < len; ++i) {
+        index[i] = __builtin_bswap16(index[i]);
+    }
+    return len;
+}
+
+static void set_vm(Vm* vm, const Image* image) {
+    for (u32 i = 0; i < PAGE_COUNT; ++i) {
+        free(vm->packs[i]);
+        vm->packs[i] = NULL;
+    }
+    memcpy(vm->mem, image->mem, MEM_SIZE * sizeof(u16));
+    memset(vm->reg, 0, sizeof(vm->reg));
+    memset(vm->pages, 0, sizeof(vm->pages));
+    set_device_pages(vm);
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    vm->reg[R_PC] = PC_START;
+    vm->status = ALIVE;
+    vm->image = image;
+    vm->code_words = NULL;
+    vm->stale = FALSE;
+}
+
+/* NOTE: Decoded blocks survive a reset unless one of their words is about
+ * to be copied back to something else, in which case the page moves on to a
+ * new generation. */
+static void do_check_code(Vm* vm, u8 page) {
+    const u16 start = (u16)(page << PAGE_BITS);
+    for (u16 i = 0; i < (PAGE_SIZE / 64); ++i) {
+        const u16 base = (u16)(start + (i << 6));
+        for (u64 bits = vm->code_words[base >> 6]; bits; bits &= bits - 1) {
+            const u16 address = (u16)(base + __builtin_ctzll(bits));
+            if (get_word_at(vm, address) != vm->image->mem[address]) {
+                ++vm->generations[page];
+                return;
+            }
+        }
+    }
+}
+
+/* NOTE: Returns `vm` to the state `set_vm` left it in, copying back only the
+ * pages stored to since then. */
+static void do_reset_vm(Vm* vm) {
+    for (u8 i = 0; i < (PAGE_COUNT / 64); ++i) {
+        for (u64 bits = vm->dirty[i]; bits; bits &= bits - 1) {
+            const u8 page = (u8)((i << 6) | __builtin_ctzll(bits));
+            if (vm->pages[page] & PAGE_CODE) {
+                do_check_code(vm, page);
+            }
+            memcpy(&vm->mem[page << PAGE_BITS],
+                   &vm->image->mem[page << PAGE_BITS],
+                   PAGE_SIZE * sizeof(u16));
+            free(vm->packs[page]);
+            vm->packs[page] = NULL;
+            vm->pages[page] = (u8)(vm->pages[page] &
+                                   ~(PAGE_DIRTY | PAGE_SHARED | PAGE_PACKED));
+        }
+        vm->dirty[i] = 0;
+    }
+    memset(vm->reg, 0, sizeof(vm->reg));
+    vm->reg[R_PC] = PC_START;
+    vm->status = ALIVE;
+}
+
+static u64 get_deadline(u64 timeout_ms) {
+    return timeout_ms ? get_monotonic_ns() + (timeout_ms * MILLISECOND_NS)
+                      : 0;
+}
+
+/* NOTE: Runs until the guest halts, `budget` instructions have executed,
+ * the monotonic clock passes `deadline` (in nanoseconds, `0` for none) or
+ * `INTERRUPT` is set. The clock and `INTERRUPT` are only checked once per
+ * batch of `BATCH_SIZE` instructions; the price of the exact budget is one
+ * extra `i < batch` compare per instruction on top of the status test. */
+static u64 run_vm(Vm* vm, u64 budget, u64 deadline) {
+    u64 n = 0;
+    vm->deadline = deadline;
+    while (vm->status == ALIVE) {
+        if (budget <= n) {
+            vm->status = EXHAUSTED;
+            break;
+        }
+        if (deadline && (deadline <= get_monotonic_ns())) {
+            vm->status = EXPIRED;
+            break;
+        }
+        if (INTERRUPT) {
+            vm->status = INTERRUPTED;
+            break;
+        }
+        const u64 batch = budget - n < BATCH_SIZE ? budget - n : BATCH_SIZE;
+        u64       i = 0;
+        for (; (i < batch) && (vm->status == ALIVE); ++i) {
+            do_bin_instr(vm, get_mem_at(vm, vm->reg[R_PC]++));
+        }
+        n += i;
     }
+    return n;
 }
 
 #endif